@@ -0,0 +1,550 @@
+#include "stdafx.h"
+#include "cpu.h"
+#include "memdescr.h"
+#include "interrupts.h"
+#include "vga.h"
+#include "disk.h"
+#include "pic_pit.h"
+#include "bench.h"
+
+// Synthetic instruction streams run through the real step() / instrs[] path
+// plus direct calls into the device models. Every case reports ns/op.
+
+#define BENCH_REAL			0
+#define BENCH_PMODE			1
+#define BENCH_PAGING		2
+
+// Guest memory layout used by the CPU cases
+#define BENCH_GDT			0x00800u
+#define BENCH_IDT			0x01000u
+#define BENCH_CODE			0x10000u
+#define BENCH_IRET			0x1F000u
+#define BENCH_RETF			0x1F010u
+#define BENCH_DATA			0x20000u
+#define BENCH_STACK			0x4FFF0u
+#define BENCH_PDIR			0x90000u
+#define BENCH_PTAB			0x91000u
+
+#define BENCH_CODE_SIZE		1024
+
+#define BENCH_CPU_OPS		2000000u
+#define BENCH_DEVICE_OPS	2000000u
+#define BENCH_FRAMES		50u
+#define BENCH_REPEAT		3
+
+typedef struct
+{
+	const char *name;
+	int mode;
+	unsigned char code[16];
+	int length;
+} bench_code_t;
+
+typedef struct
+{
+	const char *name;
+	const char *group;
+	void (*setup)(const void *arg);
+	void (*run)(unsigned int n);
+	const void *arg;
+	unsigned int ops;
+} bench_t;
+
+typedef struct
+{
+	double best;
+	double mean;
+	int exceptions;
+} bench_result_t;
+
+// Instruction streams. Each one is repeated to fill BENCH_CODE_SIZE bytes
+// and closed with a jump back to its start.
+static const bench_code_t bench_codes[] =
+{
+	// ALU
+	{"alu_reg_reg",				BENCH_REAL,		{0x01, 0xD8}, 2},								// add ax, bx
+	{"alu_reg_mem",				BENCH_REAL,		{0x03, 0x07}, 2},								// add ax, [bx]
+	{"alu_mem_reg",				BENCH_REAL,		{0x01, 0x07}, 2},								// add [bx], ax
+	{"alu_reg_imm",				BENCH_REAL,		{0x05, 0x34, 0x12}, 3},							// add ax, 1234h
+	{"alu_reg_reg_32",			BENCH_REAL,		{0x66, 0x01, 0xD8}, 3},							// add eax, ebx
+	{"shift_reg",				BENCH_REAL,		{0xD1, 0xE0}, 2},								// shl ax, 1
+	{"mul_reg",					BENCH_REAL,		{0xF7, 0xE3}, 2},								// mul bx
+	{"mov_reg_imm",				BENCH_REAL,		{0xB8, 0x34, 0x12}, 3},							// mov ax, 1234h
+	{"push_pop",				BENCH_REAL,		{0x50, 0x58}, 2},								// push ax / pop ax
+	{"jcc_not_taken",			BENCH_REAL,		{0x74, 0x00}, 2},								// jz $+2 (ZF = 0)
+
+	// 16-bit effective addresses
+	{"modrm16_bx_si",			BENCH_REAL,		{0x8B, 0x00}, 2},								// mov ax, [bx+si]
+	{"modrm16_bp_di_disp8",		BENCH_REAL,		{0x8B, 0x43, 0x10}, 3},							// mov ax, [bp+di+10h]
+	{"modrm16_bx_disp16",		BENCH_REAL,		{0x8B, 0x87, 0x34, 0x12}, 4},					// mov ax, [bx+1234h]
+	{"modrm16_disp16",			BENCH_REAL,		{0x8B, 0x06, 0x34, 0x12}, 4},					// mov ax, [1234h]
+
+	// 32-bit effective addresses
+	{"modrm32_base",			BENCH_REAL,		{0x67, 0x8B, 0x03}, 3},							// mov ax, [ebx]
+	{"modrm32_base_disp8",		BENCH_REAL,		{0x67, 0x8B, 0x43, 0x10}, 4},					// mov ax, [ebx+10h]
+	{"modrm32_sib",				BENCH_REAL,		{0x67, 0x8B, 0x04, 0x8E}, 4},					// mov ax, [esi+ecx*4]
+	{"modrm32_sib_disp32",		BENCH_REAL,		{0x67, 0x8B, 0x84, 0x8E, 0x10, 0, 0, 0}, 8},	// mov ax, [esi+ecx*4+10h]
+	{"modrm32_disp32",			BENCH_REAL,		{0x67, 0x8B, 0x05, 0x00, 0x10, 0, 0}, 7},		// mov ax, [1000h]
+
+	// String operations
+	{"lodsb",					BENCH_REAL,		{0xAC}, 1},										// lodsb
+	{"rep_movsb_64",			BENCH_REAL,		{0xB9, 0x40, 0x00, 0xF3, 0xA4}, 5},				// mov cx, 64 / rep movsb
+	{"rep_movsw_64",			BENCH_REAL,		{0xB9, 0x40, 0x00, 0xF3, 0xA5}, 5},				// mov cx, 64 / rep movsw
+	{"rep_stosw_64",			BENCH_REAL,		{0xB9, 0x40, 0x00, 0xF3, 0xAB}, 5},				// mov cx, 64 / rep stosw
+
+	// Control transfer
+	{"call_far_real",			BENCH_REAL,		{0x9A, 0x10, 0xF0, 0x00, 0x10}, 5},				// call 1000:F010 / retf
+	{"int_real",				BENCH_REAL,		{0xCD, 0x60}, 2},								// int 60h / iret
+	{"call_far_pmode",			BENCH_PMODE,	{0x9A, 0x10, 0xF0, 0x01, 0x00, 0x08, 0x00}, 7},	// call 08:1F010 / retf
+	{"int_pmode",				BENCH_PMODE,	{0xCD, 0x40}, 2},								// int 40h / iretd
+
+	// Memory access with and without paging
+	{"mov_mem_paging_off",		BENCH_PMODE,	{0x8B, 0x03}, 2},								// mov eax, [ebx]
+	{"mov_mem_paging_on",		BENCH_PAGING,	{0x8B, 0x03}, 2},								// mov eax, [ebx]
+	{"alu_reg_reg_pmode",		BENCH_PMODE,	{0x01, 0xD8}, 2},								// add eax, ebx
+
+	// FPU / MMX
+	{"fpu_fld1_fstp",			BENCH_REAL,		{0xD9, 0xE8, 0xDD, 0xD8}, 4},					// fld1 / fstp st0
+	{"fpu_fadd",				BENCH_REAL,		{0xD8, 0xC1}, 2},								// fadd st0, st1
+	{"mmx_paddd",				BENCH_REAL,		{0x0F, 0xFE, 0xC1}, 3},							// paddd mm0, mm1
+};
+
+static const int bench_vga_write_modes[4] = {0, 1, 2, 3};
+
+static const int bench_video_modes[] =
+{
+	0x01, 0x03, 0x04, 0x06, 0x0D, 0x10, 0x11, 0x12, 0x13, 0x113, 0x14
+};
+
+#if (PC)
+static double bench_now_ns()
+{
+	static LARGE_INTEGER freq = {0};
+	LARGE_INTEGER t;
+	if (freq.QuadPart == 0)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&t);
+	return (double)t.QuadPart * 1e9 / (double)freq.QuadPart;
+}
+#else
+static double bench_now_ns()
+{
+	return (double)GetTickCount() * 1e6;
+}
+#endif
+
+static void bench_real_mode()
+{
+	reset();
+
+	memset(ram, 0, 0x100000);
+
+	fault = 0;
+	hlt = 0;
+	irqs = 0;
+	irq_pending = 0;
+
+	idt_base = 0;
+	idt_limit = 0x3FF;
+
+	set_selector(&cs, BENCH_CODE >> 4, 1);
+	set_selector(&ds, BENCH_DATA >> 4, 1);
+	set_selector(&es, (BENCH_DATA >> 4) + 0x1000, 1);
+	set_selector(&ss, 0x4000, 1);
+	set_selector(&fs, 0, 1);
+	set_selector(&gs, 0, 1);
+	r.eip = 0;
+	r.esp = 0xFFF0;
+
+	r.eax = 1;
+	r.ebx = 0x100;
+	r.ecx = 0x10;
+	r.edx = 0;
+	r.esi = 0x200;
+	r.edi = 0x400;
+	r.ebp = 0x80;
+	set_flags(0x0002, 0xFFFFFFFFu);
+
+	// int 60h -> iret, far call target -> retf
+	*(unsigned short *)&ram[0x60 * 4] = (unsigned short)(BENCH_IRET - BENCH_CODE);
+	*(unsigned short *)&ram[0x60 * 4 + 2] = BENCH_CODE >> 4;
+	ram[BENCH_IRET] = 0xCF;
+	ram[BENCH_RETF] = 0xCB;
+}
+
+static void bench_protected_mode(int enable_paging)
+{
+	unsigned int *gdt, *idt, *pdir, *ptab;
+	int i;
+
+	bench_real_mode();
+
+	// Null, flat 32-bit code (08h), flat 32-bit data (10h)
+	gdt = (unsigned int *)&ram[BENCH_GDT];
+	gdt[0] = 0;
+	gdt[1] = 0;
+	gdt[2] = 0x0000FFFFu;
+	gdt[3] = 0x00CF9A00u;
+	gdt[4] = 0x0000FFFFu;
+	gdt[5] = 0x00CF9200u;
+	gdt_base = BENCH_GDT;
+	gdt_limit = 3 * 8 - 1;
+
+	// int 40h -> 386 interrupt gate to iretd
+	idt = (unsigned int *)&ram[BENCH_IDT];
+	idt[0x40 * 2] = (BENCH_IRET & 0xFFFFu) | (0x08 << 16);
+	idt[0x40 * 2 + 1] = (BENCH_IRET & 0xFFFF0000u) | 0x8E00u;
+	idt_base = BENCH_IDT;
+	idt_limit = 256 * 8 - 1;
+
+	cr[0] |= CR0_PE;
+	pmode = 1;
+
+	set_selector(&cs, 0x08, 1);
+	set_selector(&ds, 0x10, 1);
+	set_selector(&es, 0x10, 1);
+	set_selector(&ss, 0x10, 1);
+	set_selector(&fs, 0x10, 1);
+	set_selector(&gs, 0x10, 1);
+	r.eip = BENCH_CODE;
+	r.esp = BENCH_STACK;
+	r.ebx = BENCH_DATA;
+	r.esi = BENCH_DATA;
+	r.edi = BENCH_DATA + 0x8000;
+
+	if (enable_paging)
+	{
+		// Identity map the first 4 MB
+		pdir = (unsigned int *)&ram[BENCH_PDIR];
+		ptab = (unsigned int *)&ram[BENCH_PTAB];
+		memset(pdir, 0, 4096);
+		pdir[0] = BENCH_PTAB | 7;
+		for (i = 0; i < 1024; i++)
+			ptab[i] = (i << 12) | 7;
+		cr[3] = BENCH_PDIR;
+		cr[0] |= CR0_PG;
+		paging = 1;
+		dir = (unsigned int *)&ram[cr[3] & 0xFFFFF000u];
+	}
+}
+
+static void bench_setup_code(const void *arg)
+{
+	const bench_code_t *c = (const bench_code_t *)arg;
+	unsigned char *p = &ram[BENCH_CODE];
+	int n = 0;
+
+	if (c->mode == BENCH_REAL)
+		bench_real_mode();
+	else
+		bench_protected_mode(c->mode == BENCH_PAGING);
+
+	while (n + c->length <= BENCH_CODE_SIZE)
+	{
+		memcpy(p + n, c->code, c->length);
+		n += c->length;
+	}
+
+	// jmp BENCH_CODE
+	p[n++] = 0xE9;
+	if (c->mode == BENCH_REAL)
+	{
+		*(unsigned short *)&p[n] = (unsigned short)(-(n + 2));
+		n += 2;
+	}
+	else
+	{
+		*(unsigned int *)&p[n] = (unsigned int)(-(n + 4));
+		n += 4;
+	}
+}
+
+static void bench_run_steps(unsigned int n)
+{
+	unsigned int i;
+	for (i = 0; i < n; i++)
+		step();
+}
+
+static unsigned int bench_counter = 0;
+
+static void bench_setup_vga_write(const void *arg)
+{
+	int mode = *(const int *)arg;
+
+	vmode = 0x12;
+	vga_portwrite(0x3C4, 4);
+	vga_portwrite(0x3C5, 0x06);
+	vga_portwrite(0x3C4, 2);
+	vga_portwrite(0x3C5, 0x0F);
+	vga_portwrite(0x3CE, 8);
+	vga_portwrite(0x3CF, 0xFF);
+	vga_portwrite(0x3CE, 3);
+	vga_portwrite(0x3CF, 0x00);
+	vga_portwrite(0x3CE, 5);
+	vga_portwrite(0x3CF, mode);
+	bench_counter = 0;
+}
+
+static void bench_run_vga_write(unsigned int n)
+{
+	unsigned int i;
+	for (i = 0; i < n; i++)
+	{
+		vga_memwrite(0xA0000u + (bench_counter & 0xFFFFu), (unsigned char)bench_counter);
+		bench_counter++;
+	}
+}
+
+static void bench_run_vga_write32(unsigned int n)
+{
+	unsigned int i;
+	for (i = 0; i < n; i++)
+	{
+		vga_memwrite32(0xA0000u + (bench_counter & 0xFFFCu), bench_counter);
+		bench_counter += 4;
+	}
+}
+
+static void bench_run_vga_read(unsigned int n)
+{
+	unsigned int i, sum = 0;
+	for (i = 0; i < n; i++)
+	{
+		sum += vga_memread(0xA0000u + (bench_counter & 0xFFFFu));
+		bench_counter++;
+	}
+	ram[BENCH_DATA] = (unsigned char)sum;
+}
+
+static void bench_run_vga_read32(unsigned int n)
+{
+	unsigned int i, sum = 0;
+	for (i = 0; i < n; i++)
+	{
+		sum += vga_memread32(0xA0000u + (bench_counter & 0xFFFCu));
+		bench_counter += 4;
+	}
+	ram[BENCH_DATA] = (unsigned char)sum;
+}
+
+static void bench_ide_command()
+{
+	ide_write(0x1F2, 128);
+	ide_write(0x1F3, 1);
+	ide_write(0x1F4, 0);
+	ide_write(0x1F5, 0);
+	ide_write(0x1F6, 0xA0);
+	ide_write(0x1F7, HDD_CMD_READ);
+	// Data is ready when the disk worker completes the request
+	diskio_drain();
+}
+
+static void bench_setup_ide(const void *arg)
+{
+	disk_init();
+	disk_set_hdd(0, 104, 16, 63);
+	bench_counter = 0;
+}
+
+static void bench_run_ide_read(unsigned int n)
+{
+	unsigned int i, sum = 0;
+	for (i = 0; i < n; i++)
+	{
+		// 128 sectors per command
+		if ((bench_counter & 0xFFFFu) == 0)
+			bench_ide_command();
+		sum += ide_read(0x1F0);
+		bench_counter++;
+	}
+	ram[BENCH_DATA] = (unsigned char)sum;
+}
+
+static void bench_setup_screen(const void *arg)
+{
+	int mode = *(const int *)arg;
+	unsigned int i;
+
+	vmode = mode & 0xFF;
+	vga_portwrite(0x3C4, 4);
+	vga_portwrite(0x3C5, ((mode & 0xFF) == 0x13) && ((mode & 0x100) == 0) ? 0x0E : 0x06);
+
+	// 200 lines, no doubling, no panning
+	vga_portwrite(0x3D4, 0x07);
+	vga_portwrite(0x3D5, 0x00);
+	vga_portwrite(0x3D4, 0x12);
+	vga_portwrite(0x3D5, 0xC7);
+	vga_portwrite(0x3D4, 0x13);
+	vga_portwrite(0x3D5, 0x28);
+
+	// Fill video memory with a pattern so renderers do real work
+	for (i = 0; i < 0x10000; i++)
+		ram[0xA0000 + i] = (unsigned char)(i * 7);
+	for (i = 0; i < 0x8000; i++)
+		ram[0xB8000 + i] = (unsigned char)(i * 13);
+	for (i = 0; i < 0x40000; i++)
+		vram[i] = i * 0x9E3779B1u;
+}
+
+static void bench_run_screen(unsigned int n)
+{
+	unsigned int i;
+	// Measure full frames, not just the dirty scanlines
+	for (i = 0; i < n; i++)
+	{
+		vga_invalidate();
+		update_screen();
+	}
+}
+
+static int bench_num_exceptions()
+{
+	return num_pf + num_gp + num_ex;
+}
+
+static bench_result_t bench_measure(const bench_t *b)
+{
+	bench_result_t res;
+	double t, total = 0;
+	int i, ex0;
+
+	// Warm up caches and branch predictors
+	b->setup(b->arg);
+	b->run(b->ops / 10 + 1);
+
+	res.best = 0;
+	ex0 = bench_num_exceptions();
+	for (i = 0; i < BENCH_REPEAT; i++)
+	{
+		b->setup(b->arg);
+		t = bench_now_ns();
+		b->run(b->ops);
+		t = (bench_now_ns() - t) / b->ops;
+		total += t;
+		if ((i == 0) || (t < res.best))
+			res.best = t;
+	}
+	res.mean = total / BENCH_REPEAT;
+	res.exceptions = bench_num_exceptions() - ex0;
+
+	return res;
+}
+
+static void bench_report(FILE *json, FILE *text, const bench_t *b, const bench_result_t *res, int first)
+{
+	if (json != NULL)
+	{
+		fprintf(json, "%s\n    {\"name\": \"%s\", \"group\": \"%s\", \"ops\": %u, \"ns_per_op\": %.3f, \"ns_per_op_mean\": %.3f, \"exceptions\": %d}",
+			first ? "" : ",", b->name, b->group, b->ops, res->best, res->mean, res->exceptions);
+	}
+	if (text != NULL)
+	{
+		fprintf(text, "%-8s %-24s %10.3f ns/op%s\n", b->group, b->name, res->best,
+			res->exceptions ? "  (exceptions!)" : "");
+		fflush(text);
+	}
+}
+
+void bench_run(FILE *json, FILE *text)
+{
+	static char names[64][32];
+	bench_t b;
+	bench_result_t res;
+	int i, first = 1;
+
+	if (json != NULL)
+	{
+		fprintf(json, "{\n  \"build\": {\"cpu\": %d, \"ram_size\": %u, \"fpu\": %d, \"mmx\": %d, \"debug\": %d, \"date\": \"%s %s\"},\n",
+			CPU, RAM_SIZE, ENABLE_FPU, ENABLE_MMX, DEBUG, __DATE__, __TIME__);
+		fprintf(json, "  \"results\": [");
+	}
+
+	for (i = 0; i < (int)(sizeof(bench_codes) / sizeof(bench_codes[0])); i++)
+	{
+		b.name = bench_codes[i].name;
+		b.group = "cpu";
+		b.setup = bench_setup_code;
+		b.run = bench_run_steps;
+		b.arg = &bench_codes[i];
+		b.ops = BENCH_CPU_OPS;
+		res = bench_measure(&b);
+		bench_report(json, text, &b, &res, first);
+		first = 0;
+	}
+
+	for (i = 0; i < 4; i++)
+	{
+		sprintf(names[i], "vga_memwrite_mode%d", bench_vga_write_modes[i]);
+		b.name = names[i];
+		b.group = "vga";
+		b.setup = bench_setup_vga_write;
+		b.run = bench_run_vga_write;
+		b.arg = &bench_vga_write_modes[i];
+		b.ops = BENCH_DEVICE_OPS;
+		res = bench_measure(&b);
+		bench_report(json, text, &b, &res, first);
+	}
+
+	b.name = "vga_memread";
+	b.group = "vga";
+	b.setup = bench_setup_vga_write;
+	b.run = bench_run_vga_read;
+	b.arg = &bench_vga_write_modes[0];
+	b.ops = BENCH_DEVICE_OPS;
+	res = bench_measure(&b);
+	bench_report(json, text, &b, &res, first);
+
+	b.name = "vga_memwrite32_mode0";
+	b.group = "vga";
+	b.setup = bench_setup_vga_write;
+	b.run = bench_run_vga_write32;
+	b.arg = &bench_vga_write_modes[0];
+	b.ops = BENCH_DEVICE_OPS;
+	res = bench_measure(&b);
+	bench_report(json, text, &b, &res, first);
+
+	b.name = "vga_memread32";
+	b.group = "vga";
+	b.setup = bench_setup_vga_write;
+	b.run = bench_run_vga_read32;
+	b.arg = &bench_vga_write_modes[0];
+	b.ops = BENCH_DEVICE_OPS;
+	res = bench_measure(&b);
+	bench_report(json, text, &b, &res, first);
+
+	b.name = "ide_read_byte";
+	b.group = "disk";
+	b.setup = bench_setup_ide;
+	b.run = bench_run_ide_read;
+	b.arg = NULL;
+	b.ops = BENCH_DEVICE_OPS;
+	res = bench_measure(&b);
+	bench_report(json, text, &b, &res, first);
+
+	for (i = 0; i < (int)(sizeof(bench_video_modes) / sizeof(bench_video_modes[0])); i++)
+	{
+		sprintf(names[8 + i], "update_screen_%.2X%s", bench_video_modes[i] & 0xFF,
+			bench_video_modes[i] & 0x100 ? "x" : "");
+		b.name = names[8 + i];
+		b.group = "screen";
+		b.setup = bench_setup_screen;
+		b.run = bench_run_screen;
+		b.arg = &bench_video_modes[i];
+		b.ops = BENCH_FRAMES;
+		res = bench_measure(&b);
+		bench_report(json, text, &b, &res, first);
+	}
+
+	if (json != NULL)
+	{
+		fprintf(json, "\n  ]\n}\n");
+		fflush(json);
+	}
+
+	// Leave the machine in a sane state
+	reset();
+	memset(ram, 0, 0x100000);
+	disk_init();
+	vmode = 3;
+}
@@ -0,0 +1,9 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+// Runs every benchmark case and reports ns/op.
+// "json" receives a machine-readable report, "text" a human-readable one.
+// Either file may be NULL.
+void bench_run(FILE *json, FILE *text);
+
+#endif
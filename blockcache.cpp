@@ -0,0 +1,228 @@
+#include "stdafx.h"
+#include "config.h"
+#include "blockcache.h"
+
+// Decompressed image blocks shared by all drives of the emulator.
+// Blocks are keyed by the file identity, so drives and overlays that use the same
+// base image share the cached data. All the functions may be called from any thread.
+// The BLOCK_CACHE_SIZE KB pool is allocated on first use.
+
+typedef struct
+{
+	blockcache_key_t key;
+	unsigned int block;
+	// LRU list, most recently used first
+	int prev;
+	int next;
+	int hash_next;
+	unsigned int size;
+	unsigned char *data;
+} blockcache_entry_t;
+
+static mutex blockcache_mtx;
+
+static blockcache_entry_t *entries = NULL;
+static unsigned char *pool = NULL;
+static int *buckets = NULL;
+static unsigned int num_entries = 0;
+static unsigned int num_buckets = 0;
+static unsigned int num_used = 0;
+static int lru_first = -1;
+static int lru_last = -1;
+
+static blockcache_stats_t stats;
+
+static void blockcache_free()
+{
+	free(entries);
+	free(pool);
+	free(buckets);
+
+	entries = NULL;
+	pool = NULL;
+	buckets = NULL;
+	num_entries = 0;
+	num_buckets = 0;
+	num_used = 0;
+	lru_first = -1;
+	lru_last = -1;
+}
+
+static int blockcache_alloc(unsigned int size)
+{
+	unsigned int i;
+
+	num_entries = size / BLOCKCACHE_BLOCK_SIZE;
+	if (num_entries == 0)
+		return 0;
+	num_buckets = num_entries * 2;
+
+	entries = (blockcache_entry_t *)calloc(num_entries, sizeof(blockcache_entry_t));
+	pool = (unsigned char *)malloc(num_entries * BLOCKCACHE_BLOCK_SIZE);
+	buckets = (int *)malloc(num_buckets * sizeof(int));
+	if ((entries == NULL) || (pool == NULL) || (buckets == NULL))
+	{
+		blockcache_free();
+		return 0;
+	}
+
+	for (i = 0; i < num_entries; i++)
+		entries[i].data = pool + i * BLOCKCACHE_BLOCK_SIZE;
+	for (i = 0; i < num_buckets; i++)
+		buckets[i] = -1;
+
+	stats.capacity = num_entries;
+	stats.used = 0;
+
+	return 1;
+}
+
+static unsigned int blockcache_hash(const blockcache_key_t *key, unsigned int block)
+{
+	unsigned int h = key->volume ^ key->file_low * 0x9E3779B1u ^ key->file_high ^ key->time_low;
+	h ^= block * 0x85EBCA6Bu;
+	h ^= h >> 15;
+	return h % num_buckets;
+}
+
+static int blockcache_find(const blockcache_key_t *key, unsigned int block)
+{
+	int i;
+
+	for (i = buckets[blockcache_hash(key, block)]; i >= 0; i = entries[i].hash_next)
+	{
+		if ((entries[i].block == block) && (memcmp(&entries[i].key, key, sizeof(blockcache_key_t)) == 0))
+			return i;
+	}
+
+	return -1;
+}
+
+static void blockcache_unlink(int i)
+{
+	blockcache_entry_t *e = &entries[i];
+
+	if (e->prev >= 0)
+		entries[e->prev].next = e->next;
+	else
+		lru_first = e->next;
+
+	if (e->next >= 0)
+		entries[e->next].prev = e->prev;
+	else
+		lru_last = e->prev;
+}
+
+static void blockcache_link_first(int i)
+{
+	entries[i].prev = -1;
+	entries[i].next = lru_first;
+	if (lru_first >= 0)
+		entries[lru_first].prev = i;
+	lru_first = i;
+	if (lru_last < 0)
+		lru_last = i;
+}
+
+static void blockcache_unhash(int i)
+{
+	int *p = &buckets[blockcache_hash(&entries[i].key, entries[i].block)];
+
+	while (*p != i)
+		p = &entries[*p].hash_next;
+	*p = entries[i].hash_next;
+}
+
+// Copies a part of the block, returns 0 if the block is not cached
+int blockcache_read(const blockcache_key_t *key, unsigned int block, unsigned int offset, unsigned char *buffer, unsigned int size)
+{
+	int i;
+
+	lock_guard<mutex> lock(blockcache_mtx);
+
+	if ((entries == NULL) && !blockcache_alloc(BLOCK_CACHE_SIZE * 1024u))
+		return 0;
+
+	i = blockcache_find(key, block);
+	if ((i < 0) || (offset + size > entries[i].size))
+	{
+		stats.misses++;
+		return 0;
+	}
+
+	stats.hits++;
+
+	memcpy(buffer, entries[i].data + offset, size);
+
+	if (lru_first != i)
+	{
+		blockcache_unlink(i);
+		blockcache_link_first(i);
+	}
+
+	return 1;
+}
+
+// Replaces the least recently used block when the cache is full
+void blockcache_insert(const blockcache_key_t *key, unsigned int block, const unsigned char *data, unsigned int size)
+{
+	blockcache_entry_t *e;
+	unsigned int h;
+	int i;
+
+	if (size > BLOCKCACHE_BLOCK_SIZE)
+		return;
+
+	lock_guard<mutex> lock(blockcache_mtx);
+
+	if ((entries == NULL) && !blockcache_alloc(BLOCK_CACHE_SIZE * 1024u))
+		return;
+
+	i = blockcache_find(key, block);
+	if (i >= 0)
+	{
+		blockcache_unlink(i);
+		e = &entries[i];
+	}
+	else
+	{
+		if (num_used < num_entries)
+		{
+			i = num_used++;
+			stats.used = num_used;
+		}
+		else
+		{
+			i = lru_last;
+			blockcache_unlink(i);
+			blockcache_unhash(i);
+			stats.evictions++;
+		}
+
+		e = &entries[i];
+		e->key = *key;
+		e->block = block;
+		h = blockcache_hash(key, block);
+		e->hash_next = buckets[h];
+		buckets[h] = i;
+	}
+
+	memcpy(e->data, data, size);
+	e->size = size;
+
+	blockcache_link_first(i);
+}
+
+void blockcache_get_stats(blockcache_stats_t *s)
+{
+	lock_guard<mutex> lock(blockcache_mtx);
+
+	*s = stats;
+}
+
+void blockcache_deinit()
+{
+	lock_guard<mutex> lock(blockcache_mtx);
+
+	blockcache_free();
+}
@@ -0,0 +1,31 @@
+#ifndef BLOCKCACHE_H
+#define BLOCKCACHE_H
+
+// Largest block that can be cached
+#define BLOCKCACHE_BLOCK_SIZE	32768
+
+// Identifies an image file and its version
+typedef struct
+{
+	unsigned int volume;
+	unsigned int file_high;
+	unsigned int file_low;
+	unsigned int time_high;
+	unsigned int time_low;
+} blockcache_key_t;
+
+typedef struct
+{
+	unsigned __int64 hits;
+	unsigned __int64 misses;
+	unsigned __int64 evictions;
+	unsigned int used;
+	unsigned int capacity;
+} blockcache_stats_t;
+
+int blockcache_read(const blockcache_key_t *key, unsigned int block, unsigned int offset, unsigned char *buffer, unsigned int size);
+void blockcache_insert(const blockcache_key_t *key, unsigned int block, const unsigned char *data, unsigned int size);
+void blockcache_get_stats(blockcache_stats_t *stats);
+void blockcache_deinit();
+
+#endif
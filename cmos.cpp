@@ -1,5 +1,7 @@
 #include "stdafx.h"
 #include "cmos.h"
+#include "pic_pit.h"
+#include "vclock.h"
 
 // NVRAM / RTC
 
@@ -7,7 +9,7 @@ cmos_t cmos;
 
 unsigned char cmos_image[64] = 
 {
-	0x01, 0x00, 0x01, 0x00, 0x01, 0x00, 0x01, 0x01, 0x01, 0x00, 0x26, 0x00, 0x00, 0x80, 0x00, 0x04, 
+	0x01, 0x00, 0x01, 0x00, 0x01, 0x00, 0x01, 0x01, 0x01, 0x00, 0x26, 0x02, 0x00, 0x80, 0x00, 0x04, 
 	0x00, 0x00, 0xF0, 0x00, 0x20, 0x80, 0x02, 0x00, 0x1C, 0x2F, 0x2F, 0x00, 0x00, 0x00, 0x00, 0x00, 
 	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xAA, 0xAA, 
 	0x00, 0x1C, 0x19, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
@@ -17,56 +19,268 @@ unsigned char cmos_index = 0;
 
 int cmos_initialized = 0;
 
+#define RTC_REG(n)			(((unsigned char *)&cmos)[n])
+#define RTC_CENTURY			0x32
+
+// Register C flags
+#define RTC_IRQF			0x80
+#define RTC_PF				0x40
+#define RTC_AF				0x20
+#define RTC_UF				0x10
+
+// Update in progress is set for this long before every update
+#define RTC_UIP_NS			244000
+
+// Virtual time of the next update of the time registers
+static unsigned __int64 rtc_next_update;
+// Next periodic interrupt while it is enabled
+static unsigned __int64 rtc_next_periodic;
+// 32768 Hz clock at the last periodic flag
+static unsigned __int64 rtc_periodic_clock;
+
 unsigned char bcd(unsigned char value)
 {
 	return (value / 10) * 16 + value % 10;
 }
 
-void update_rtc()
+static unsigned char rtc_to_reg(unsigned int value)
+{
+	return cmos.bindate ? (unsigned char)value : bcd((unsigned char)value);
+}
+
+static unsigned int rtc_from_reg(unsigned char value)
+{
+	return cmos.bindate ? value : (value >> 4) * 10 + (value & 0x0F);
+}
+
+// Days since 1970-01-01
+static unsigned int rtc_days(unsigned int year, unsigned int month, unsigned int day)
+{
+	unsigned int era, yoe, doy;
+
+	year -= month <= 2;
+	era = year / 400;
+	yoe = year - era * 400;
+	doy = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+	return era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+}
+
+static void rtc_date(unsigned int days, unsigned int *year, unsigned int *month, unsigned int *day)
+{
+	unsigned int era, doe, yoe, doy, mp;
+
+	days += 719468;
+	era = days / 146097;
+	doe = days - era * 146097;
+	yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	mp = (5 * doy + 2) / 153;
+	*day = doy - (153 * mp + 2) / 5 + 1;
+	*month = mp < 10 ? mp + 3 : mp - 9;
+	*year = yoe + era * 400 + (*month <= 2);
+}
+
+// Time registers as seconds since 1970-01-01
+static unsigned __int64 rtc_get_time()
+{
+	unsigned int hour, day, month, year;
+
+	if (cmos.hr24)
+		hour = rtc_from_reg(cmos.hour);
+	else
+		hour = rtc_from_reg(cmos.hour & 0x7F) % 12 + ((cmos.hour & 0x80) ? 12 : 0);
+
+	day = rtc_from_reg(cmos.day);
+	month = rtc_from_reg(cmos.month);
+	year = rtc_from_reg(RTC_REG(RTC_CENTURY)) * 100 + rtc_from_reg(cmos.yearmod100);
+	if (year < 1970)
+		year += 100;
+	if ((month < 1) || (month > 12))
+		month = 1;
+	if ((day < 1) || (day > 31))
+		day = 1;
+
+	return (unsigned __int64)rtc_days(year, month, day) * 86400 + hour * 3600 +
+		rtc_from_reg(cmos.min) * 60 + rtc_from_reg(cmos.second);
+}
+
+static void rtc_set_time(unsigned __int64 t)
+{
+	unsigned int days, hour, year, month, day;
+
+	days = (unsigned int)(t / 86400);
+	rtc_date(days, &year, &month, &day);
+	hour = (unsigned int)(t / 3600 % 24);
+
+	cmos.second = rtc_to_reg((unsigned int)(t % 60));
+	cmos.min = rtc_to_reg((unsigned int)(t / 60 % 60));
+	if (cmos.hr24)
+		cmos.hour = rtc_to_reg(hour);
+	else
+		cmos.hour = rtc_to_reg(hour % 12 ? hour % 12 : 12) | (hour >= 12 ? 0x80 : 0);
+	// 1 - Sunday
+	cmos.dow = rtc_to_reg((days + 4) % 7 + 1);
+	cmos.day = rtc_to_reg(day);
+	cmos.month = rtc_to_reg(month);
+	cmos.yearmod100 = rtc_to_reg(year % 100);
+	RTC_REG(RTC_CENTURY) = rtc_to_reg(year / 100);
+}
+
+// 32768 Hz time base clocks elapsed
+static unsigned __int64 rtc_clock(unsigned __int64 ns)
+{
+	return ns / 1000000000 * 32768 + ns % 1000000000 * 32768 / 1000000000;
+}
+
+// Time base clocks per periodic interrupt, 0 - disabled
+static unsigned int rtc_periodic_rate()
+{
+	if (cmos.rate == 0)
+		return 0;
+	if (cmos.rate <= 2)
+		return 1 << (cmos.rate + 6);
+	return 1 << (cmos.rate - 1);
+}
+
+// Sets the periodic flag if a period has ended since the last one
+static void rtc_check_periodic()
+{
+	unsigned int rate = rtc_periodic_rate();
+	unsigned __int64 clock;
+
+	if (rate == 0)
+		return;
+
+	clock = rtc_clock(vclock_now());
+	if (clock / rate != rtc_periodic_clock / rate)
+		cmos.int_status |= RTC_PF;
+	rtc_periodic_clock = clock;
+}
+
+// Raises IRQ 8 when a flag enabled in register B is set
+static void rtc_irq()
 {
+	if ((cmos.int_status & RTC_REG(0x0B) & 0x70) && !(cmos.int_status & RTC_IRQF))
+	{
+		cmos.int_status |= RTC_IRQF;
+		irq(8);
+	}
+}
+
+static int rtc_alarm_match(unsigned char alarm, unsigned char value)
+{
+	// 11xxxxxx - any value
+	return ((alarm & 0xC0) == 0xC0) || (alarm == value);
+}
+
+// Update cycle, once per second
+static void rtc_update()
+{
+	// Stopped by the SET bit or by the divider control
+	if (cmos.updateB || (cmos.div != 2))
+		return;
+
+	rtc_set_time(rtc_get_time() + 1);
+
+	cmos.int_status |= RTC_UF;
+	if (rtc_alarm_match(cmos.alm_second, cmos.second) && rtc_alarm_match(cmos.alm_min, cmos.min) &&
+		rtc_alarm_match(cmos.alm_hour, cmos.hour))
+		cmos.int_status |= RTC_AF;
+}
+
+static void rtc_event();
+
+// Next update, or the next periodic interrupt if it comes first and is enabled
+static void rtc_schedule()
+{
+	unsigned int rate = rtc_periodic_rate();
+	unsigned __int64 due = rtc_next_update, edge;
+
+	rtc_next_periodic = VCLOCK_NEVER;
+	if (cmos.periodic_int_enable && rate)
+	{
+		edge = (rtc_clock(vclock_now()) / rate + 1) * rate;
+		rtc_next_periodic = edge / 32768 * 1000000000 + (edge % 32768 * 1000000000 + 32767) / 32768;
+		if (rtc_next_periodic < due)
+			due = rtc_next_periodic;
+	}
+
+	vclock_schedule(VCLOCK_EVENT_RTC, due, rtc_event);
+}
+
+static void rtc_event()
+{
+	unsigned __int64 now = vclock_now();
+
+	while (now >= rtc_next_update)
+	{
+		rtc_update();
+		rtc_next_update += 1000000000;
+	}
+
+	if (now >= rtc_next_periodic)
+	{
+		cmos.int_status |= RTC_PF;
+		rtc_periodic_clock = rtc_clock(now);
+	}
+
+	rtc_irq();
+	rtc_schedule();
+}
+
+static void cmos_init()
+{
+#if (!RTC_START_TIME)
 	SYSTEMTIME tm;
-	unsigned char prev[10];
+#endif
+	unsigned __int64 t;
 
-	memcpy(prev, &cmos, 10);
+	memcpy(&cmos, cmos_image, sizeof(cmos));
+	cmos_initialized = 1;
 
+#if (RTC_START_TIME)
+	t = RTC_START_TIME;
+#else
 	GetLocalTime(&tm);
+	t = (unsigned __int64)rtc_days(tm.wYear, tm.wMonth, tm.wDay) * 86400 + tm.wHour * 3600 + tm.wMinute * 60 + tm.wSecond;
+#endif
+	rtc_set_time(t);
 
-	cmos.second = bcd((unsigned char)tm.wSecond);
-	cmos.min = bcd((unsigned char)tm.wMinute);
-	cmos.hour = bcd((unsigned char)tm.wHour);
-	cmos.dow = bcd((unsigned char)tm.wDayOfWeek);
-	cmos.day = bcd((unsigned char)tm.wDay);
-	cmos.month = bcd((unsigned char)tm.wMonth);
-	cmos.yearmod100 = bcd((unsigned char)tm.wYear % 100);
-
-	if (memcmp(prev, &cmos, 10))
-		cmos.updateA = 1;
+	// From here on the clock runs on virtual time only
+	rtc_next_update = vclock_now() + 1000000000;
+	rtc_periodic_clock = rtc_clock(vclock_now());
+	rtc_schedule();
 }
 
 unsigned char cmos_read(int port)
 {
 	unsigned char v;
+	int index = cmos_index & 0x3F;
+
 	if (!cmos_initialized)
-	{
-		memcpy(&cmos, cmos_image, sizeof(cmos));
-		cmos_initialized = 1;
-	}
+		cmos_init();
+
 	switch (port)
 	{
 		case 0x70:
 			return cmos_index;
 		case 0x71:
-			if (cmos_index <= 0x0A)
-				update_rtc();
-			v = ((unsigned char *)&cmos)[cmos_index & 0x3F];
-			// Clear update / int status
-			if (cmos_index == 0x0A)
-				cmos.updateA = 0;
-			if (cmos_index == 0x0B)
-				cmos.updateB = 0;
-			if (cmos_index == 0x0C)
-				cmos.int_status = 0;
-			if (cmos_index == 0x0D)
+			switch (index)
+			{
+				case 0x0A:
+					cmos.updateA = !cmos.updateB && (cmos.div == 2) && (rtc_next_update <= vclock_now() + RTC_UIP_NS);
+					break;
+				case 0x0C:
+					// Reading clears the flags and the interrupt request
+					rtc_check_periodic();
+					v = cmos.int_status;
+					cmos.int_status = 0;
+					if (v & RTC_IRQF)
+						irq_clear(8);
+					return v;
+			}
+			v = RTC_REG(index);
+			if (index == 0x0D)
 				cmos.power_control = 0x80;
 			return v;
 	}
@@ -75,18 +289,44 @@ unsigned char cmos_read(int port)
 
 void cmos_write(int port, unsigned char value)
 {
+	int index = cmos_index & 0x3F;
+	int div;
+
 	if (!cmos_initialized)
-	{
-		memcpy(&cmos, cmos_image, sizeof(cmos));
-		cmos_initialized = 1;
-	}
+		cmos_init();
+
 	switch (port)
 	{
 		case 0x70:
 			cmos_index = value;
 			break;
 		case 0x71:
-			((unsigned char *)&cmos)[cmos_index & 0x3F] = value;
+			switch (index)
+			{
+				case 0x0A:
+					// Update in progress is read only, the first update comes 500 ms after the divider starts
+					div = cmos.div;
+					RTC_REG(0x0A) = (value & 0x7F) | (RTC_REG(0x0A) & 0x80);
+					if ((div != 2) && (cmos.div == 2))
+						rtc_next_update = vclock_now() + 500000000;
+					rtc_schedule();
+					break;
+				case 0x0B:
+					RTC_REG(0x0B) = value;
+					// SET stops the updates and clears the update interrupt enable
+					if (cmos.updateB)
+						cmos.update_int_enable = 0;
+					rtc_irq();
+					rtc_schedule();
+					break;
+				case 0x0C:
+				case 0x0D:
+					// Read only
+					break;
+				default:
+					RTC_REG(index) = value;
+					break;
+			}
 			break;
 	}
 }
@@ -18,6 +18,22 @@
 #define ENABLE_MMX				1
 
 
+// Virtual CPU clock. RDTSC, timers, RTC, retrace and disk delays run on virtual time counted
+// in CPU clock cycles, so the guest sees the same rates at any emulation speed
+#define CPU_MHZ					33
+
+// Set to 1 to count approximate 486 clocks per instruction, 0 - one clock per instruction
+#define CPU_CYCLE_WEIGHTS		0
+
+// 1 - real-time mode: virtual time follows the host clock, the emulator sleeps when it is ahead
+// 0 - batch mode: runs as fast as possible, a halted CPU skips to the next timer event
+#define VCLOCK_REALTIME			1
+
+// RTC start time, seconds since 1970-01-01 00:00:00 (946684800 - 2000-01-01), 0 - host local time
+// A fixed start makes batch runs reproducible
+#define RTC_START_TIME			0
+
+
 // Set to 1 to enable debugging
 #define DEBUG					1
 
@@ -30,10 +46,75 @@
 #define DISASM_FILE_NAME		"debug.dasm"
 
 
+// Set to 1 to run the microbenchmarks instead of the emulator
+#define BENCHMARK				0
+
+#define BENCHMARK_FILE_NAME		"bench.json"
+
+
+// Set to 1 to enable the guest code sampling profiler
+// To write a report press F11 in the main window, it is also written on exit
+#define PROFILER				0
+
+// Take one CS:EIP sample every N instructions
+#define PROFILER_INTERVAL		997
+
+#define PROFILER_FILE_NAME		"profile.txt"
+#define PROFILER_COLLAPSED_FILE_NAME	"profile.folded"
+
+// Optional System.map or DOS .map file to resolve addresses
+#define PROFILER_SYMBOL_FILE_NAME	"System.map"
+
+
+// Set to 1 to collect runtime metrics (interrupts, IRQ latency, port I/O, disk, frames)
+#define METRICS					0
+
+// Snapshot period in ms
+#define METRICS_INTERVAL		5000
+
+// 1 - one JSON object per line, 0 - plain text
+#define METRICS_JSON			1
+
+// Use "-" to write to stdout
+#define METRICS_FILE_NAME		"metrics.json"
+
+
 // Disk drives
 #define NUM_FDD					1
 #define NUM_HDD					1
 
+// Set to 1 to run disk transfers on a separate thread
+#define ASYNC_DISK_IO			1
+
+// Set to 1 to never change hard disk image files, guest writes are kept in memory until exit
+#define HDD_READ_ONLY_BASE		0
+
+// Set to 1 to keep hard disk changes in an overlay file over a shared read-only base image
+// The overlay is created on first start. Ctrl+F9 commits it to the base, Shift+F9 discards it
+#define HDD_OVERLAY				0
+
+#define HDD_OVERLAY_FILE_NAME	"hd0.ovl"
+
+// Set to 1 to convert a disk image instead of running the emulator
+// Any image can be converted to a compressed image (IMAGE_CONVERT_COMPRESS 1) or raw image (0)
+#define IMAGE_CONVERT			0
+#define IMAGE_CONVERT_COMPRESS	1
+#define IMAGE_CONVERT_SOURCE	"hd0.img"
+#define IMAGE_CONVERT_DEST		"hd0.cimg"
+
+// Decompressed blocks of compressed images shared by all drives (KB)
+#define BLOCK_CACHE_SIZE		8192
+
+
+// Set to 1 to draw frames on a separate thread, 0 - on the CPU thread at vertical retrace
+#define RENDER_THREAD			1
+
+// Set to 1 to publish finished frames in a named shared memory section for external viewers
+// (see "fbexport.h" and "tools/fbdump.cpp"). Frames are only copied while a viewer is attached.
+#define FB_EXPORT				0
+
+#define FB_EXPORT_NAME			"Local\\e86r_frame"
+
 
 // Set to 1 if you don't want to see registers in the main window
 #define SET_WINDOW_CLIENT_SIZE	0
@@ -5,7 +5,14 @@
 #include "ioports.h"
 #include "disk.h"
 #include "pic_pit.h"
+#include "vclock.h"
 #include "config.h"
+#if (PROFILER)
+#include "profiler.h"
+#endif
+#if (METRICS)
+#include "metrics.h"
+#endif
 
 extern unsigned char ports[1024];
 
@@ -15,7 +22,6 @@ selector_t *ssel;
 selector_t es, cs, ss, ds, fs, gs;
 
 #if (CPU >= 586)
-unsigned __int64 tsc_counter = 0;
 std::map<unsigned int, unsigned __int64> msr_registers;
 #endif
 
@@ -296,7 +302,7 @@ void check_irqs()
 {
 	int nextint;
 
-	if (r.eflags & F_I)
+	if ((r.eflags & F_I) && irq_pending)
 	{
 		nextint = get_next_irq_vector();
 		if (nextint > 0)
@@ -309,12 +315,11 @@ void check_irqs()
 
 void step()
 {
-#if (CPU >= 586)
-	tsc_counter++;
-#endif
-
-	if (hlt && (irqs == 0))
+	if (hlt && !irq_pending)
+	{
+		vclock_idle();
 		return;
+	}
 	hlt = 0;
 
 	repe = repne = 0;
@@ -351,6 +356,11 @@ void step()
 	instr_esp = r.esp;
 	instr_fl = r.eflags;
 
+#if (PROFILER)
+	if (--profiler_countdown <= 0)
+		profiler_sample();
+#endif
+
 #if (PC)
 	if ((dasm == NULL) && (open_log))
 	{
@@ -371,6 +381,16 @@ void step()
 
 	cyc++;
 
+#if (CPU_CYCLE_WEIGHTS)
+	vclock_cycles += vclock_weights[opcode];
+#else
+	vclock_cycles++;
+#endif
+
+#if (METRICS)
+	metrics.instructions++;
+#endif
+
 #if (CPU >= 586)
 	lock_prefix_active = false;
 #endif
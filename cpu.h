@@ -349,7 +349,6 @@ extern int a20;
 extern unsigned int a20mask;
 
 #if (CPU >= 586)
-extern unsigned __int64 tsc_counter;
 extern std::map<unsigned int, unsigned __int64> msr_registers;
 #endif
 
@@ -4,25 +4,79 @@
 #include "interrupts.h"
 #include "disk.h"
 #include "pic_pit.h"
+#include "vclock.h"
+#if (METRICS)
+#include "metrics.h"
+#endif
 
 fdd_t fdd[NUM_FDD] = {{0}};
 
 hdd_t hdd[NUM_HDD] = {{0}};
 
+// Delay from a command to its interrupt
+#define IDE_COMMAND_NS		50000
+// Retry interval while the data or the bus master is not ready
+#define IDE_RETRY_NS		20000
+
+static void ide_update_timer();
+static void ide_start_timer(hdd_t *ch);
+static void ide_command(int drive, unsigned char value);
+
+// One bus master per IDE channel
+ide_bm_t ide_bm[2];
+
 // Template for drive identify command
 ide_drive_id_t drive_id =
 {
 	0x40, 1023, 0, 16, 512 * 63, 512, 63, {0, 0, 0}, "21436587",
-	{0, 0, 0}, "1r", "yMH DD", {0, 0}, 0, {0, 0, 0}, 0x0001, 1023, 16, 63,
+	{0, 0, 0}, "1r", "yMH DD", 0x8000 | HDD_MAX_MULTIPLE, 0, 0, {0, 0, 0}, 0x0001, 1023, 16, 63,
 	(1023 * 16 * 63) & 0xFFFFu, (1023 * 16 * 63) >> 16u, 0,
 	(1023 * 16 * 63) & 0xFFFFu, (1023 * 16 * 63) >> 16u
 };
 
 
+// hdd_t holds the atomic request state and cannot be cleared with memset. A request the
+// worker still owns is completed first.
+static void hdd_reset(hdd_t *d)
+{
+	diskio_wait(&d->io);
+
+	d->cyls = 0;
+	d->heads = 0;
+	d->sectors = 0;
+	d->drive = 0;
+	d->cyl = 0;
+	d->head = 0;
+	d->sector = 0;
+	d->numsectors = 0;
+	d->count = 0;
+	d->block = 0;
+	d->multiple = 0;
+	d->lba = 0;
+	d->cmd = 0;
+	d->features = 0;
+	d->error = 0;
+	d->pos = 0;
+	d->have_data = 0;
+	d->irq = 0;
+	d->irq_enabled = 0;
+	d->busy = false;
+	d->command_due = 0;
+	d->dma = 0;
+	d->next_cmd = 0;
+	d->io.state.store(DISKIO_IDLE, memory_order_release);
+}
+
 void disk_init()
 {
+	int i;
+
+	diskio_init();
+
 	memset(&fdd, 0, sizeof(fdd));
-	memset(&hdd, 0, sizeof(hdd));
+	for (i = 0; i < NUM_HDD; i++)
+		hdd_reset(&hdd[i]);
+	memset(&ide_bm, 0, sizeof(ide_bm));
 }
 
 int disk_set_fdd(int drive, int cyls, int heads, int sectors)
@@ -48,7 +102,7 @@ int disk_set_hdd(int drive, int cyls, int heads, int sectors)
 
 	hdd_t *d = &hdd[drive];
 
-	memset(d, 0, sizeof(hdd_t));
+	hdd_reset(d);
 
 	d->cyls = cyls;
 	d->heads = heads;
@@ -62,6 +116,28 @@ int disk_set_hdd(int drive, int cyls, int heads, int sectors)
 
 void disk_deinit()
 {
+	diskio_deinit();
+}
+
+// Real mode buffer, NULL if it does not fit into the RAM
+static unsigned char *disk_buffer(unsigned short seg, unsigned short ofs, unsigned int size)
+{
+	unsigned int addr = seg * 16u + ofs;
+
+	// Addresses above 1 MB wrap around while A20 is disabled
+	if (!a20)
+		addr &= 0xFFFFFu;
+
+	if ((addr >= RAM_SIZE) || (size > RAM_SIZE - addr))
+		return NULL;
+
+	return &ram[addr];
+}
+
+static void disk_error(unsigned char status)
+{
+	r.ax = (status << 8) | (r.ax & 0xFF);
+	r.flags |= F_C;
 }
 
 void disk_read()
@@ -70,7 +146,9 @@ void disk_read()
 	int lba;
 	int n;
 
-	void (*hw_read)(int, unsigned char *, unsigned int, unsigned int) = hw_read_floppy;
+	int type = DISKIO_FDD;
+	disk_request_t req;
+	unsigned char *buffer;
 
 	hdd_t *hd;
 	fdd_t *fd;
@@ -94,7 +172,7 @@ void disk_read()
 	if ((drive & 0x80) && ((drive & 0x7F) < NUM_HDD))
 	{
 		hd = &hdd[drive & 0x7F];
-		hw_read = hw_read_hdd;
+		type = DISKIO_HDD;
 		numheads = hd->heads;
 		numsectors = hd->sectors;
 	}
@@ -118,7 +196,15 @@ void disk_read()
 	if (n <= 0)
 		n = 1;
 
-	hw_read(drive & 0x7F, &ram[es.value * 16 + r.bx], lba, n);
+	buffer = disk_buffer(es.value, r.bx, n * 512);
+	if (buffer == NULL)
+	{
+		disk_error(0x09);
+		return;
+	}
+
+	diskio_submit(&req, type, 0, drive & 0x7F, buffer, lba, n);
+	diskio_wait(&req);
 
 	r.flags &= ~F_C;
 	r.ax = r.ax & 0xFF;
@@ -130,7 +216,9 @@ void disk_write()
 	int lba;
 	int n;
 
-	void (*hw_write)(int, const unsigned char *, unsigned int, unsigned int) = hw_write_floppy;
+	int type = DISKIO_FDD;
+	disk_request_t req;
+	unsigned char *buffer;
 	hdd_t *hd;
 	fdd_t *fd;
 
@@ -153,7 +241,7 @@ void disk_write()
 	if ((drive & 0x80) && ((drive & 0x7F) < NUM_HDD))
 	{
 		hd = &hdd[drive & 0x7F];
-		hw_write = hw_write_hdd;
+		type = DISKIO_HDD;
 		numheads = hd->heads;
 		numsectors = hd->sectors;
 	}
@@ -177,7 +265,15 @@ void disk_write()
 	if (n <= 0)
 		n = 1;
 
-	hw_write(drive & 0x7F, &ram[es.value * 16 + r.bx], lba, n);
+	buffer = disk_buffer(es.value, r.bx, n * 512);
+	if (buffer == NULL)
+	{
+		disk_error(0x09);
+		return;
+	}
+
+	diskio_submit(&req, type, 1, drive & 0x7F, buffer, lba, n);
+	diskio_wait(&req);
 	// fseek(fp, lba * 512, SEEK_SET);
 	// fwrite(&ram[es.value * 16 + r.bx], 512, n, fp);
 	
@@ -230,6 +326,130 @@ void disk_info()
 	r.ax = 0x100 | (r.ax & 0xFF);
 }
 
+// EDD extensions are supported for hard disks only
+static hdd_t *disk_ext_drive()
+{
+	if ((r.dl & 0x80) && ((r.dl & 0x7F) < NUM_HDD))
+		return &hdd[r.dl & 0x7F];
+
+	disk_error(0x01);
+	return NULL;
+}
+
+// AH = 41h, BX = 55AAh
+void disk_ext_check()
+{
+	if ((disk_ext_drive() == NULL) || (r.bx != 0x55AA))
+		return;
+
+	// EDD 1.1, fixed disk access subset
+	r.ah = 0x21;
+	r.bx = 0xAA55;
+	r.cx = 0x0001;
+	r.flags &= ~F_C;
+}
+
+// AH = 42h / 43h, DS:SI - disk address packet
+// 00 size, 02 sectors, 04 buffer offset:segment, 08 64-bit LBA
+void disk_ext_transfer(int write)
+{
+	unsigned char *packet, *buffer;
+	unsigned int count, lba, total;
+	disk_request_t req;
+	hdd_t *hd;
+
+	hd = disk_ext_drive();
+	if (hd == NULL)
+		return;
+
+	packet = disk_buffer(ds.value, r.si, 0x10);
+	if ((packet == NULL) || (packet[0] < 0x10))
+	{
+		disk_error(0x01);
+		return;
+	}
+
+	// FFFF:FFFF selects the EDD 3.0 64-bit flat buffer address, not part of EDD 1.1
+	if (*(unsigned int *)&packet[0x04] == 0xFFFFFFFFu)
+	{
+		*(unsigned short *)&packet[0x02] = 0;
+		disk_error(0x01);
+		return;
+	}
+
+	count = *(unsigned short *)&packet[0x02];
+	buffer = disk_buffer(*(unsigned short *)&packet[0x06], *(unsigned short *)&packet[0x04], count * 512);
+
+	lba = *(unsigned int *)&packet[0x08];
+	total = hd->cyls * hd->heads * hd->sectors;
+
+	if ((*(unsigned int *)&packet[0x0C] != 0) || (lba > total) || (count > total - lba))
+	{
+		*(unsigned short *)&packet[0x02] = 0;
+		disk_error(0x04);
+		return;
+	}
+
+	if (buffer == NULL)
+	{
+		*(unsigned short *)&packet[0x02] = 0;
+		disk_error(0x09);
+		return;
+	}
+
+	// The whole request goes to the image in one call
+	if (count > 0)
+	{
+		diskio_submit(&req, DISKIO_HDD, write, r.dl & 0x7F, buffer, lba, count);
+		diskio_wait(&req);
+	}
+
+	r.ah = 0;
+	r.flags &= ~F_C;
+}
+
+// AH = 48h, DS:SI - result buffer, the first word is the buffer size
+void disk_ext_params()
+{
+	unsigned char *p;
+	unsigned int total;
+	hdd_t *hd;
+
+	hd = disk_ext_drive();
+	if (hd == NULL)
+		return;
+
+	p = disk_buffer(ds.value, r.si, 0x1E);
+	if ((p == NULL) || (*(unsigned short *)&p[0x00] < 0x1A))
+	{
+		disk_error(0x01);
+		return;
+	}
+
+	total = hd->cyls * hd->heads * hd->sectors;
+
+	// 02 flags: CHS information is valid
+	*(unsigned short *)&p[0x02] = 0x0002;
+	*(unsigned int *)&p[0x04] = hd->cyls;
+	*(unsigned int *)&p[0x08] = hd->heads;
+	*(unsigned int *)&p[0x0C] = hd->sectors;
+	*(unsigned int *)&p[0x10] = total;
+	*(unsigned int *)&p[0x14] = 0;
+	*(unsigned short *)&p[0x18] = 512;
+
+	if (*(unsigned short *)&p[0x00] >= 0x1E)
+	{
+		// No device parameter table extension
+		*(unsigned int *)&p[0x1A] = 0xFFFFFFFFu;
+		*(unsigned short *)&p[0x00] = 0x1E;
+	}
+	else
+		*(unsigned short *)&p[0x00] = 0x1A;
+
+	r.ah = 0;
+	r.flags &= ~F_C;
+}
+
 void bios_disk()
 {
 	int f = r.ah;
@@ -249,6 +469,27 @@ void bios_disk()
 		case 8:
 			disk_info();
 			return;
+		case 0x41:
+			disk_ext_check();
+			return;
+		case 0x42:
+			disk_ext_transfer(0);
+			return;
+		case 0x43:
+			disk_ext_transfer(1);
+			return;
+		case 0x44:
+		case 0x47:
+			// Verify and seek have nothing to do
+			if (disk_ext_drive() != NULL)
+			{
+				r.ah = 0;
+				r.flags &= ~F_C;
+			}
+			return;
+		case 0x48:
+			disk_ext_params();
+			return;
 		case 0x95:
 			if (r.dl == 0x0)
 			{
@@ -300,9 +541,343 @@ void ide_irq(int drive)
 		irq(drive >= 2 ? 15 : 14);
 }
 
-void ide_write(int port, unsigned char value)
+// Status register, the alternate status at 3F6h reads the same without clearing the interrupt
+static unsigned char ide_status(hdd_t *d)
+{
+	unsigned char r;
+
+	if ((d->busy) || (diskio_busy(&d->io)))
+		return HDD_STATUS_BUSY | HDD_STATUS_SEEK;
+
+	r = HDD_STATUS_READY | HDD_STATUS_SEEK;
+	if (d->have_data)
+		r |= HDD_STATUS_DRQ;
+	if (d->error)
+		r |= HDD_STATUS_ERROR;
+	return r;
+}
+
+// The whole transfer is already in the buffer, raise DRQ interrupt for every next sector
+unsigned char ide_read_data(int drive)
+{
+	hdd_t *d = &hdd[drive];
+	unsigned char r;
+
+	// No data until the worker has filled the buffer
+	if ((d->busy) || (diskio_busy(&d->io)))
+		return 0xFF;
+
+	r = d->buffer[d->pos++ % sizeof(d->buffer)];
+#if (METRICS)
+	metrics.ide_bytes_in++;
+#endif
+
+	if (d->have_data)
+	{
+		d->have_data--;
+
+		if ((d->block) && (d->pos % (d->block * 512) == 0) && (d->have_data))
+			ide_irq(drive);
+	}
+
+	return r;
+}
+
+// Sectors are collected in the buffer and go to the disk in one call after the last byte
+void ide_write_data(int drive, unsigned char value)
+{
+	hdd_t *d = &hdd[drive];
+
+	if (!d->have_data)
+		return;
+
+	d->buffer[d->pos++ % sizeof(d->buffer)] = value;
+	d->have_data--;
+#if (METRICS)
+	metrics.ide_bytes_out++;
+#endif
+
+	if ((d->cmd != HDD_CMD_WRITE) && (d->cmd != HDD_CMD_WRITE_MULTIPLE))
+		return;
+
+	if (d->have_data == 0)
+	{
+		// Interrupt is raised when the data is written
+		diskio_submit(&d->io, DISKIO_HDD, 1, drive, d->buffer, d->lba, d->count);
+		d->pos = 0;
+		d->busy = true;
+		ide_start_timer(d);
+	}
+	else if (d->pos % (d->block * 512) == 0)
+		ide_irq(drive);
+}
+
+// Copies between the buffer and guest memory, one memcpy per PRD entry.
+// Entries are 8 bytes: physical address, byte count (0 means 64 KB), bit 15 of the last word marks the last entry.
+static int ide_dma_copy(int channel, unsigned char *buffer, unsigned int size, int to_memory)
+{
+	unsigned int prd = ide_bm[channel].prd & ~3u;
+	unsigned int addr, n, done = 0;
+	int last;
+
+	while (done < size)
+	{
+		if (prd > RAM_SIZE - 8)
+			return 0;
+
+		addr = *(unsigned int *)&ram[prd];
+		n = *(unsigned short *)&ram[prd + 4];
+		if (n == 0)
+			n = 0x10000;
+		last = ram[prd + 7] & 0x80;
+		prd += 8;
+
+		if (n > size - done)
+			n = size - done;
+		if ((addr >= RAM_SIZE) || (n > RAM_SIZE - addr))
+			return 0;
+
+		if (to_memory)
+			memcpy(&ram[addr], buffer + done, n);
+		else
+			memcpy(buffer + done, &ram[addr], n);
+		done += n;
+
+		if (last)
+			break;
+	}
+
+	// PRD table is shorter than the transfer
+	return done == size;
+}
+
+// Called when the drive is ready for a DMA command, returns 1 when the interrupt can be raised
+static int ide_dma_transfer(int drive)
+{
+	hdd_t *d = &hdd[drive];
+	ide_bm_t *bm = &ide_bm[drive >> 1];
+
+	if (~bm->command & IDE_BM_CMD_START)
+		return 0;
+
+	// Bus master direction must match the command
+	if ((d->dma == 1) && ((d->cmd == HDD_CMD_READ_DMA) != ((bm->command & IDE_BM_CMD_READ) != 0)))
+	{
+		d->error = HDD_ERROR_ABORT;
+		bm->status |= IDE_BM_STATUS_ERROR;
+	}
+	else if (d->cmd == HDD_CMD_READ_DMA)
+	{
+		if (!ide_dma_copy(drive >> 1, d->buffer, d->count * 512, 1))
+			bm->status |= IDE_BM_STATUS_ERROR;
+	}
+	else if (d->dma == 1)
+	{
+		if (!ide_dma_copy(drive >> 1, d->buffer, d->count * 512, 0))
+			bm->status |= IDE_BM_STATUS_ERROR;
+		else
+		{
+			// Interrupt is raised when the data is written
+			diskio_submit(&d->io, DISKIO_HDD, 1, drive, d->buffer, d->lba, d->count);
+			d->dma = 2;
+			return 0;
+		}
+	}
+
+	d->dma = 0;
+	bm->status = (bm->status & ~IDE_BM_STATUS_ACTIVE) | IDE_BM_STATUS_IRQ;
+	return 1;
+}
+
+// Bus master stopped by the guest, DMA commands of the channel end with an error and no interrupt.
+// A write that is already queued completes, it only uses the drive buffer.
+static void ide_dma_abort(int channel)
+{
+	hdd_t *d;
+	int i;
+
+	for (i = channel * 2; (i < channel * 2 + 2) && (i < NUM_HDD); i++)
+	{
+		d = &hdd[i];
+		if (!d->dma)
+			continue;
+
+		d->dma = 0;
+		d->busy = false;
+		d->error = HDD_ERROR_ABORT;
+		// A command written meanwhile still starts from the timer
+		if (!d->next_cmd)
+			d->command_due = 0;
+		ide_bm[channel].status |= IDE_BM_STATUS_ERROR;
+	}
+
+	ide_update_timer();
+}
+
+static void ide_timer_event()
+{
+	unsigned __int64 now = vclock_now();
+	int i, cmd;
+
+	for (i = 0; i < NUM_HDD; i++)
+	{
+		if ((hdd[i].command_due == 0) || (hdd[i].command_due > now))
+			continue;
+
+		// Interrupt is raised when the data is ready, DMA commands also wait for the bus master
+		if ((diskio_busy(&hdd[i].io)) || ((hdd[i].dma) && (!ide_dma_transfer(i))))
+		{
+			hdd[i].command_due = now + IDE_RETRY_NS;
+			continue;
+		}
+
+		hdd[i].command_due = 0;
+		ide_irq(i);
+
+		// Command written while the request was running
+		if (hdd[i].next_cmd)
+		{
+			cmd = hdd[i].next_cmd & 0xFF;
+			hdd[i].next_cmd = 0;
+			ide_command(i, cmd);
+		}
+	}
+
+	ide_update_timer();
+}
+
+// Schedules the earliest command interrupt
+static void ide_update_timer()
+{
+	unsigned __int64 due = VCLOCK_NEVER;
+	int i;
+
+	for (i = 0; i < NUM_HDD; i++)
+		if ((hdd[i].command_due != 0) && (hdd[i].command_due < due))
+			due = hdd[i].command_due;
+
+	if (due == VCLOCK_NEVER)
+		vclock_cancel(VCLOCK_EVENT_IDE);
+	else
+		vclock_schedule(VCLOCK_EVENT_IDE, due, ide_timer_event);
+}
+
+static void ide_start_timer(hdd_t *ch)
+{
+	ch->command_due = vclock_now() + IDE_COMMAND_NS;
+	ide_update_timer();
+}
+
+// Starts a command written to 1F7h, the registers of the channel hold its parameters
+static void ide_command(int drive, unsigned char value)
 {
 	unsigned int lba;
+	hdd_t *d = &hdd[drive & ~1];
+	hdd_t *ch = &hdd[drive];
+
+	d->have_data = 0;
+	ch->error = 0;
+	ch->dma = 0;
+	ch->block = 0;
+	ch->busy = true;
+	lba = (d->cyl * ch->heads + d->head) * ch->sectors + d->sector - 1;
+	ch->cmd = value;
+
+	// Block mode must be enabled first
+	if (((value == HDD_CMD_READ_MULTIPLE) || (value == HDD_CMD_WRITE_MULTIPLE)) && (ch->multiple == 0))
+	{
+		ch->error = HDD_ERROR_ABORT;
+		ide_start_timer(ch);
+		return;
+	}
+
+	switch (value)
+	{
+		case HDD_CMD_RESTORE:
+		case HDD_CMD_SEEK:
+			ide_start_timer(ch);
+			break;
+		case HDD_CMD_INIT:
+			ch->busy = false;
+			break;
+		case HDD_CMD_READ:
+		case HDD_CMD_READ_MULTIPLE:
+			ch->lba = lba;
+			ch->count = d->numsectors > 0 ? d->numsectors : HDD_MAX_SECTORS;
+			ch->block = value == HDD_CMD_READ ? 1 : ch->multiple;
+			diskio_submit(&ch->io, DISKIO_HDD, 0, drive, ch->buffer, ch->lba, ch->count);
+			ch->pos = 0;
+			ch->have_data = ch->count * 512;
+			ide_start_timer(ch);
+			break;
+		case HDD_CMD_WRITE:
+		case HDD_CMD_WRITE_MULTIPLE:
+			ch->lba = lba;
+			ch->count = d->numsectors > 0 ? d->numsectors : HDD_MAX_SECTORS;
+			ch->block = value == HDD_CMD_WRITE ? 1 : ch->multiple;
+			ch->pos = 0;
+			ch->have_data = ch->count * 512;
+			ide_start_timer(ch);
+			break;
+		case HDD_CMD_READ_DMA:
+			ch->lba = lba;
+			ch->count = d->numsectors > 0 ? d->numsectors : HDD_MAX_SECTORS;
+			diskio_submit(&ch->io, DISKIO_HDD, 0, drive, ch->buffer, ch->lba, ch->count);
+			ch->dma = 1;
+			ide_start_timer(ch);
+			break;
+		case HDD_CMD_WRITE_DMA:
+			ch->lba = lba;
+			ch->count = d->numsectors > 0 ? d->numsectors : HDD_MAX_SECTORS;
+			ch->dma = 1;
+			ide_start_timer(ch);
+			break;
+		case HDD_CMD_SET_MULTIPLE:
+			// Block size must be a power of 2, 0 disables block mode
+			if ((d->numsectors > HDD_MAX_MULTIPLE) || (d->numsectors & (d->numsectors - 1)))
+				ch->error = HDD_ERROR_ABORT;
+			else
+				ch->multiple = d->numsectors;
+			ide_start_timer(ch);
+			break;
+		case HDD_CMD_SPECIFY:
+		case HDD_CMD_SET_FEATURES:
+			ide_start_timer(ch);
+			break;
+		case HDD_CMD_IDENTIFY:
+			memset(ch->buffer, 0, 512);
+			drive_id.current_cyls = ch->cyls;
+			drive_id.current_heads = ch->heads;
+			drive_id.current_sectors = ch->sectors;
+			drive_id.cyls = ch->cyls;
+			drive_id.heads = ch->heads;
+			drive_id.sectors = ch->sectors;
+			drive_id.current_lba_capacity_low = (ch->cyls * ch->heads * ch->sectors) & 0xFFFFu;
+			drive_id.current_lba_capacity_high = (ch->cyls * ch->heads * ch->sectors) >> 16u;
+			drive_id.default_lba_capacity_low = (ch->cyls * ch->heads * ch->sectors) & 0xFFFFu;
+			drive_id.default_lba_capacity_high = (ch->cyls * ch->heads * ch->sectors) >> 16u;
+			// DMA supported, multiword DMA modes 0 - 2 with mode 2 selected
+			drive_id.capabilites |= 0x0100;
+			drive_id.reserved7[63 - 62] = 0x0407;
+			drive_id.current_multiple = ch->multiple ? 0x0100 | ch->multiple : 0;
+			drive_id.serial_number[0] += drive;
+
+			memcpy(ch->buffer, &drive_id, sizeof(drive_id));
+
+			ch->pos = 0;
+			d->numsectors = 1;
+			ch->count = 1;
+			ch->have_data = d->numsectors * 512;
+
+			ide_start_timer(ch);
+			break;
+		default:
+			break;
+	}
+}
+
+void ide_write(int port, unsigned char value)
+{
 	hdd_t *d;
 	hdd_t *ch;
 
@@ -317,34 +892,10 @@ void ide_write(int port, unsigned char value)
 	switch (port | 0x80)
 	{
 		case 0x1F0:
-			if (ch->pos < sizeof(ch->buffer))
-			{
-				ch->buffer[ch->pos] = value;
-			}
-			ch->pos++;
-			if ((ch->cmd == HDD_CMD_WRITE) && (ch->numsectors > 0))
-			{
-				if (ch->pos >= 512 * ch->numsectors)
-					ch->pos = 0;
-			}
+			ide_write_data(drive, value);
 			break;
 		case 0x1F1:
-			if ((ch->cmd == HDD_CMD_WRITE) && (ch->numsectors > 0))
-			{
-				ch->pos++;
-
-				if (ch->pos % 512 == 0)
-				{
-					d->lba++;
-					hw_write_hdd(drive, d->buffer, d->lba, 1);
-				}
-
-				if ((ch->pos % 512 == 0) && (ch->pos / 512 < ch->numsectors))
-					ide_irq(drive);
-
-				if (ch->pos >= 512 * ch->numsectors)
-					ch->pos = 0;
-			}
+			d->features = value;
 			break;
 		case 0x1F2:
 			d->numsectors = value;
@@ -369,61 +920,13 @@ void ide_write(int port, unsigned char value)
 			ch->have_data = 0;
 			break;
 		case 0x1F7:
-			d->have_data = 0;
-			ch->error = 0;
-			ch->busy = true;
-			lba = (d->cyl * ch->heads + d->head) * ch->sectors + d->sector - 1;
-			d->cmd = value;
-			switch (value)
+			// The previous disk request still owns the buffer, the command starts when it completes
+			if (diskio_busy(&ch->io))
 			{
-				case HDD_CMD_RESTORE:
-				case HDD_CMD_SEEK:
-					ch->command_timer = 100;
-					break;
-				case HDD_CMD_INIT:
-					ch->busy = false;
-					break;
-				case HDD_CMD_READ:
-					ch->lba = lba;
-					hw_read_hdd(drive, ch->buffer, ch->lba, 1);
-					ch->pos = 0;
-					ch->have_data = d->numsectors * 512;
-					ch->command_timer = 100;
-					break;
-				case HDD_CMD_WRITE:
-					ch->lba = lba;
-					ch->pos = 0;
-					ch->have_data = d->numsectors * 512;
-					ch->command_timer = 100;
-					break;
-				case HDD_CMD_SPECIFY:
-					ch->command_timer = 100;
-					break;
-				case HDD_CMD_IDENTIFY:
-					memset(ch->buffer, 0, 512);
-					drive_id.current_cyls = ch->cyls;
-					drive_id.current_heads = ch->heads;
-					drive_id.current_sectors = ch->sectors;
-					drive_id.cyls = ch->cyls;
-					drive_id.heads = ch->heads;
-					drive_id.sectors = ch->sectors;
-					drive_id.current_lba_capacity_low = (ch->cyls * ch->heads * ch->sectors) & 0xFFFFu;
-					drive_id.current_lba_capacity_high = (ch->cyls * ch->heads * ch->sectors) >> 16u;
-					drive_id.default_lba_capacity_low = (ch->cyls * ch->heads * ch->sectors) & 0xFFFFu;
-					drive_id.default_lba_capacity_high = (ch->cyls * ch->heads * ch->sectors) >> 16u;
-					drive_id.serial_number[0] += drive;
-
-					memcpy(ch->buffer, &drive_id, sizeof(drive_id));
-
-					ch->pos = 0;
-					d->numsectors = 1;
-					ch->have_data = d->numsectors * 512;
-
-					ch->command_timer = 100;
-					break;
-				default:
-					break;
+				ch->next_cmd = value | 0x100;
+				break;
 			}
+			ide_command(drive, value);
 			break;
 		case 0x3F6:
 			// Interrupt / reset register
@@ -451,45 +954,12 @@ unsigned char ide_read(int port)
 	switch (port | 0x80)
 	{
 		case 0x1F0:
-			r = d->buffer[d->pos++ % sizeof(d->buffer)];
-
-			if (d->pos % 512 == 0)
-			{
-				d->lba++;
-				hw_read_hdd(drive, d->buffer, d->lba, 1);
-			}
-
-			if ((d->numsectors > 0) && (d->cmd == HDD_CMD_READ) && (d->pos % 512 == 0) && (d->pos / 512 < d->numsectors))
-			{
-				ide_irq(drive);
-			}
-
-			if (d->have_data)
-			{
-				d->have_data--;
-			}
+			r = ide_read_data(drive);
 			break;
 		case 0x1F1:
 			if (last_0)
 			{
-				r = d->buffer[d->pos++ % sizeof(d->buffer)];
-			
-				if (d->pos % 512 == 0)
-				{
-					d->lba++;
-					hw_read_hdd(drive, d->buffer, d->lba, 1);
-				}
-
-				if (d->have_data)
-				{
-					d->have_data--;
-				}
-
-				if ((d->numsectors > 0) && (d->cmd == HDD_CMD_READ) && (d->pos % 512 == 0) && (d->pos / 512 < d->numsectors))
-				{
-					if (d->have_data)
-						ide_irq(drive);
-				}
+				r = ide_read_data(drive);
 			}
 			else
 			{
@@ -514,20 +984,13 @@ unsigned char ide_read(int port)
 				r |= 0x10;
 			break;
 		case 0x1F7:
-			irqs &= ~((1 << 15) | (1 << 14));
+			irq_clear(14);
+			irq_clear(15);
 			d->irq = 0;
-			if (d->busy) {
-				r = HDD_STATUS_BUSY | HDD_STATUS_SEEK;
-			}
-			else {
-				r = HDD_STATUS_READY | HDD_STATUS_SEEK;
-				if (d->have_data) {
-					r |= HDD_STATUS_DRQ;
-				}
-			}
+			r = ide_status(d);
 			break;
 		case 0x3F6:
-			r = ((d->have_data) ? 0x08 : 0) | 0x50;
+			r = ide_status(d);
 			break;
 		case 0x3F7:
 			r = d->head | (d->drive ? 0x10 : 0);
@@ -538,17 +1001,57 @@ unsigned char ide_read(int port)
 	return r;
 }
 
-void ide_timer_tick()
+void ide_bm_write(int port, unsigned char value)
 {
-	for (int i = 0; i < NUM_HDD; ++i)
+	ide_bm_t *bm = &ide_bm[(port >> 3) & 1];
+	int shift;
+
+	switch (port & 7)
 	{
-		if (hdd[i].command_timer > 0)
-		{
-			hdd[i].command_timer--;
-			if (hdd[i].command_timer == 0)
+		case IDE_BM_COMMAND:
+			// Clearing the start bit aborts the transfer
+			if (value & IDE_BM_CMD_START)
+				bm->status |= IDE_BM_STATUS_ACTIVE;
+			else
 			{
-				ide_irq(i);
+				bm->status &= ~IDE_BM_STATUS_ACTIVE;
+				if (bm->command & IDE_BM_CMD_START)
+					ide_dma_abort((port >> 3) & 1);
 			}
-		}
+			bm->command = value & (IDE_BM_CMD_START | IDE_BM_CMD_READ);
+			break;
+		case IDE_BM_STATUS:
+			// Interrupt and error bits are cleared by writing 1
+			bm->status &= ~(value & (IDE_BM_STATUS_ERROR | IDE_BM_STATUS_IRQ));
+			bm->status = (bm->status & ~(IDE_BM_STATUS_DMA0 | IDE_BM_STATUS_DMA1)) |
+				(value & (IDE_BM_STATUS_DMA0 | IDE_BM_STATUS_DMA1));
+			break;
+		case IDE_BM_PRD:
+		case IDE_BM_PRD + 1:
+		case IDE_BM_PRD + 2:
+		case IDE_BM_PRD + 3:
+			shift = ((port & 7) - IDE_BM_PRD) * 8;
+			bm->prd = (bm->prd & ~(0xFFu << shift)) | (value << shift);
+			break;
+	}
+}
+
+unsigned char ide_bm_read(int port)
+{
+	ide_bm_t *bm = &ide_bm[(port >> 3) & 1];
+
+	switch (port & 7)
+	{
+		case IDE_BM_COMMAND:
+			return bm->command;
+		case IDE_BM_STATUS:
+			return bm->status;
+		case IDE_BM_PRD:
+		case IDE_BM_PRD + 1:
+		case IDE_BM_PRD + 2:
+		case IDE_BM_PRD + 3:
+			return (bm->prd >> (((port & 7) - IDE_BM_PRD) * 8)) & 0xFF;
 	}
-}
\ No newline at end of file
+
+	return 0;
+}
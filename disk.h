@@ -1,6 +1,8 @@
 #ifndef DISK_H
 #define DISK_H
 
+#include "diskio.h"
+
 #define HDD_DATA			0x1F0
 #define HDD_ERROR			0x1F1
 #define HDD_NUMSECTORS		0x1F2
@@ -11,6 +13,22 @@
 #define HDD_STATUS			0x1F7
 #define HDD_CMD				0x3F6
 
+// Bus master IDE registers (PIIX style), primary channel at IDE_BM_BASE, secondary at IDE_BM_BASE + 8
+#define IDE_BM_BASE			0xF000
+#define IDE_BM_COMMAND		0
+#define IDE_BM_STATUS		2
+#define IDE_BM_PRD			4
+
+#define IDE_BM_CMD_START	0x01
+// Set for transfers to memory (READ DMA)
+#define IDE_BM_CMD_READ		0x08
+
+#define IDE_BM_STATUS_ACTIVE	0x01
+#define IDE_BM_STATUS_ERROR		0x02
+#define IDE_BM_STATUS_IRQ		0x04
+#define IDE_BM_STATUS_DMA0		0x20
+#define IDE_BM_STATUS_DMA1		0x40
+
 #define HDD_STATUS_ERROR	0x01
 #define HDD_STATUS_ECC		0x04
 #define HDD_STATUS_DRQ		0x08
@@ -19,6 +37,8 @@
 #define HDD_STATUS_READY	0x40
 #define HDD_STATUS_BUSY		0x80
 
+#define HDD_ERROR_ABORT		0x04
+
 #define HDD_CMD_RESTORE			0x10
 #define HDD_CMD_READ			0x20
 #define HDD_CMD_WRITE			0x30
@@ -28,9 +48,20 @@
 #define HDD_CMD_SEEK			0x70
 #define HDD_CMD_DIAG			0x90
 #define HDD_CMD_SPECIFY			0x91
+#define HDD_CMD_READ_MULTIPLE	0xC4
+#define HDD_CMD_WRITE_MULTIPLE	0xC5
+#define HDD_CMD_SET_MULTIPLE	0xC6
+#define HDD_CMD_READ_DMA		0xC8
+#define HDD_CMD_WRITE_DMA		0xCA
+#define HDD_CMD_SET_FEATURES	0xEF
 #define HDD_CMD_IDENTIFY		0xEC
 #define HDD_CMD_IDENTIFY_ATAPI	0xEC
 
+// Sector count register value 0 means 256 sectors
+#define HDD_MAX_SECTORS			256
+// Largest block for READ / WRITE MULTIPLE
+#define HDD_MAX_MULTIPLE		128
+
 typedef struct
 {
 	int cyls;
@@ -50,19 +81,42 @@ typedef struct
 	int head;
 	int sector;
 	int numsectors;
+	// Sectors in the current data transfer
+	int count;
+	// Sectors per DRQ block of the current transfer, 0 - no interrupt between blocks
+	int block;
+	// Block size set by SET MULTIPLE MODE, 0 - disabled
+	int multiple;
 	unsigned int lba;
 	int cmd;
+	int features;
 	int error;
 	int pos;
 	int have_data;
 	int irq;
 	int irq_enabled;
 	bool busy;
-	int command_timer;
+	// Virtual time of the command interrupt, 0 - none
+	unsigned __int64 command_due;
+	// DMA command waits for the bus master to start
+	int dma;
+	// 0x100 | command written while the disk request was still running
+	int next_cmd;
+	// New fields are cleared in hdd_reset, the struct cannot be memset
+	disk_request_t io;
 	
-	unsigned char buffer[512];
+	// Whole transfer is read at command start and written at completion
+	unsigned char buffer[HDD_MAX_SECTORS * 512];
 } hdd_t;
 
+typedef struct
+{
+	unsigned char command;
+	unsigned char status;
+	// Physical address of the PRD table
+	unsigned int prd;
+} ide_bm_t;
+
 typedef struct
 {
 	// 00  0x40 - fixed disk, 0x80 - removable
@@ -89,8 +143,10 @@ typedef struct
 	unsigned char firmware_ver[8];
 	// 27 - 46
 	unsigned char model_name[40];
-	// 47 - 48
-	unsigned short reserved4[2];
+	// 47  0x8000 | max sectors per READ / WRITE MULTIPLE block
+	unsigned short max_multiple;
+	// 48
+	unsigned short reserved4;
 	// 49  0x200 - LBA supported
 	unsigned short capabilites;
 	// 50 - 52
@@ -107,8 +163,8 @@ typedef struct
 	unsigned short current_lba_capacity_low;
 	// 58
 	unsigned short current_lba_capacity_high;
-	// 59
-	unsigned short reserved6;
+	// 59  0x0100 | current sectors per block
+	unsigned short current_multiple;
 	// 60
 	unsigned int default_lba_capacity_low;
 	// 61
@@ -119,7 +175,6 @@ typedef struct
 
 
 void disk_init();
-void ide_timer_tick();
 int disk_set_fdd(int drive, int cyls, int heads, int sectors);
 int disk_set_hdd(int drive, int cyls, int heads, int sectors);
 void disk_deinit();
@@ -132,5 +187,7 @@ void hw_write_hdd(int disk, const unsigned char *buffer, unsigned int lba, unsig
 
 void ide_write(int port, unsigned char value);
 unsigned char ide_read(int port);
+void ide_bm_write(int port, unsigned char value);
+unsigned char ide_bm_read(int port);
 
 #endif
@@ -0,0 +1,197 @@
+#include "stdafx.h"
+#include "disk.h"
+#include "diskio.h"
+#if (METRICS)
+#include "metrics.h"
+#endif
+
+// Disk requests are executed by a worker thread so the CPU thread never waits
+// for the host storage. IDE commands complete through the command timer event / ide_irq,
+// INT 13h waits for its own request only.
+
+#if (ASYNC_DISK_IO)
+#include <condition_variable>
+
+static thread *diskio_thread = NULL;
+static mutex diskio_mtx;
+static condition_variable diskio_wake;
+static condition_variable diskio_complete;
+
+static disk_request_t *diskio_queue[DISKIO_QUEUE_SIZE];
+static int diskio_rp = 0;
+static int diskio_count = 0;
+static int diskio_active = 0;
+static bool diskio_stop = false;
+#endif
+
+static void diskio_execute(disk_request_t *req)
+{
+	if (req->type == DISKIO_HDD)
+	{
+		if (req->write)
+			hw_write_hdd(req->drive, req->buffer, req->lba, req->count);
+		else
+			hw_read_hdd(req->drive, req->buffer, req->lba, req->count);
+	}
+	else
+	{
+		if (req->write)
+			hw_write_floppy(req->drive, req->buffer, req->lba, req->count);
+		else
+			hw_read_floppy(req->drive, req->buffer, req->lba, req->count);
+	}
+}
+
+#if (ASYNC_DISK_IO)
+static void diskio_worker()
+{
+	disk_request_t *req;
+
+	for (;;)
+	{
+		{
+			unique_lock<mutex> lock(diskio_mtx);
+
+			while ((!diskio_stop) && (diskio_count == 0))
+				diskio_wake.wait(lock);
+
+			if (diskio_count == 0)
+				return;
+
+			req = diskio_queue[diskio_rp++];
+			diskio_rp %= DISKIO_QUEUE_SIZE;
+			diskio_count--;
+			diskio_active = 1;
+		}
+
+		diskio_execute(req);
+
+		{
+			lock_guard<mutex> lock(diskio_mtx);
+			req->state.store(DISKIO_DONE, memory_order_release);
+			diskio_active = 0;
+		}
+		diskio_complete.notify_all();
+	}
+}
+#endif
+
+void diskio_init()
+{
+#if (ASYNC_DISK_IO)
+	if (diskio_thread != NULL)
+	{
+		// Requests may point to buffers that are about to be cleared
+		diskio_drain();
+		return;
+	}
+
+	diskio_rp = 0;
+	diskio_count = 0;
+	diskio_active = 0;
+	diskio_stop = false;
+	diskio_thread = new thread(diskio_worker);
+#endif
+}
+
+// Called on the CPU thread when it sees the request completed, so the counters have a single writer
+static void diskio_finish(disk_request_t *req)
+{
+#if (METRICS)
+	if (req->type == DISKIO_HDD)
+	{
+		if (req->write)
+			metrics.hdd_sectors_written += req->count;
+		else
+			metrics.hdd_sectors_read += req->count;
+	}
+#endif
+	req->state.store(DISKIO_IDLE, memory_order_relaxed);
+}
+
+// Requests are executed in submission order
+void diskio_submit(disk_request_t *req, int type, int write, int drive, unsigned char *buffer, unsigned int lba, unsigned int count)
+{
+	// The previous request of this slot may have completed unnoticed
+	if (req->state.load(memory_order_acquire) == DISKIO_DONE)
+		diskio_finish(req);
+
+	req->type = type;
+	req->write = write;
+	req->drive = drive;
+	req->buffer = buffer;
+	req->lba = lba;
+	req->count = count;
+
+#if (ASYNC_DISK_IO)
+	if (diskio_thread != NULL)
+	{
+		{
+			unique_lock<mutex> lock(diskio_mtx);
+
+			while (diskio_count >= DISKIO_QUEUE_SIZE)
+				diskio_complete.wait(lock);
+
+			req->state.store(DISKIO_PENDING, memory_order_release);
+			diskio_queue[(diskio_rp + diskio_count) % DISKIO_QUEUE_SIZE] = req;
+			diskio_count++;
+		}
+		diskio_wake.notify_one();
+		return;
+	}
+#endif
+
+	diskio_execute(req);
+	req->state.store(DISKIO_DONE, memory_order_release);
+}
+
+int diskio_busy(disk_request_t *req)
+{
+	if (req->state.load(memory_order_acquire) == DISKIO_DONE)
+		diskio_finish(req);
+	return req->state.load(memory_order_relaxed) != DISKIO_IDLE;
+}
+
+void diskio_wait(disk_request_t *req)
+{
+#if (ASYNC_DISK_IO)
+	{
+		unique_lock<mutex> lock(diskio_mtx);
+
+		while (req->state.load(memory_order_acquire) == DISKIO_PENDING)
+			diskio_complete.wait(lock);
+	}
+#endif
+
+	if (req->state.load(memory_order_acquire) == DISKIO_DONE)
+		diskio_finish(req);
+}
+
+void diskio_drain()
+{
+#if (ASYNC_DISK_IO)
+	unique_lock<mutex> lock(diskio_mtx);
+
+	while ((diskio_count > 0) || (diskio_active))
+		diskio_complete.wait(lock);
+#endif
+}
+
+void diskio_deinit()
+{
+#if (ASYNC_DISK_IO)
+	if (diskio_thread == NULL)
+		return;
+
+	{
+		lock_guard<mutex> lock(diskio_mtx);
+		diskio_stop = true;
+	}
+	diskio_wake.notify_one();
+
+	// The worker finishes all queued requests before it exits
+	diskio_thread->join();
+	delete diskio_thread;
+	diskio_thread = NULL;
+#endif
+}
@@ -0,0 +1,36 @@
+#ifndef DISKIO_H
+#define DISKIO_H
+
+#include <atomic>
+
+#define DISKIO_FDD			0
+#define DISKIO_HDD			1
+
+#define DISKIO_IDLE			0
+#define DISKIO_PENDING		1
+// Executed, the CPU thread has not seen the completion yet
+#define DISKIO_DONE			2
+
+// Requests waiting for the worker, submit blocks while the queue is full
+#define DISKIO_QUEUE_SIZE	16
+
+typedef struct
+{
+	int type;
+	int write;
+	int drive;
+	unsigned char *buffer;
+	unsigned int lba;
+	unsigned int count;
+	// Release store by the side that hands the buffer over, acquire load by the other
+	atomic<int> state{DISKIO_IDLE};
+} disk_request_t;
+
+void diskio_init();
+void diskio_submit(disk_request_t *req, int type, int write, int drive, unsigned char *buffer, unsigned int lba, unsigned int count);
+int diskio_busy(disk_request_t *req);
+void diskio_wait(disk_request_t *req);
+void diskio_drain();
+void diskio_deinit();
+
+#endif
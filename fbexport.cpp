@@ -0,0 +1,74 @@
+#include "stdafx.h"
+#include "vga.h"
+#include "fbexport.h"
+
+#include <atomic>
+
+static HANDLE fb_mapping = NULL;
+static fb_export_t *fb_header = NULL;
+
+void fb_export_init()
+{
+	unsigned int size = sizeof(fb_export_t) + SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(unsigned int);
+
+	if (fb_header != NULL)
+		return;
+
+	fb_mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, size, FB_EXPORT_NAME);
+	if (fb_mapping == NULL)
+		return;
+
+	fb_header = (fb_export_t *)MapViewOfFile(fb_mapping, FILE_MAP_WRITE, 0, 0, 0);
+	if (fb_header == NULL)
+	{
+		CloseHandle(fb_mapping);
+		fb_mapping = NULL;
+		return;
+	}
+
+	// A viewer may already be attached to a section left by a previous run
+	fb_header->sequence |= 1;
+	atomic_thread_fence(memory_order_release);
+	fb_header->magic = FB_EXPORT_MAGIC;
+	fb_header->version = FB_EXPORT_VERSION;
+	fb_header->header_size = sizeof(fb_export_t);
+	fb_header->frame = 0;
+	fb_header->mode = 0;
+	fb_header->mode_width = 0;
+	fb_header->mode_height = 0;
+	fb_header->mode_bpp = 0;
+	fb_header->width = SCREEN_WIDTH;
+	fb_header->height = SCREEN_HEIGHT;
+	atomic_thread_fence(memory_order_release);
+	fb_header->sequence++;
+}
+
+void fb_export_frame(const unsigned int *pixels, unsigned int frame)
+{
+	if (fb_header == NULL)
+		return;
+
+	// Nobody is watching
+	if (GetTickCount() - fb_header->viewer_tick > FB_EXPORT_VIEWER_TIMEOUT)
+		return;
+
+	fb_header->sequence++;
+	atomic_thread_fence(memory_order_release);
+
+	fb_header->frame = frame;
+	vga_frame_info(&fb_header->mode, &fb_header->mode_width, &fb_header->mode_height, &fb_header->mode_bpp);
+	memcpy(FB_EXPORT_PIXELS(fb_header), pixels, SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(unsigned int));
+
+	atomic_thread_fence(memory_order_release);
+	fb_header->sequence++;
+}
+
+void fb_export_deinit()
+{
+	if (fb_header != NULL)
+		UnmapViewOfFile(fb_header);
+	if (fb_mapping != NULL)
+		CloseHandle(fb_mapping);
+	fb_header = NULL;
+	fb_mapping = NULL;
+}
@@ -0,0 +1,46 @@
+#ifndef FBEXPORT_H
+#define FBEXPORT_H
+
+// Finished frames published in a named shared memory section for viewers in other processes.
+// The header is followed by width * height pixels (0x00RRGGBB, bottom-up rows as in a DIB).
+//
+// The emulator never waits for viewers. It updates a frame as a seqlock: sequence is odd while
+// the frame is written and is incremented again when it is complete. A viewer reads sequence,
+// copies the frame and accepts it if sequence is even and has not changed meanwhile.
+// Frames are only copied while a viewer keeps viewer_tick (GetTickCount) recent.
+
+#define FB_EXPORT_MAGIC			0x46363845u
+#define FB_EXPORT_VERSION		1
+
+// Frames stop being exported when viewer_tick is older than this (ms)
+#define FB_EXPORT_VIEWER_TIMEOUT	2000
+
+// mode field, VGA modes are the BIOS mode number
+#define FB_EXPORT_MODE_VBE		0x10000u
+
+typedef struct
+{
+	unsigned int magic;
+	unsigned int version;
+	unsigned int header_size;
+	volatile unsigned int sequence;
+	volatile unsigned int viewer_tick;
+	unsigned int frame;
+	// Guest video mode and its resolution
+	unsigned int mode;
+	unsigned int mode_width;
+	unsigned int mode_height;
+	unsigned int mode_bpp;
+	// Exported pixels
+	unsigned int width;
+	unsigned int height;
+} fb_export_t;
+
+#define FB_EXPORT_PIXELS(h)		((unsigned int *)((unsigned char *)(h) + (h)->header_size))
+
+void fb_export_init();
+// Called by the renderer with each complete frame
+void fb_export_frame(const unsigned int *pixels, unsigned int frame);
+void fb_export_deinit();
+
+#endif
@@ -0,0 +1,659 @@
+#include "stdafx.h"
+#include <winioctl.h>
+#include "image.h"
+#include "lz.h"
+
+// Disk images are mapped into the address space as a whole,
+// so sector transfers are plain memcpy and the host page cache is shared
+// between emulator instances that use the same image.
+
+void image_init(image_t *img)
+{
+	img->file = INVALID_HANDLE_VALUE;
+	img->mapping = NULL;
+	img->data = NULL;
+	img->size = 0;
+	img->sectors = 0;
+	img->mode = IMAGE_READ_WRITE;
+	img->dirty = 0;
+
+	img->type = IMAGE_RAW;
+	img->base = NULL;
+	img->bitmap = NULL;
+	img->blocks = NULL;
+	img->block_sectors = 0;
+	img->num_blocks = 0;
+
+	img->index = NULL;
+	img->private_blocks = NULL;
+	img->scratch = NULL;
+	memset(&img->key, 0, sizeof(img->key));
+}
+
+static int image_map(image_t *img)
+{
+	int ro = img->mode == IMAGE_READ_ONLY_BASE;
+
+	img->mapping = CreateFileMappingA(img->file, NULL, ro ? PAGE_WRITECOPY : PAGE_READWRITE, 0, 0, NULL);
+	if (img->mapping == NULL)
+		return 0;
+
+	img->data = (unsigned char *)MapViewOfFile(img->mapping, ro ? FILE_MAP_COPY : FILE_MAP_WRITE, 0, 0, 0);
+	if (img->data == NULL)
+		return 0;
+
+	if (img->type == IMAGE_OVERLAY)
+	{
+		img->bitmap = img->data + ((image_overlay_header_t *)img->data)->bitmap_offset;
+		img->blocks = img->data + ((image_overlay_header_t *)img->data)->data_offset;
+	}
+
+	return 1;
+}
+
+static void image_unmap(image_t *img)
+{
+	if (img->data != NULL)
+		UnmapViewOfFile(img->data);
+	if (img->mapping != NULL)
+		CloseHandle(img->mapping);
+
+	img->data = NULL;
+	img->mapping = NULL;
+	img->bitmap = NULL;
+	img->blocks = NULL;
+}
+
+static int image_attach_base(image_t *img)
+{
+	const image_overlay_header_t *h = (const image_overlay_header_t *)img->data;
+	unsigned __int64 end;
+
+	if ((h->version != IMAGE_OVERLAY_VERSION) || (h->block_sectors == 0))
+		return 0;
+
+	img->block_sectors = h->block_sectors;
+	img->num_blocks = (h->base_sectors + h->block_sectors - 1) / h->block_sectors;
+
+	end = (unsigned __int64)h->data_offset + (unsigned __int64)img->num_blocks * img->block_sectors * 512;
+	if (((unsigned __int64)h->bitmap_offset + (img->num_blocks + 7) / 8 > h->data_offset) || (end > img->size))
+		return 0;
+
+	img->base = (image_t *)malloc(sizeof(image_t));
+	if (img->base == NULL)
+		return 0;
+
+	// The base may be an overlay too
+	if (!image_open(img->base, h->base_name, IMAGE_READ_ONLY_BASE))
+	{
+		free(img->base);
+		img->base = NULL;
+		return 0;
+	}
+
+	img->type = IMAGE_OVERLAY;
+	img->sectors = h->base_sectors;
+	img->bitmap = img->data + h->bitmap_offset;
+	img->blocks = img->data + h->data_offset;
+
+	return 1;
+}
+
+static int image_attach_index(image_t *img)
+{
+	const image_compressed_header_t *h = (const image_compressed_header_t *)img->data;
+	BY_HANDLE_FILE_INFORMATION info;
+	unsigned int i, block_size;
+
+	if ((h->version != IMAGE_COMPRESSED_VERSION) || (h->block_sectors == 0) || (h->block_sectors > 0x10000))
+		return 0;
+
+	img->block_sectors = h->block_sectors;
+	img->num_blocks = (h->sectors + h->block_sectors - 1) / h->block_sectors;
+	block_size = img->block_sectors * 512;
+
+	if ((unsigned __int64)h->index_offset + (unsigned __int64)img->num_blocks * sizeof(image_block_t) > img->size)
+		return 0;
+
+	img->index = (const image_block_t *)(img->data + h->index_offset);
+	for (i = 0; i < img->num_blocks; i++)
+	{
+		if ((img->index[i].length > block_size) ||
+			((unsigned __int64)img->index[i].offset + img->index[i].length > img->size))
+			return 0;
+	}
+
+	img->scratch = (unsigned char *)malloc(block_size);
+	if (img->scratch == NULL)
+		return 0;
+
+	// Every drive that opens this file shares its cached blocks, the write time keeps old versions apart
+	if (!GetFileInformationByHandle(img->file, &info))
+		return 0;
+	img->key.volume = info.dwVolumeSerialNumber;
+	img->key.file_high = info.nFileIndexHigh;
+	img->key.file_low = info.nFileIndexLow;
+	img->key.time_high = info.ftLastWriteTime.dwHighDateTime;
+	img->key.time_low = info.ftLastWriteTime.dwLowDateTime;
+
+	img->type = IMAGE_COMPRESSED;
+	img->sectors = h->sectors;
+
+	return 1;
+}
+
+// Overlay and compressed files are recognized by their header
+int image_open(image_t *img, const char *file_name, int mode)
+{
+	DWORD size_high = 0;
+
+	image_init(img);
+	img->mode = mode;
+
+	// A base must not change under the overlays that map it, it is shared for reading only
+	if (mode == IMAGE_READ_ONLY_BASE)
+		img->file = CreateFileA(file_name, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	else
+		img->file = CreateFileA(file_name, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+			NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (img->file == INVALID_HANDLE_VALUE)
+		return 0;
+
+	img->size = GetFileSize(img->file, &size_high);
+	if ((img->size == 0) || (size_high != 0))
+	{
+		// Empty or larger than 4 GB
+		image_close(img);
+		return 0;
+	}
+
+	if (!image_map(img))
+	{
+		image_close(img);
+		return 0;
+	}
+
+	img->sectors = img->size / 512;
+
+	if ((img->size >= sizeof(image_overlay_header_t)) && (memcmp(img->data, IMAGE_OVERLAY_MAGIC, 8) == 0))
+	{
+		if (!image_attach_base(img))
+		{
+			image_close(img);
+			return 0;
+		}
+	}
+	else if ((img->size >= sizeof(image_compressed_header_t)) && (memcmp(img->data, IMAGE_COMPRESSED_MAGIC, 8) == 0))
+	{
+		if (!image_attach_index(img))
+		{
+			image_close(img);
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+// Scratch disk backed by the page file
+int image_create_temp(image_t *img, unsigned int size)
+{
+	image_init(img);
+
+	img->mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, size, NULL);
+	if (img->mapping == NULL)
+		return 0;
+
+	img->data = (unsigned char *)MapViewOfFile(img->mapping, FILE_MAP_WRITE, 0, 0, 0);
+	if (img->data == NULL)
+	{
+		image_close(img);
+		return 0;
+	}
+
+	img->size = size;
+	img->sectors = size / 512;
+	return 1;
+}
+
+// Creates an empty overlay for the base image. Fails if the file exists.
+int image_create_overlay(const char *file_name, const char *base_file_name)
+{
+	image_t base;
+	image_overlay_header_t h;
+	HANDLE f;
+	DWORD bytes;
+	LONG high;
+	unsigned int num_blocks;
+	unsigned __int64 total;
+
+	if (!image_open(&base, base_file_name, IMAGE_READ_ONLY_BASE))
+		return 0;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, IMAGE_OVERLAY_MAGIC, 8);
+	h.version = IMAGE_OVERLAY_VERSION;
+	h.block_sectors = IMAGE_OVERLAY_BLOCK_SECTORS;
+	h.base_sectors = base.sectors;
+	strncpy(h.base_name, base_file_name, sizeof(h.base_name) - 1);
+
+	image_close(&base);
+
+	num_blocks = (h.base_sectors + h.block_sectors - 1) / h.block_sectors;
+	h.bitmap_offset = 4096;
+	h.data_offset = (h.bitmap_offset + (num_blocks + 7) / 8 + IMAGE_OVERLAY_ALIGN - 1) & ~(IMAGE_OVERLAY_ALIGN - 1);
+
+	total = (unsigned __int64)h.data_offset + (unsigned __int64)num_blocks * h.block_sectors * 512;
+	if (total > 0xFFFFFFFFu)
+		return 0;
+
+	f = CreateFileA(file_name, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (f == INVALID_HANDLE_VALUE)
+		return 0;
+
+	// Blocks that are never written take no disk space
+	DeviceIoControl(f, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &bytes, NULL);
+
+	if (!WriteFile(f, &h, sizeof(h), &bytes, NULL))
+	{
+		CloseHandle(f);
+		DeleteFileA(file_name);
+		return 0;
+	}
+
+	high = 0;
+	SetFilePointer(f, (LONG)total, &high, FILE_BEGIN);
+	SetEndOfFile(f);
+	CloseHandle(f);
+
+	return 1;
+}
+
+static int image_is_zero(const unsigned char *p, unsigned int size)
+{
+	unsigned int i;
+
+	for (i = 0; i < size; i++)
+		if (p[i])
+			return 0;
+
+	return 1;
+}
+
+// Writes any image as raw (IMAGE_RAW) or compressed (IMAGE_COMPRESSED) file
+int image_convert(const char *file_name, const char *src_file_name, int type)
+{
+	image_t src;
+	image_compressed_header_t h;
+	image_block_t *index;
+	unsigned char *block, *packed;
+	unsigned int i, block_size, num_blocks, offset;
+	int len, res = 0;
+	FILE *f;
+
+	if (!image_open(&src, src_file_name, IMAGE_READ_ONLY_BASE))
+		return 0;
+
+	block_size = IMAGE_COMPRESSED_BLOCK_SECTORS * 512;
+	num_blocks = (src.sectors + IMAGE_COMPRESSED_BLOCK_SECTORS - 1) / IMAGE_COMPRESSED_BLOCK_SECTORS;
+
+	block = (unsigned char *)malloc(block_size);
+	packed = (unsigned char *)malloc(block_size);
+	index = (image_block_t *)calloc(num_blocks, sizeof(image_block_t));
+
+	if ((block == NULL) || (packed == NULL) || (index == NULL) || (fopen_s(&f, file_name, "wb") != 0))
+	{
+		free(block);
+		free(packed);
+		free(index);
+		image_close(&src);
+		return 0;
+	}
+
+	if (type == IMAGE_COMPRESSED)
+	{
+		memset(&h, 0, sizeof(h));
+		memcpy(h.magic, IMAGE_COMPRESSED_MAGIC, 8);
+		h.version = IMAGE_COMPRESSED_VERSION;
+		h.block_sectors = IMAGE_COMPRESSED_BLOCK_SECTORS;
+		h.sectors = src.sectors;
+		h.index_offset = sizeof(h);
+
+		// The index is written again when all the offsets are known
+		fwrite(&h, sizeof(h), 1, f);
+		fwrite(index, sizeof(image_block_t), num_blocks, f);
+		offset = sizeof(h) + num_blocks * sizeof(image_block_t);
+
+		for (i = 0; i < num_blocks; i++)
+		{
+			image_read(&src, block, i * IMAGE_COMPRESSED_BLOCK_SECTORS, IMAGE_COMPRESSED_BLOCK_SECTORS);
+
+			if (image_is_zero(block, block_size))
+				continue;
+
+			len = lz_compress(block, block_size, packed, block_size - 1);
+
+			index[i].offset = offset;
+			index[i].length = len > 0 ? len : block_size;
+			fwrite(len > 0 ? packed : block, index[i].length, 1, f);
+			offset += index[i].length;
+		}
+
+		fseek(f, h.index_offset, SEEK_SET);
+		fwrite(index, sizeof(image_block_t), num_blocks, f);
+	}
+	else
+	{
+		for (i = 0; i < num_blocks; i++)
+		{
+			len = src.sectors - i * IMAGE_COMPRESSED_BLOCK_SECTORS;
+			if (len > IMAGE_COMPRESSED_BLOCK_SECTORS)
+				len = IMAGE_COMPRESSED_BLOCK_SECTORS;
+			image_read(&src, block, i * IMAGE_COMPRESSED_BLOCK_SECTORS, len);
+			fwrite(block, 512, len, f);
+		}
+	}
+
+	res = ferror(f) == 0;
+	fclose(f);
+
+	free(block);
+	free(packed);
+	free(index);
+	image_close(&src);
+
+	return res;
+}
+
+int image_is_open(const image_t *img)
+{
+	return img->data != NULL;
+}
+
+static void image_read_overlay(image_t *img, unsigned char *buffer, unsigned int lba, unsigned int count)
+{
+	unsigned int block, n;
+
+	while (count > 0)
+	{
+		block = lba / img->block_sectors;
+		n = img->block_sectors - lba % img->block_sectors;
+		if (n > count)
+			n = count;
+
+		if (img->bitmap[block >> 3] & (1 << (block & 7)))
+			memcpy(buffer, img->blocks + lba * 512, n * 512);
+		else
+			image_read(img->base, buffer, lba, n);
+
+		buffer += n * 512;
+		lba += n;
+		count -= n;
+	}
+}
+
+static void image_write_overlay(image_t *img, const unsigned char *buffer, unsigned int lba, unsigned int count)
+{
+	unsigned int block, n;
+
+	while (count > 0)
+	{
+		block = lba / img->block_sectors;
+		n = img->block_sectors - lba % img->block_sectors;
+		if (n > count)
+			n = count;
+
+		if (!(img->bitmap[block >> 3] & (1 << (block & 7))))
+		{
+			// First write to the block, copy it from the base
+			image_read(img->base, img->blocks + block * img->block_sectors * 512, block * img->block_sectors, img->block_sectors);
+			img->bitmap[block >> 3] |= 1 << (block & 7);
+		}
+
+		memcpy(img->blocks + lba * 512, buffer, n * 512);
+
+		buffer += n * 512;
+		lba += n;
+		count -= n;
+	}
+}
+
+// Copies a part of a block from the private copy, the image or the block cache
+static void image_read_block(image_t *img, unsigned int block, unsigned int offset, unsigned char *buffer, unsigned int size)
+{
+	const image_block_t *b = &img->index[block];
+	unsigned int block_size = img->block_sectors * 512;
+
+	if ((img->private_blocks != NULL) && (img->private_blocks[block] != NULL))
+		memcpy(buffer, img->private_blocks[block] + offset, size);
+	else if (b->length == 0)
+		memset(buffer, 0, size);
+	else if (b->length == block_size)
+		memcpy(buffer, img->data + b->offset + offset, size);
+	else if (!blockcache_read(&img->key, block, offset, buffer, size))
+	{
+		if (lz_decompress(img->data + b->offset, b->length, img->scratch, block_size) != (int)block_size)
+		{
+			// Damaged block reads as zeroes
+			memset(img->scratch, 0, block_size);
+		}
+		blockcache_insert(&img->key, block, img->scratch, block_size);
+		memcpy(buffer, img->scratch + offset, size);
+	}
+}
+
+static void image_read_compressed(image_t *img, unsigned char *buffer, unsigned int lba, unsigned int count)
+{
+	unsigned int block, n;
+
+	while (count > 0)
+	{
+		block = lba / img->block_sectors;
+		n = img->block_sectors - lba % img->block_sectors;
+		if (n > count)
+			n = count;
+
+		image_read_block(img, block, (lba % img->block_sectors) * 512, buffer, n * 512);
+
+		buffer += n * 512;
+		lba += n;
+		count -= n;
+	}
+}
+
+static void image_write_compressed(image_t *img, const unsigned char *buffer, unsigned int lba, unsigned int count)
+{
+	unsigned char *b;
+	unsigned int block, n, block_size = img->block_sectors * 512;
+
+	if (img->private_blocks == NULL)
+	{
+		img->private_blocks = (unsigned char **)calloc(img->num_blocks, sizeof(unsigned char *));
+		if (img->private_blocks == NULL)
+			return;
+	}
+
+	while (count > 0)
+	{
+		block = lba / img->block_sectors;
+		n = img->block_sectors - lba % img->block_sectors;
+		if (n > count)
+			n = count;
+
+		if (img->private_blocks[block] == NULL)
+		{
+			b = (unsigned char *)malloc(block_size);
+			if (b == NULL)
+				return;
+			image_read_block(img, block, 0, b, block_size);
+			img->private_blocks[block] = b;
+		}
+
+		memcpy(img->private_blocks[block] + (lba % img->block_sectors) * 512, buffer, n * 512);
+
+		buffer += n * 512;
+		lba += n;
+		count -= n;
+	}
+}
+
+// Sectors past the end of the image read as zeroes
+unsigned int image_read(image_t *img, unsigned char *buffer, unsigned int lba, unsigned int count)
+{
+	unsigned int n = 0;
+
+	if (img->data != NULL)
+	{
+		if (lba < img->sectors)
+			n = img->sectors - lba;
+		if (n > count)
+			n = count;
+		if (n)
+		{
+			if (img->type == IMAGE_OVERLAY)
+				image_read_overlay(img, buffer, lba, n);
+			else if (img->type == IMAGE_COMPRESSED)
+				image_read_compressed(img, buffer, lba, n);
+			else
+				memcpy(buffer, img->data + lba * 512, n * 512);
+		}
+	}
+
+	if (n < count)
+		memset(buffer + n * 512, 0, (count - n) * 512);
+
+	return n;
+}
+
+// Sectors past the end of the image are dropped
+unsigned int image_write(image_t *img, const unsigned char *buffer, unsigned int lba, unsigned int count)
+{
+	unsigned int n = 0;
+
+	if (img->data == NULL)
+		return 0;
+
+	if (lba < img->sectors)
+		n = img->sectors - lba;
+	if (n > count)
+		n = count;
+
+	if (n)
+	{
+		if (img->type == IMAGE_OVERLAY)
+			image_write_overlay(img, buffer, lba, n);
+		else if (img->type == IMAGE_COMPRESSED)
+			image_write_compressed(img, buffer, lba, n);
+		else
+			memcpy(img->data + lba * 512, buffer, n * 512);
+		img->dirty = 1;
+	}
+
+	return n;
+}
+
+// Writes all overlay blocks to the base image and empties the overlay
+int image_commit(image_t *img)
+{
+	char base_name[sizeof(((image_overlay_header_t *)0)->base_name)];
+	unsigned int block;
+
+	if (img->type != IMAGE_OVERLAY)
+		return 0;
+
+	memcpy(base_name, ((image_overlay_header_t *)img->data)->base_name, sizeof(base_name));
+
+	// Reopen the base for writing only while committing. Fails while other overlays use the base.
+	image_close(img->base);
+	if (!image_open(img->base, base_name, IMAGE_READ_WRITE))
+	{
+		image_open(img->base, base_name, IMAGE_READ_ONLY_BASE);
+		return 0;
+	}
+
+	for (block = 0; block < img->num_blocks; block++)
+	{
+		if (img->bitmap[block >> 3] & (1 << (block & 7)))
+			image_write(img->base, img->blocks + block * img->block_sectors * 512, block * img->block_sectors, img->block_sectors);
+	}
+
+	image_close(img->base);
+	if (!image_open(img->base, base_name, IMAGE_READ_ONLY_BASE))
+	{
+		// Without the base the overlay blocks are all that is left of the disk
+		return 0;
+	}
+
+	image_discard(img);
+
+	return 1;
+}
+
+// Drops all overlay blocks, the disk returns to the base image state
+void image_discard(image_t *img)
+{
+	FILE_ZERO_DATA_INFORMATION zero;
+	DWORD bytes;
+
+	if (img->type != IMAGE_OVERLAY)
+		return;
+
+	memset(img->bitmap, 0, (img->num_blocks + 7) / 8);
+	img->dirty = 1;
+	image_flush(img);
+
+	if (img->mode != IMAGE_READ_WRITE)
+		return;
+
+	// Give the space of the data area back to the file system
+	zero.FileOffset.QuadPart = ((image_overlay_header_t *)img->data)->data_offset;
+	zero.BeyondFinalZero.QuadPart = img->size;
+
+	image_unmap(img);
+	DeviceIoControl(img->file, FSCTL_SET_ZERO_DATA, &zero, sizeof(zero), NULL, 0, &bytes, NULL);
+	if (!image_map(img))
+		image_close(img);
+}
+
+void image_flush(image_t *img)
+{
+	if ((img->data == NULL) || !img->dirty)
+		return;
+
+	// Copy-on-write pages never reach the file
+	if ((img->mode == IMAGE_READ_WRITE) && (img->file != INVALID_HANDLE_VALUE))
+	{
+		FlushViewOfFile(img->data, 0);
+		FlushFileBuffers(img->file);
+	}
+
+	img->dirty = 0;
+}
+
+void image_close(image_t *img)
+{
+	unsigned int i;
+
+	image_flush(img);
+
+	if (img->base != NULL)
+	{
+		image_close(img->base);
+		free(img->base);
+	}
+
+	free(img->scratch);
+
+	if (img->private_blocks != NULL)
+	{
+		for (i = 0; i < img->num_blocks; i++)
+			free(img->private_blocks[i]);
+		free(img->private_blocks);
+	}
+
+	image_unmap(img);
+	if (img->file != INVALID_HANDLE_VALUE)
+		CloseHandle(img->file);
+
+	image_init(img);
+}
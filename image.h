@@ -0,0 +1,98 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include "stdafx.h"
+#include "blockcache.h"
+
+// Guest writes go to the image file
+#define IMAGE_READ_WRITE		0
+// The image file is never changed, guest writes are kept in private copy-on-write pages
+#define IMAGE_READ_ONLY_BASE	1
+
+#define IMAGE_RAW				0
+// Modified blocks are kept in an overlay file, the rest is read from a shared base image
+#define IMAGE_OVERLAY			1
+// Read-only image of LZ compressed blocks, guest writes are kept in memory
+#define IMAGE_COMPRESSED		2
+
+#define IMAGE_OVERLAY_MAGIC		"E86R-OVL"
+#define IMAGE_OVERLAY_VERSION	1
+// 64 KB blocks match the NTFS sparse file allocation unit
+#define IMAGE_OVERLAY_BLOCK_SECTORS	128
+#define IMAGE_OVERLAY_ALIGN		65536
+
+// Overlay file: header, block bitmap (1 - block is in the overlay), data area.
+// Block N is stored at data_offset + N * block size, unused blocks are sparse.
+typedef struct
+{
+	char magic[8];
+	unsigned int version;
+	unsigned int block_sectors;
+	unsigned int base_sectors;
+	unsigned int bitmap_offset;
+	unsigned int data_offset;
+	char base_name[260];
+} image_overlay_header_t;
+
+#define IMAGE_COMPRESSED_MAGIC		"E86R-CMP"
+#define IMAGE_COMPRESSED_VERSION	1
+#define IMAGE_COMPRESSED_BLOCK_SECTORS	64
+
+// Compressed file: header, block index, block data
+typedef struct
+{
+	char magic[8];
+	unsigned int version;
+	unsigned int block_sectors;
+	unsigned int sectors;
+	unsigned int index_offset;
+} image_compressed_header_t;
+
+typedef struct
+{
+	unsigned int offset;
+	// 0 - zero block, block size - stored as is, otherwise LZ compressed
+	unsigned int length;
+} image_block_t;
+
+typedef struct image_s
+{
+	HANDLE file;
+	HANDLE mapping;
+	unsigned char *data;
+	unsigned int size;
+	// Disk size
+	unsigned int sectors;
+	int mode;
+	int dirty;
+
+	int type;
+	unsigned int block_sectors;
+	unsigned int num_blocks;
+
+	// Overlay only
+	struct image_s *base;
+	unsigned char *bitmap;
+	unsigned char *blocks;
+
+	// Compressed only
+	const image_block_t *index;
+	unsigned char **private_blocks;
+	blockcache_key_t key;
+	unsigned char *scratch;
+} image_t;
+
+void image_init(image_t *img);
+int image_open(image_t *img, const char *file_name, int mode);
+int image_create_temp(image_t *img, unsigned int size);
+int image_create_overlay(const char *file_name, const char *base_file_name);
+int image_convert(const char *file_name, const char *src_file_name, int type);
+int image_is_open(const image_t *img);
+unsigned int image_read(image_t *img, unsigned char *buffer, unsigned int lba, unsigned int count);
+unsigned int image_write(image_t *img, const unsigned char *buffer, unsigned int lba, unsigned int count);
+int image_commit(image_t *img);
+void image_discard(image_t *img);
+void image_flush(image_t *img);
+void image_close(image_t *img);
+
+#endif
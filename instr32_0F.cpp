@@ -6,6 +6,7 @@
 #include "modrm.h"
 #include "alu.h"
 #include "x86.h"
+#include "vclock.h"
 #if (ENABLE_MMX == 1)
 #include "mmx.h"
 #endif
@@ -525,8 +526,8 @@ void f32_31()
 {
 #if (CPU >= 586)
 	D("rdtsc");
-	r.eax = (unsigned int)(tsc_counter);
-	r.edx = (unsigned int)(tsc_counter >> 32);
+	r.eax = (unsigned int)(vclock_cycles);
+	r.edx = (unsigned int)(vclock_cycles >> 32);
 #else
 	undefined32(0x31);
 #endif
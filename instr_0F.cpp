@@ -8,6 +8,7 @@
 #include "stringops.h"
 #include "ioports.h"
 #include "x86.h"
+#include "vclock.h"
 #if (ENABLE_MMX == 1)
 #include "mmx.h"
 #endif
@@ -467,8 +468,8 @@ void f_31()
 {
 #if (CPU >= 586)
 	D("rdtsc");
-	r.eax = (unsigned int)(tsc_counter);
-	r.edx = (unsigned int)(tsc_counter >> 32);
+	r.eax = (unsigned int)(vclock_cycles);
+	r.edx = (unsigned int)(vclock_cycles >> 32);
 #else
 	undefined(0x31);
 #endif
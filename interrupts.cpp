@@ -3,7 +3,11 @@
 #include "cpu.h"
 #include "memdescr.h"
 #include "disk.h"
+#include "vga.h"
 #include "transfer.h"
+#if (METRICS)
+#include "metrics.h"
+#endif
 
 int fault = 0;
 unsigned int faultcode = 0;
@@ -56,6 +60,10 @@ void interrupt(int n, int errorcode, int intflags)
 	unsigned int oss = ss.value, oesp = r.esp, nss, nesp;
 	unsigned int ocs = cs.value, oeip = r.eip;
 
+#if (METRICS)
+	metrics.interrupts[n & 0xFF]++;
+#endif
+
 	if (!pmode)
 	{
 		if (n == 0x13)
@@ -65,6 +73,13 @@ void interrupt(int n, int errorcode, int intflags)
 			return;
 		}
 
+		// VBE functions, mode sets below 100h fall through to the VGA BIOS
+		if ((n == 0x10) && (r.ah == 0x4F) && bios_vbe())
+		{
+			r.flags |= F_I;
+			return;
+		}
+
 		if ((n == 0x15) && (r.ah == 0x87))
 		{
 			block_move();
@@ -482,6 +497,10 @@ void ex(int n, int errorcode)
 	fault = 0x100 + n;
 	faultcode = errorcode;
 
+#if (METRICS)
+	metrics.exceptions[n & 0x1F]++;
+#endif
+
 	if (n == EX_PAGE)
 		num_pf++;
 	else if (n == EX_GP)
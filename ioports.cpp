@@ -8,6 +8,9 @@
 #include "pic_pit.h"
 #include "cmos.h"
 #include "keybmouse.h"
+#if (METRICS)
+#include "metrics.h"
+#endif
 
 unsigned char ports[1024];
 
@@ -15,6 +18,10 @@ unsigned char portread8(unsigned short port)
 {
 	GP((cr[0] & 1) && (cpl > IOPL), 0);
 
+#if (METRICS)
+	metrics_port_read(port);
+#endif
+
 	// VGA goes first to speed up games
 	if ((port >= 0x3B0) && (port <= 0x3DF))
 		return vga_portread(port);
@@ -24,6 +31,14 @@ unsigned char portread8(unsigned short port)
 		((port >= 0x170) && (port <= 0x177)) || ((port >= 0x370) && (port <= 0x377)))
 		return ide_read(port);
 
+	// Bus master IDE
+	if ((port >= IDE_BM_BASE) && (port < IDE_BM_BASE + 16))
+		return ide_bm_read(port);
+
+	// VBE dispi interface, byte access goes to the low byte
+	if ((port == VBE_DISPI_IOPORT_INDEX) || (port == VBE_DISPI_IOPORT_DATA))
+		return (unsigned char)vbe_portread(port);
+
 	if (port >= 1024)
 	{
 		return 0;
@@ -41,6 +56,7 @@ unsigned char portread8(unsigned short port)
 		case 0x42:
 		case 0x43:
 			return pit_read(port);
+		case 0x60:
 		case 0x61:
 		case 0x62:
 		case 0x63:
@@ -70,6 +86,15 @@ unsigned short portread16(unsigned short port)
 {
 	GP((cr[0] & 1) && (cpl > IOPL), 0);
 
+	// VBE dispi interface registers are 16 bits wide
+	if ((port == VBE_DISPI_IOPORT_INDEX) || (port == VBE_DISPI_IOPORT_DATA))
+	{
+#if (METRICS)
+		metrics_port_read(port);
+#endif
+		return vbe_portread(port);
+	}
+
 	unsigned short res;
 	res = portread8(port);
 	res |= portread8(port + 1) << 8u;
@@ -92,6 +117,10 @@ void portwrite8(unsigned short port, unsigned char v)
 {
 	GPV((cr[0] & 1) && (cpl > IOPL), 0);
 
+#if (METRICS)
+	metrics_port_write(port);
+#endif
+
 	if ((port >= 0x3B0) && (port <= 0x3DF))
 	{
 		vga_portwrite(port, v);
@@ -103,6 +132,16 @@ void portwrite8(unsigned short port, unsigned char v)
 		ide_write(port, v);
 		return;
 	}
+	if ((port >= IDE_BM_BASE) && (port < IDE_BM_BASE + 16))
+	{
+		ide_bm_write(port, v);
+		return;
+	}
+	if ((port == VBE_DISPI_IOPORT_INDEX) || (port == VBE_DISPI_IOPORT_DATA))
+	{
+		vbe_portwrite(port, v);
+		return;
+	}
 
 	if (port >= 1024)
 	{
@@ -128,6 +167,10 @@ void portwrite8(unsigned short port, unsigned char v)
 		case 0x3fc:
 			keybmouse_portwrite(port, v);
 			break;
+		case 0x61:
+			// Speaker timer gate
+			pit_set_gate(2, v & 1);
+			break;
 		case 0x70:
 		case 0x71:
 			cmos_write(port, v);
@@ -146,6 +189,24 @@ void portwrite16(unsigned short port, unsigned short v)
 {
 	GPV((cr[0] & 1) && (cpl > IOPL), 0);
 
+	// VBE dispi interface registers are 16 bits wide
+	if ((port == VBE_DISPI_IOPORT_INDEX) || (port == VBE_DISPI_IOPORT_DATA))
+	{
+#if (METRICS)
+		metrics_port_write(port);
+#endif
+		vbe_portwrite(port, v);
+		return;
+	}
+
+	// IDE data register is 16 bits wide, both bytes go to it
+	if ((port == 0x1F0) || (port == 0x170))
+	{
+		portwrite8(port, (unsigned char)v);
+		portwrite8(port, v >> 8u);
+		return;
+	}
+
 	portwrite8(port, (unsigned char)v);
 	portwrite8(port + 1, v >> 8u);
 }
@@ -154,6 +215,15 @@ void portwrite32(unsigned short port, unsigned int v)
 {
 	GPV((cr[0] & 1) && (cpl > IOPL), 0);
 
+	if ((port == 0x1F0) || (port == 0x170))
+	{
+		portwrite8(port, (unsigned char)v);
+		portwrite8(port, v >> 8u);
+		portwrite8(port, v >> 16u);
+		portwrite8(port, v >> 24u);
+		return;
+	}
+
 	portwrite8(port, (unsigned char)v);
 	portwrite8(port + 1, v >> 8u);
 	portwrite8(port + 2, v >> 16u);
@@ -2,64 +2,68 @@
 #define IOPORTS_H
 
 #include "stdafx.h"
+#include <atomic>
 
-class SmallBuffer
+// Bounded single producer, single consumer queue without locks. Each index is written by one
+// side only, so the UI thread can put while the emulator gets. N must be a power of 2.
+template <typename T, unsigned int N>
+class SpscQueue
 {
 private:
-	unsigned char m_data[16];
-	int m_rp, m_wp, m_count;
-	mutex m_mtx;
+	T m_data[N];
+	// Next entry to get, written by the consumer
+	atomic<unsigned int> m_head;
+	// Next entry to put, written by the producer
+	atomic<unsigned int> m_tail;
 public:
-	SmallBuffer()
+	SpscQueue() : m_head(0), m_tail(0)
 	{
-		m_rp = m_wp = m_count = 0;
 		memset(m_data, 0, sizeof(m_data));
 	}
 
-	int count() const
+	unsigned int count() const
 	{
-		return m_count;
+		return m_tail.load(memory_order_acquire) - m_head.load(memory_order_acquire);
 	}
 
-	int peek()
+	// Producer. A full queue keeps what it has and drops the new value
+	bool put(const T &value)
 	{
-		return m_data[m_rp];
+		unsigned int tail = m_tail.load(memory_order_relaxed);
+
+		if (tail - m_head.load(memory_order_acquire) >= N)
+			return false;
+		m_data[tail & (N - 1)] = value;
+		m_tail.store(tail + 1, memory_order_release);
+		return true;
 	}
 
-	int get()
+	// Consumer
+	bool peek(T *value) const
 	{
-		int res;
-		if (m_count <= 0)
-			return -1;
-		m_mtx.lock();
-		res = m_data[m_rp++];
-		m_rp %= sizeof(m_data);
-		m_count--;
-		m_mtx.unlock();
-		return res;
+		unsigned int head = m_head.load(memory_order_relaxed);
+
+		if (head == m_tail.load(memory_order_acquire))
+			return false;
+		*value = m_data[head & (N - 1)];
+		return true;
 	}
 
-	void put(unsigned char value)
+	// Consumer
+	bool get(T *value)
 	{
-		while (m_count > sizeof(m_data))
-		{
-			m_wp++;
-			m_wp %= sizeof(m_data);
-			m_count--;
-		}
-		m_mtx.lock();
-		m_data[m_wp++] = value;
-		m_wp %= sizeof(m_data);
-		m_count++;
-		m_mtx.unlock();
+		unsigned int head = m_head.load(memory_order_relaxed);
+
+		if (head == m_tail.load(memory_order_acquire))
+			return false;
+		*value = m_data[head & (N - 1)];
+		m_head.store(head + 1, memory_order_release);
+		return true;
 	}
 };
 
 extern unsigned char ports[1024];
 
-extern SmallBuffer keybuf;
-extern SmallBuffer mousebuf;
-
 void mouseevent(int x, int y, int buttons);
 
 unsigned char portread8(unsigned short port);
@@ -5,13 +5,35 @@
 #include "ioports.h"
 #include "pic_pit.h"
 #include "keybmouse.h"
+#include "vclock.h"
+#if (METRICS)
+#include "metrics.h"
+#endif
+
+// Delay before the controller loads the next byte after the guest has read port 60h
+#define KEYB_BYTE_NS		1000000
+// Delay before the next mouse packet after the guest has read the last byte of one
+#define MOUSE_PACKET_NS		50000
+
+atomic<int> input_pending(0);
+
+// Filled by the UI thread only
+static SpscQueue<key_event_t, 256> keybuf;
+static SpscQueue<mouse_event_t, 256> mousebuf;
 
-SmallBuffer keybuf;
-SmallBuffer mousebuf;
+// CPU thread only: controller replies and the serial bytes of the current mouse packet
+static SpscQueue<unsigned char, 16> keyb_reply;
+static SpscQueue<unsigned char, 16> mouse_serial;
+
+// Port 60h holds a byte the guest has not read yet
+static int keyb_full = 0;
 
 int mouse_x = 0, new_mouse_x = 0;
 int mouse_y = 0, new_mouse_y = 0;
 int mouse_b = 0, new_mouse_b = 0;
+// Time of the last report taken from the queue, not sent yet when mouse_timed is set
+static unsigned int mouse_time = 0;
+static int mouse_timed = 0;
 
 unsigned char regs16550[8] = {0};
 
@@ -99,12 +121,39 @@ int scancode(int key)
 	return 0;
 }
 
+// Host time in microseconds, wraps around
+static unsigned int input_clock()
+{
+	LARGE_INTEGER t, freq;
+
+	QueryPerformanceCounter(&t);
+	QueryPerformanceFrequency(&freq);
+	return (unsigned int)(t.QuadPart / freq.QuadPart * 1000000 + t.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart);
+}
+
+static void input_latency(unsigned int time)
+{
+#if (METRICS)
+	metrics_input(input_clock() - time);
+#endif
+}
+
+static void keyb_event(int code)
+{
+	key_event_t e;
+
+	e.time = input_clock();
+	e.code = code;
+	if (keybuf.put(e))
+		input_pending = 1;
+}
+
 void keydown(int key)
 {
 	key = scancode(key);
 	if (key <= 0)
 		return;
-	keybuf.put(key);
+	keyb_event(key);
 }
 
 void keyup(int key)
@@ -112,41 +161,90 @@ void keyup(int key)
 	key = scancode(key);
 	if (key <= 0)
 		return;
-	key |= 0x80;
-	keybuf.put(key);
+	keyb_event(key | 0x80);
 }
 
 void mousereport(int x, int y, int b)
 {
-	new_mouse_x = x;
-	new_mouse_y = y;
-	new_mouse_b = b;
+	mouse_event_t e;
+
+	e.time = input_clock();
+	e.x = x;
+	e.y = y;
+	e.buttons = b;
+	if (mousebuf.put(e))
+		input_pending = 1;
+}
+
+// Loads the next byte into port 60h once the guest has read the previous one. Controller
+// replies go before scancodes.
+static void keyb_load()
+{
+	key_event_t e;
+	unsigned char v;
+
+	if (keyb_full)
+		return;
+
+	if (keyb_reply.get(&v))
+		ports[0x60] = v;
+	else if (keybuf.get(&e))
+	{
+		ports[0x60] = e.code;
+		input_latency(e.time);
+	}
+	else
+		return;
+
+	keyb_full = 1;
+	irq(1);
 }
 
-int getkey()
+// A command drops the unread byte and any older reply, its reply is next. Keys typed on the
+// host stay queued.
+static void keyb_answer(unsigned char reply)
 {
-	return keybuf.get();
+	unsigned char v;
+
+	while (keyb_reply.get(&v))
+		;
+	vclock_cancel(VCLOCK_EVENT_KEYB);
+	keyb_full = 0;
+
+	keyb_reply.put(reply);
+	keyb_load();
 }
 
-void check_keyb()
+// Takes the queued reports up to the next button change. Moves in between are merged, the
+// pointer walks to the last position anyway.
+static void mouse_fetch()
 {
-	int ch;
-	if (!(irqs & 2))
+	mouse_event_t e;
+
+	while (mousebuf.peek(&e))
 	{
-		ch = getkey();
-		if (ch > 0)
-		{
-			ports[0x60] = ch;
-			irq(1);
-		}
+		if ((e.buttons != new_mouse_b) && ((mouse_x != new_mouse_x) || (mouse_y != new_mouse_y) || (mouse_b != new_mouse_b)))
+			break;
+		mousebuf.get(&e);
+		new_mouse_x = e.x;
+		new_mouse_y = e.y;
+		new_mouse_b = e.buttons;
+		mouse_time = e.time;
+		mouse_timed = 1;
 	}
 }
 
-void check_mouse()
+// Sends the next packet when the previous one has been read
+static void mouse_send()
 {
 	int mouse_speed, high, a, b, mdx, mdy;
-	
-	if (((mouse_x != new_mouse_x) || (mouse_y != new_mouse_y) || (mouse_b != new_mouse_b)) && (mousebuf.count() == 0))
+
+	if (mouse_serial.count())
+		return;
+
+	mouse_fetch();
+
+	if ((mouse_x != new_mouse_x) || (mouse_y != new_mouse_y) || (mouse_b != new_mouse_b))
 	{
 		if (new_mouse_x > 639)
 			new_mouse_x = 639;
@@ -175,52 +273,69 @@ void check_mouse()
 #if (MOUSE_PROTOCOL == MOUSE_MS)
 		high = (a >> 6) & 3;
 		high |= ((b >> 6) & 3) << 2;
-		mousebuf.put(0x40 | high | (mouse_b & 1 ? 0x20 : 0) | (mouse_b & 2 ? 0x10 : 0));
-		mousebuf.put(a & 0x3F);
-		mousebuf.put(b & 0x3F);
+		mouse_serial.put(0x40 | high | (mouse_b & 1 ? 0x20 : 0) | (mouse_b & 2 ? 0x10 : 0));
+		mouse_serial.put(a & 0x3F);
+		mouse_serial.put(b & 0x3F);
 #else
 		// Mouse Systems
-		mousebuf.put(0x80 | (mouse_b & 1 ? 0 : 4) | 2 | (mouse_b & 2 ? 0 : 1));
+		mouse_serial.put(0x80 | (mouse_b & 1 ? 0 : 4) | 2 | (mouse_b & 2 ? 0 : 1));
 		mdy = -mdy;
-		mousebuf.put(mdx);
-		mousebuf.put(mdy);
-		mousebuf.put(0);
-		mousebuf.put(0);
+		mouse_serial.put(mdx);
+		mouse_serial.put(mdy);
+		mouse_serial.put(0);
+		mouse_serial.put(0);
 #endif
+		if (mouse_timed)
+		{
+			input_latency(mouse_time);
+			mouse_timed = 0;
+		}
+		irq(4);
 	}
+}
 
-	if (!(irqs & (1 << 4)))
-	{
-		if (mousebuf.count())
-			irq(4);
-	}
+void check_input()
+{
+	// Cleared first, an event queued meanwhile sets it again
+	input_pending = 0;
+	keyb_load();
+	mouse_send();
 }
 
 unsigned char keybmouse_portread(unsigned short port)
 {
 	unsigned char v;
 
-	static unsigned char port61toggle = 0;
-	port61toggle++;
-
 	switch (port)
 	{
+		case 0x60:
+			if (keyb_full)
+			{
+				keyb_full = 0;
+				if (keyb_reply.count() || keybuf.count())
+					vclock_schedule(VCLOCK_EVENT_KEYB, vclock_now() + KEYB_BYTE_NS, keyb_load);
+			}
+			return ports[0x60];
 		case 0x61:
-			return 0x01 | (port61toggle & 0x30);
+			// Bit 4 - refresh request toggling every 15 us, bit 5 - timer channel 2 output
+			return (ports[0x61] & 0x0F) | ((vclock_now() / 15085) & 1 ? 0x10 : 0) | (pit_output(2) ? 0x20 : 0);
 		case 0x62:
 		case 0x63:
 			return 0xFD;
 		case 0x64:
-			return 0x1C | (irqs & 2 ? 1 : 0);
+			return 0x1C | keyb_full;
 		case 0x3f8:
-			v = mousebuf.get();
-			// if (mousebuf.count())
-				// irq(4);
+			if (!mouse_serial.get(&v))
+				return 0xFF;
+			if (mouse_serial.count())
+				irq(4);
+			else if (mousebuf.count() || (mouse_x != new_mouse_x) || (mouse_y != new_mouse_y) || (mouse_b != new_mouse_b))
+				vclock_schedule(VCLOCK_EVENT_MOUSE, vclock_now() + MOUSE_PACKET_NS, mouse_send);
 			return v;
 		case 0x3fd:
-			return mousebuf.count() ? 1 : 0;
+			return mouse_serial.count() ? 1 : 0;
 		case 0x3FA:
-			return (3 << 1) + (mousebuf.count() ? 0 : 1);
+			return (3 << 1) + (mouse_serial.count() ? 0 : 1);
 		case 0x3FE:
 			return 0;//0xFF;
 	}
@@ -234,6 +349,7 @@ unsigned char keybmouse_portread(unsigned short port)
 void keybmouse_portwrite(unsigned short port, unsigned char value)
 {
 	static int keyb_enabled = 1;
+	unsigned char v;
 
 	switch (port)
 	{
@@ -242,7 +358,7 @@ void keybmouse_portwrite(unsigned short port, unsigned char value)
 			{
 				case 0xad: // disable keyboard
 					keyb_enabled = 0;
-					irqs &= ~2;
+					irq_clear(1);
 					break;
 				case 0xae: // enable keyboard
 					keyb_enabled = 1;
@@ -257,34 +373,29 @@ void keybmouse_portwrite(unsigned short port, unsigned char value)
 				case 0xf5: // disable scan
 				case 0xf6: // reset
 				case 0xff: // reset
-					while (keybuf.count())
-						keybuf.get();
 					// irq(2);
-					keybuf.put(0xfa);
+					keyb_answer(0xfa);
 					break;
 				case 0xAA: // test 1
-					while (keybuf.count())
-						keybuf.get();
-					keybuf.put(0x55);
+					keyb_answer(0x55);
 					break;
 				case 0xAB: // test 2
-					while (keybuf.count())
-						keybuf.get();
-					keybuf.put(0x00);
+					keyb_answer(0x00);
 					break;
 				default:
-					while (keybuf.count())
-						keybuf.get();
 					// irq(2);
-					keybuf.put(0xfa);
+					keyb_answer(0xfa);
 					break;
 			}
 			break;
 		case 0x3fc:
-			while (mousebuf.count())
-				mousebuf.get();
+			while (mouse_serial.get(&v))
+				;
 #if (MOUSE_PROTOCOL == MOUSE_MS)
-			mousebuf.put('M');
+			mouse_serial.put('M');
+			irq(4);
+#else
+			mouse_send();
 #endif
 			break;
 	}
@@ -5,8 +5,24 @@
 
 #define MOUSE_PROTOCOL		MOUSE_SYSTEMS
 
-void check_keyb();
-void check_mouse();
+// Input events from the UI thread, host time in microseconds
+typedef struct
+{
+	unsigned int time;
+	unsigned char code;
+} key_event_t;
+
+typedef struct
+{
+	unsigned int time;
+	short x, y;
+	unsigned char buttons;
+} mouse_event_t;
+
+// Set by the UI thread when it queues an event, the CPU loop calls check_input() then
+extern atomic<int> input_pending;
+
+void check_input();
 
 unsigned char keybmouse_portread(unsigned short port);
 void keybmouse_portwrite(unsigned short port, unsigned char value);
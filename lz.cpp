@@ -0,0 +1,168 @@
+#include "stdafx.h"
+#include "lz.h"
+
+// Byte oriented LZ77 codec for disk image blocks.
+// Every sequence is: token (literal count << 4 | match length - 4), more literal count bytes,
+// literals, 16-bit match offset, more match length bytes. Counts of 15 and more continue
+// in the following bytes, 255 means "add and read one more". The last sequence has literals only.
+
+#define LZ_MIN_MATCH		4
+#define LZ_MAX_OFFSET		65535
+#define LZ_HASH_BITS		12
+
+static unsigned int lz_hash(const unsigned char *p)
+{
+	unsigned int v = p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static int lz_put_length(unsigned char **op, const unsigned char *oend, int len)
+{
+	while (len >= 255)
+	{
+		if (*op >= oend)
+			return 0;
+		*(*op)++ = 255;
+		len -= 255;
+	}
+
+	if (*op >= oend)
+		return 0;
+	*(*op)++ = (unsigned char)len;
+
+	return 1;
+}
+
+static int lz_get_length(const unsigned char **ip, const unsigned char *iend, int *len)
+{
+	int b;
+
+	do
+	{
+		if (*ip >= iend)
+			return 0;
+		b = *(*ip)++;
+		*len += b;
+	} while (b == 255);
+
+	return 1;
+}
+
+// Match length 0 ends the stream
+static int lz_emit(unsigned char **op, const unsigned char *oend, const unsigned char *lit, int num_lit, int offset, int len)
+{
+	unsigned char *token;
+
+	if (*op >= oend)
+		return 0;
+	token = (*op)++;
+
+	*token = (num_lit >= 15 ? 15 : num_lit) << 4;
+	if ((num_lit >= 15) && !lz_put_length(op, oend, num_lit - 15))
+		return 0;
+
+	if (oend - *op < num_lit)
+		return 0;
+	memcpy(*op, lit, num_lit);
+	*op += num_lit;
+
+	if (len == 0)
+		return 1;
+
+	if (oend - *op < 2)
+		return 0;
+	*(*op)++ = offset & 0xFF;
+	*(*op)++ = offset >> 8;
+
+	len -= LZ_MIN_MATCH;
+	*token |= len >= 15 ? 15 : len;
+	if ((len >= 15) && !lz_put_length(op, oend, len - 15))
+		return 0;
+
+	return 1;
+}
+
+int lz_compress(const unsigned char *src, int size, unsigned char *dst, int capacity)
+{
+	int table[1 << LZ_HASH_BITS];
+	const unsigned char *ip = src, *anchor = src, *end = src + size, *ref;
+	unsigned char *op = dst;
+	const unsigned char *oend = dst + capacity;
+	unsigned int h;
+	int i, len;
+
+	for (i = 0; i < (1 << LZ_HASH_BITS); i++)
+		table[i] = -1;
+
+	while (end - ip >= LZ_MIN_MATCH)
+	{
+		h = lz_hash(ip);
+		ref = table[h] >= 0 ? src + table[h] : NULL;
+		table[h] = (int)(ip - src);
+
+		if ((ref != NULL) && (ip - ref <= LZ_MAX_OFFSET) && (memcmp(ref, ip, LZ_MIN_MATCH) == 0))
+		{
+			len = LZ_MIN_MATCH;
+			while ((ip + len < end) && (ref[len] == ip[len]))
+				len++;
+
+			if (!lz_emit(&op, oend, anchor, (int)(ip - anchor), (int)(ip - ref), len))
+				return 0;
+
+			ip += len;
+			anchor = ip;
+		}
+		else
+			ip++;
+	}
+
+	if (!lz_emit(&op, oend, anchor, (int)(end - anchor), 0, 0))
+		return 0;
+
+	return (int)(op - dst);
+}
+
+int lz_decompress(const unsigned char *src, int size, unsigned char *dst, int capacity)
+{
+	const unsigned char *ip = src, *iend = src + size, *ref;
+	unsigned char *op = dst, *oend = dst + capacity;
+	int token, len, offset;
+
+	while (ip < iend)
+	{
+		token = *ip++;
+
+		len = token >> 4;
+		if ((len == 15) && !lz_get_length(&ip, iend, &len))
+			return -1;
+		if ((iend - ip < len) || (oend - op < len))
+			return -1;
+		memcpy(op, ip, len);
+		op += len;
+		ip += len;
+
+		if (ip >= iend)
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if ((offset == 0) || (offset > op - dst))
+			return -1;
+
+		len = token & 15;
+		if ((len == 15) && !lz_get_length(&ip, iend, &len))
+			return -1;
+		len += LZ_MIN_MATCH;
+		if (oend - op < len)
+			return -1;
+
+		// Byte copy, the match may overlap the output
+		ref = op - offset;
+		while (len-- > 0)
+			*op++ = *ref++;
+	}
+
+	return (int)(op - dst);
+}
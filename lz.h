@@ -0,0 +1,10 @@
+#ifndef LZ_H
+#define LZ_H
+
+// Returns the compressed size or 0 if the result does not fit into dst
+int lz_compress(const unsigned char *src, int size, unsigned char *dst, int capacity);
+
+// Returns the decompressed size or -1 if the data is damaged
+int lz_decompress(const unsigned char *src, int size, unsigned char *dst, int capacity);
+
+#endif
@@ -7,7 +7,21 @@
 #include "ioports.h"
 #include "pic_pit.h"
 #include "keybmouse.h"
+#include "image.h"
+#include "blockcache.h"
+#include "render.h"
+#include "vclock.h"
+#if (BENCHMARK)
+#include "bench.h"
+#endif
+#if (PROFILER)
+#include "profiler.h"
+#endif
+#if (METRICS)
+#include "metrics.h"
+#endif
 #include <commdlg.h>
+#include <atomic>
 
 HINSTANCE hInst;
 HWND hWnd;
@@ -22,17 +36,52 @@ unsigned long cyctime = 0;
 unsigned char sys_ram[RAM_SIZE];
 unsigned char *ram = sys_ram;
 
-// Frame buffer for render_screen
+// Frame buffer the renderers draw into, render_screen paints a copy of it
 unsigned int scr[SCREEN_WIDTH * SCREEN_HEIGHT];
 
 // Video RAM. Should be at least 512KB for 640x480x256 mode
 unsigned int video_ram[1024 * 1024];
 unsigned int *vram = video_ram;
 
-FILE *fdd[NUM_FDD] = {NULL};
-FILE *hdd[NUM_HDD] = {NULL};
+image_t fdd[NUM_FDD];
+image_t hdd[NUM_HDD];
+
+// F9 writes modified disk sectors back to the image files
+static int flush_request = 0;
+
+// Ctrl+F9 - commit overlays to base images, Shift+F9 - discard overlays
+static int commit_request = 0;
+static int discard_request = 0;
+
+// F2 - floppy image picked on the UI thread, swapped by the CPU thread. -1 when none is pending
+static atomic<int> floppy_request(-1);
+static char floppy_request_file[MAX_PATH];
 
 COLORREF hw_palette[256] = {0};
+// Palette used by the renderers, taken from hw_palette at every snapshot
+static COLORREF scr_palette[256] = {0};
+
+// Frame at the guest resolution, palette indices written by the renderers
+static unsigned char native_fb[NATIVE_MAX_WIDTH * NATIVE_MAX_HEIGHT];
+static unsigned char native_dirty[NATIVE_MAX_HEIGHT];
+static int native_width = 0;
+static int native_height = 0;
+// Palette or size change, every scanline is converted again
+static int native_repaint = 1;
+
+// Text mode glyphs expanded to palette indices, keyed by font, character, attribute and cursor
+#define GLYPH_CACHE_SHIFT	11
+#define GLYPH_CACHE_SLOTS	(1 << GLYPH_CACHE_SHIFT)
+
+typedef struct
+{
+	unsigned int key;
+	unsigned int generation;
+	unsigned char pixels[8 * 16];
+} glyph_t;
+
+static glyph_t glyph_cache[GLYPH_CACHE_SLOTS];
+static unsigned int glyph_generation = 1;
 
 // Hardware set palette function. Not used on PC
 void hw_set_palette(unsigned char index, unsigned char r, unsigned char g, unsigned char b)
@@ -40,12 +89,20 @@ void hw_set_palette(unsigned char index, unsigned char r, unsigned char g, unsig
 	hw_palette[index] = RGB(b, g, r);
 }
 
+void hw_latch_palette()
+{
+	if (memcmp(scr_palette, hw_palette, sizeof(scr_palette)) == 0)
+		return;
+	memcpy(scr_palette, hw_palette, sizeof(scr_palette));
+	// The renderers draw indices, only the conversion to the screen is redone
+	native_repaint = 1;
+}
+
 void hw_read_floppy(int disk, unsigned char *buffer, unsigned int lba, unsigned int count)
 {
 	if ((disk < 0) || (disk >= NUM_FDD))
 		return;
-	fseek(fdd[disk], lba * 512, SEEK_SET);
-	fread(buffer, 512, count, fdd[disk]);
+	image_read(&fdd[disk], buffer, lba, count);
 }
 
 void hw_write_floppy(int disk, const unsigned char *buffer, unsigned int lba, unsigned int count)
@@ -57,57 +114,162 @@ void hw_read_hdd(int disk, unsigned char *buffer, unsigned int lba, unsigned int
 {
 	if ((disk < 0) || (disk >= NUM_HDD))
 		return;
-	fseek(hdd[disk], lba * 512, SEEK_SET);
-	fread(buffer, 512, count, hdd[disk]);
+	image_read(&hdd[disk], buffer, lba, count);
 }
 
 void hw_write_hdd(int disk, const unsigned char *buffer, unsigned int lba, unsigned int count)
 {
 	if ((disk < 0) || (disk >= NUM_HDD))
 		return;
-	fseek(hdd[disk], lba * 512, SEEK_SET);
-	fwrite(buffer, 512, count, hdd[disk]);
+	image_write(&hdd[disk], buffer, lba, count);
 }
 
-void set_pixel_2x2(int x, int y, unsigned int color)
+void glyph_cache_flush()
 {
-	unsigned int *v;
-	color = hw_palette[color & 0xFF];
-	y = SCREEN_HEIGHT / 2 - y - 1;
-	v = &scr[x * 2 + y * 2 * SCREEN_WIDTH];
-	v[0] = color;
-	v[1] = color;
-	v[SCREEN_WIDTH] = color;
-	v[SCREEN_WIDTH + 1] = color;
+	glyph_generation++;
 }
 
-void set_pixel_2x1(int x, int y, unsigned int color)
+void native_set_size(int width, int height)
 {
-	unsigned int *v;
-	color = hw_palette[color & 0xFF];
-	y = SCREEN_HEIGHT - y - 1;
-	v = &scr[x * 2 + y * SCREEN_WIDTH];
-	v[0] = color;
-	v[1] = color;
+	if (width > NATIVE_MAX_WIDTH)
+		width = NATIVE_MAX_WIDTH;
+	if (height > NATIVE_MAX_HEIGHT)
+		height = NATIVE_MAX_HEIGHT;
+	if ((width == native_width) && (height == native_height))
+		return;
+
+	native_width = width;
+	native_height = height;
+	// A smaller image does not cover all of the old one
+	memset(scr, 0, sizeof(scr));
+	native_repaint = 1;
 }
 
-void set_pixel_1x2(int x, int y, unsigned int color)
+unsigned char *native_line(int y)
 {
-	unsigned int *v;
-	color = hw_palette[color & 0xFF];
-	y = SCREEN_HEIGHT / 2 - y - 1;
-	v = &scr[x + y * 2 * SCREEN_WIDTH];
-	v[0] = color;
-	v[SCREEN_WIDTH] = color;
+	static unsigned char discard[NATIVE_MAX_WIDTH];
+
+	if ((unsigned int)y >= (unsigned int)native_height)
+		return discard;
+
+	native_dirty[y] = 1;
+	return &native_fb[y * native_width];
 }
 
-void set_pixel(int x, int y, unsigned int color)
+// Converts a native scanline to screen pixels. Integer scale factors up to the screen width,
+// wider lines are sampled down.
+static void native_convert(unsigned int *v, const unsigned char *s)
+{
+	unsigned int color, x, step;
+	int i, j, scale;
+
+	scale = SCREEN_WIDTH / native_width;
+	switch (scale)
+	{
+		case 0:
+			step = (native_width << 16) / SCREEN_WIDTH;
+			for (i = 0, x = 0; i < SCREEN_WIDTH; i++, x += step)
+				v[i] = scr_palette[s[x >> 16]];
+			break;
+		case 1:
+			for (i = 0; i < native_width; i++)
+				v[i] = scr_palette[s[i]];
+			break;
+		case 2:
+			// One 64-bit store per source pixel
+			for (i = 0; i < native_width; i++)
+				((unsigned __int64 *)v)[i] = scr_palette[s[i]] * 0x0000000100000001ull;
+			break;
+		default:
+			for (i = 0; i < native_width; i++)
+			{
+				color = scr_palette[s[i]];
+				for (j = 0; j < scale; j++)
+					*v++ = color;
+			}
+			break;
+	}
+}
+
+void native_present()
 {
 	unsigned int *v;
-	color = hw_palette[color & 0xFF];
+	int i, y, scale, width;
+
+	if ((native_width == 0) || (native_height == 0))
+		return;
+
+	// Screen pixels per converted line
+	scale = SCREEN_WIDTH / native_width;
+	width = scale ? native_width * scale : SCREEN_WIDTH;
+
+	scale = SCREEN_HEIGHT / native_height;
+	if (scale == 0)
+	{
+		// Taller than the screen, every screen line samples one scanline
+		for (i = 0; i < SCREEN_HEIGHT; i++)
+		{
+			y = i * native_height / SCREEN_HEIGHT;
+			if (native_repaint || native_dirty[y])
+				native_convert(&scr[(SCREEN_HEIGHT - i - 1) * SCREEN_WIDTH], &native_fb[y * native_width]);
+		}
+	}
+	else
+	{
+		for (y = 0; y < native_height; y++)
+		{
+			if (!native_repaint && !native_dirty[y])
+				continue;
+
+			// The first screen line is converted, the others are copies of it
+			v = &scr[(SCREEN_HEIGHT - y * scale - 1) * SCREEN_WIDTH];
+			native_convert(v, &native_fb[y * native_width]);
+			for (i = 1; i < scale; i++)
+				memcpy(v - i * SCREEN_WIDTH, v, width * sizeof(unsigned int));
+		}
+	}
+
+	memset(native_dirty, 0, native_height);
+	native_repaint = 0;
+}
+
+void set_glyph(int x, int y, int font, const unsigned char *font_data, int ch, int attr, int cursor)
+{
+	glyph_t *g;
+	const unsigned char *f;
+	unsigned char b, fg, bg;
+	unsigned int key;
+	int i, j, height;
+
+	height = (font == GLYPH_FONT_8X8) ? 8 : 16;
+
+	key = (font << 17) | (cursor ? 0x10000 : 0) | ((attr & 0xFF) << 8) | (ch & 0xFF);
+	g = &glyph_cache[(key * 2654435761u) >> (32 - GLYPH_CACHE_SHIFT)];
+
+	if ((g->key != key) || (g->generation != glyph_generation))
+	{
+		fg = attr & 0x0F;
+		bg = (attr >> 4) & 0x0F;
+		f = &font_data[(ch & 0xFF) * height];
+		for (i = 0; i < height; i++)
+		{
+			b = (cursor && (i == height - 1)) ? 0xFF : f[i];
+			for (j = 0; j < 8; j++)
+				g->pixels[i * 8 + j] = (b & (0x80 >> j)) ? fg : bg;
+		}
+		g->key = key;
+		g->generation = glyph_generation;
+	}
+
+	for (i = 0; i < height; i++)
+		memcpy(native_line(y + i) + x, &g->pixels[i * 8], 8);
+}
+
+// Direct color scanline, pixels are already 0x00RRGGBB
+void set_line_rgb(int y, const unsigned int *pixels, int count)
+{
 	y = SCREEN_HEIGHT - y - 1;
-	v = &scr[x + y * SCREEN_WIDTH];
-	v[0] = color;
+	memcpy(&scr[y * SCREEN_WIDTH], pixels, count * sizeof(unsigned int));
 }
 
 void shutdown()
@@ -122,6 +284,8 @@ void shutdown()
 void render_screen(HDC hdc)
 {
 	BITMAPINFO bmi;
+	const unsigned int *frame_buffer;
+	unsigned int frame;
 	ZeroMemory(&bmi, sizeof(bmi));
 
 	bmi.bmiHeader.biSize = sizeof(bmi.bmiHeader);
@@ -136,7 +300,9 @@ void render_screen(HDC hdc)
 	bmi.bmiHeader.biClrImportant = 0;
 	bmi.bmiHeader.biClrUsed = 0;
 
-	SetDIBitsToDevice(hdc, 0, 0, SCREEN_WIDTH, SCREEN_HEIGHT, 0, 0, 0, SCREEN_HEIGHT, scr, &bmi, DIB_RGB_COLORS);
+	frame_buffer = render_acquire(&frame);
+	SetDIBitsToDevice(hdc, 0, 0, SCREEN_WIDTH, SCREEN_HEIGHT, 0, 0, 0, SCREEN_HEIGHT, frame_buffer, &bmi, DIB_RGB_COLORS);
+	render_release(frame);
 }
 
 void change_floppy_disk(int drive, HWND owner_hwnd)
@@ -145,6 +311,10 @@ void change_floppy_disk(int drive, HWND owner_hwnd)
 		return;
 	}
 
+	// The previous swap has not been done yet, its file name is still in use
+	if (floppy_request.load(memory_order_acquire) >= 0)
+		return;
+
 	OPENFILENAMEA ofn;
 	char szFile[MAX_PATH] = { 0 };
 
@@ -162,13 +332,9 @@ void change_floppy_disk(int drive, HWND owner_hwnd)
 
 	if (GetOpenFileNameA(&ofn) == TRUE)
 	{
-		if (fdd[drive] != NULL)
-		{
-			fclose(fdd[drive]);
-			fdd[drive] = NULL;
-		}
-
-		fopen_s(&fdd[drive], ofn.lpstrFile, "rb+");
+		// The image may be mapped in the middle of a transfer, loop() swaps it between requests
+		strcpy_s(floppy_request_file, sizeof(floppy_request_file), ofn.lpstrFile);
+		floppy_request.store(drive, memory_order_release);
 
 		char title[512];
 		sprintf_s(title, sizeof(title), "e86r - Floppy 0: %s", ofn.lpstrFile);
@@ -176,6 +342,13 @@ void change_floppy_disk(int drive, HWND owner_hwnd)
 	}
 }
 
+// Start of the vertical retrace, the frame is complete
+static void vsync_event()
+{
+	render_vsync();
+	vclock_schedule(VCLOCK_EVENT_RETRACE, vga_next_retrace(), vsync_event);
+}
+
 void loop()
 {
 	int i;
@@ -215,29 +388,77 @@ void loop()
 	// Disk setup
 	disk_init();
 
-	fdd[0] = fopen("hwinfo.IMA", "rb+");
+	for (i = 0; i < NUM_FDD; i++)
+		image_init(&fdd[i]);
+	for (i = 0; i < NUM_HDD; i++)
+		image_init(&hdd[i]);
+
+#if (IMAGE_CONVERT)
+	// Before the drives are opened, the source is opened read-only and may be one of them
+	if (!image_convert(IMAGE_CONVERT_DEST, IMAGE_CONVERT_SOURCE, IMAGE_CONVERT_COMPRESS ? IMAGE_COMPRESSED : IMAGE_RAW))
+		MessageBoxA(NULL, "Cannot convert " IMAGE_CONVERT_SOURCE " to " IMAGE_CONVERT_DEST, "e86r", MB_OK | MB_ICONERROR);
+
+	terminated = 1;
+	PostMessage(hWnd, WM_CLOSE, 0, 0);
+#endif
+
+	image_open(&fdd[0], "hwinfo.IMA", IMAGE_READ_WRITE);
 	disk_set_fdd(0, 80, 2, 18);
 
 	
-	hdd[0] = fopen("hd0.img", "rb+");
+#if (HDD_OVERLAY)
+	if (!image_open(&hdd[0], HDD_OVERLAY_FILE_NAME, IMAGE_READ_WRITE))
+	{
+		image_create_overlay(HDD_OVERLAY_FILE_NAME, "hd0.img");
+		image_open(&hdd[0], HDD_OVERLAY_FILE_NAME, IMAGE_READ_WRITE);
+	}
+#else
+	image_open(&hdd[0], "hd0.img", HDD_READ_ONLY_BASE ? IMAGE_READ_ONLY_BASE : IMAGE_READ_WRITE);
+#endif
 	disk_set_hdd(0, 104, 16, 63);
 	
 	
 	/*
-	hdd[0] = fopen("c:\\hd10meg.img", "rb+");
+	image_open(&hdd[0], "c:\\hd10meg.img", IMAGE_READ_WRITE);
 	disk_set_hdd(0, 306, 4, 17);
 
-	hdd[1] = fopen("c:\\hd10meg.img", "rb+");
+	image_open(&hdd[1], "c:\\hd10meg.img", IMAGE_READ_WRITE);
 	disk_set_hdd(1, 306, 4, 17);
 	*/
 
 	/*
-	hdd[0] = fopen("c:\\hd_oldlinux.img", "rb+");
+	image_open(&hdd[0], "c:\\hd_oldlinux.img", IMAGE_READ_WRITE);
 	disk_set_hdd(0, 1023, 4, 20);
-	hdd[1] = fopen("c:\\hd_oldlinux.img", "rb+");
+	image_open(&hdd[1], "c:\\hd_oldlinux.img", IMAGE_READ_WRITE);
 	disk_set_hdd(1, 1023, 4, 20);
 	*/
 
+#if (BENCHMARK)
+	// The IDE benchmark needs some disk behind drive 0
+	if (!image_is_open(&hdd[0]))
+		image_create_temp(&hdd[0], 104 * 16 * 63 * 512);
+
+	fopen_s(&f, BENCHMARK_FILE_NAME, "wt");
+	bench_run(f, c0);
+	if (f != NULL)
+		fclose(f);
+
+	terminated = 1;
+	PostMessage(hWnd, WM_CLOSE, 0, 0);
+#endif
+
+#if (PROFILER)
+	profiler_init(PROFILER_INTERVAL);
+	// For DOS .map files pass the program load segment instead of 0
+	profiler_load_symbols(PROFILER_SYMBOL_FILE_NAME, 0);
+#endif
+
+#if (METRICS)
+	metrics_init();
+#endif
+
+	vclock_schedule(VCLOCK_EVENT_RETRACE, vga_next_retrace(), vsync_event);
+
 	// Main emulator loop
 	while (!terminated)
 	{
@@ -267,46 +488,78 @@ void loop()
 
 			check_irqs();
 
-			ports[0x3da] ^= 1;
+			vclock_poll();
 
-			pit_step();
+			if (input_pending)
+				check_input();
+		}
 
-			ide_timer_tick();
+#if (PROFILER)
+		if (profiler_dump_request)
+		{
+			profiler_dump_request = 0;
+			profiler_dump(PROFILER_FILE_NAME, PROFILER_COLLAPSED_FILE_NAME);
+		}
+#endif
+
+#if (METRICS)
+		metrics_poll();
+#endif
+
+		if (flush_request)
+		{
+			flush_request = 0;
+			for (i = 0; i < NUM_FDD; i++)
+				image_flush(&fdd[i]);
+			for (i = 0; i < NUM_HDD; i++)
+				image_flush(&hdd[i]);
+		}
 
-			if ((i & 0x3F) == 0)
+		if (commit_request || discard_request)
+		{
+			// No disk requests may run while the overlay is remapped
+			diskio_drain();
+			for (i = 0; i < NUM_HDD; i++)
 			{
-				check_mouse();
+				if (commit_request)
+					image_commit(&hdd[i]);
+				else
+					image_discard(&hdd[i]);
 			}
+			commit_request = 0;
+			discard_request = 0;
 		}
 
-		ports[0x3da] ^= 8;
-
-		check_keyb();
-
-		if (ports[0x3da] & 8)
+		i = floppy_request.load(memory_order_acquire);
+		if (i >= 0)
 		{
-			InvalidateRect(hWnd, NULL, false);
-			// Sleep(5);
+			diskio_drain();
+			image_close(&fdd[i]);
+			image_open(&fdd[i], floppy_request_file, IMAGE_READ_WRITE);
+			floppy_request.store(-1, memory_order_release);
 		}
+
+		vclock_sync();
 	}
 
+#if (PROFILER)
+	profiler_dump(PROFILER_FILE_NAME, PROFILER_COLLAPSED_FILE_NAME);
+	profiler_deinit();
+#endif
+
+#if (METRICS)
+	metrics_deinit();
+#endif
+
 	disk_deinit();
 
 	for (i = 0; i < NUM_FDD; i++)
-	{
-		if (fdd[i] != NULL)
-		{
-			fclose(fdd[i]);
-		}
-	}
+		image_close(&fdd[i]);
 
 	for (i = 0; i < NUM_HDD; i++)
-	{
-		if (hdd[i] != NULL)
-		{
-			fclose(hdd[i]);
-		}
-	}
+		image_close(&hdd[i]);
+
+	blockcache_deinit();
 
 	if (c0 != NULL)
 		fclose(c0);
@@ -335,8 +588,6 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
 		case WM_PAINT:
 			hdc = BeginPaint(hWnd, &ps);
 
-			update_screen();
-
 			render_screen(hdc);
 			
 			ncyc += cyc;
@@ -375,10 +626,25 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
 				if (dasm == NULL)
 					fopen_s(&dasm, DISASM_FILE_NAME, "wt");
 			}
+#if (PROFILER)
+			else if (wParam == VK_F11)
+			{
+				profiler_dump_request = 1;
+			}
+#endif
 			else if (wParam == VK_F2)
 			{
 				change_floppy_disk(0, hWnd);
 			}
+			else if (wParam == VK_F9)
+			{
+				if (GetKeyState(VK_CONTROL) < 0)
+					commit_request = 1;
+				else if (GetKeyState(VK_SHIFT) < 0)
+					discard_request = 1;
+				else
+					flush_request = 1;
+			}
 			else if (wParam == VK_PRIOR)
 			{
 				ncycles -= 200;
@@ -490,6 +756,8 @@ int APIENTRY _tWinMain(_In_ HINSTANCE hInstance,
 		return FALSE;
 	}
 
+	render_init();
+
 	thread th1(loop);
 
 	while (GetMessage(&msg, NULL, 0, 0))
@@ -501,6 +769,8 @@ int APIENTRY _tWinMain(_In_ HINSTANCE hInstance,
 	terminated = 1;
 	th1.join();
 
+	render_deinit();
+
 	return (int) msg.wParam;
 }
 
@@ -3,6 +3,9 @@
 #include "cpu.h"
 #include "interrupts.h"
 #include "vga.h"
+#if (METRICS)
+#include "metrics.h"
+#endif
 
 unsigned int ss_mask = 0xFFFFu;
 unsigned int ss_inv_mask = 0xFFFF0000u;
@@ -71,6 +74,9 @@ int get_phys_addr(unsigned int addr, unsigned int *phys)
 	unsigned int user;
 	if (paging)
 	{
+#if (METRICS)
+		metrics.page_walks++;
+#endif
 		user = cs.dpl == 3;
 		unsigned int e = dir[addr >> 22u];
 		if (!(e & 1))
@@ -125,6 +131,9 @@ int get_phys_addr_write(unsigned int addr, unsigned int *phys)
 	unsigned int user;
 	if (paging)
 	{
+#if (METRICS)
+		metrics.page_walks++;
+#endif
 		user = cs.dpl == 3;
 		unsigned int e = dir[addr >> 22u];
 		if (!(e & 1))
@@ -222,7 +231,13 @@ int readphys8(unsigned int addr, unsigned char *v)
 		return 1;
 	}
 	if (addr >= RAM_SIZE)
-		*v = 0xff;
+	{
+		// VBE linear frame buffer
+		if ((addr - VBE_LFB_ADDRESS) < VBE_LFB_SIZE)
+			*v = VBE_LFB[addr - VBE_LFB_ADDRESS];
+		else
+			*v = 0xff;
+	}
 	else
 		*v = ram[addr];
 	return 1;
@@ -233,12 +248,16 @@ int readphys16(unsigned int addr, unsigned short *v)
 	addr &= a20mask;
 	if ((addr & 0xFFFF0000) == 0xA0000)
 	{
-		*v = vga_memread(addr);
-		*v |= vga_memread(addr + 1) << 8u;
+		*v = vga_memread16(addr);
 		return 1;
 	}
 	if (addr >= RAM_SIZE)
-		*v = 0xffffu;
+	{
+		if ((addr - VBE_LFB_ADDRESS) < VBE_LFB_SIZE - 1)
+			*v = *(unsigned short *)&VBE_LFB[addr - VBE_LFB_ADDRESS];
+		else
+			*v = 0xffffu;
+	}
 	else
 		*v = *(unsigned short *)&ram[addr];
 	return 1;
@@ -249,14 +268,16 @@ int readphys32(unsigned int addr, unsigned int *v)
 	addr &= a20mask;
 	if ((addr & 0xFFFF0000) == 0xA0000)
 	{
-		*v = vga_memread(addr);
-		*v |= vga_memread(addr + 1) << 8u;
-		*v |= vga_memread(addr + 2) << 16u;
-		*v |= vga_memread(addr + 3) << 24u;
+		*v = vga_memread32(addr);
 		return 1;
 	}
 	if (addr >= RAM_SIZE)
-		*v = 0xffffffffu;
+	{
+		if ((addr - VBE_LFB_ADDRESS) < VBE_LFB_SIZE - 3)
+			*v = *(unsigned int *)&VBE_LFB[addr - VBE_LFB_ADDRESS];
+		else
+			*v = 0xffffffffu;
+	}
 	else
 		*v = *(unsigned int *)&ram[addr];
 	return 1;
@@ -291,8 +312,19 @@ int writephys8(unsigned int addr, unsigned char v)
 		vga_memwrite(addr, v);
 		return 1;
 	}
+	// CGA / text mode memory
+	if ((addr & 0xFFFF8000) == 0xB8000)
+		VGA_MARK_DIRTY(addr - 0xA0000);
 	if (addr >= RAM_SIZE)
+	{
+		// VBE linear frame buffer
+		if ((addr - VBE_LFB_ADDRESS) < VBE_LFB_SIZE)
+		{
+			VBE_LFB[addr - VBE_LFB_ADDRESS] = v;
+			VBE_MARK_DIRTY(addr - VBE_LFB_ADDRESS);
+		}
 		return 1;
+	}
 	ram[addr] = v;
 	return 1;
 }
@@ -302,12 +334,25 @@ int writephys16(unsigned int addr, unsigned short v)
 	addr &= a20mask;
 	if ((addr & 0xFFFF0000) == 0xA0000)
 	{
-		vga_memwrite(addr, (unsigned char)v);
-		vga_memwrite(addr + 1, v >> 8);
+		vga_memwrite16(addr, v);
 		return 1;
 	}
+	// CGA / text mode memory
+	if ((addr & 0xFFFF8000) == 0xB8000)
+	{
+		VGA_MARK_DIRTY(addr - 0xA0000);
+		VGA_MARK_DIRTY(addr + 1 - 0xA0000);
+	}
 	if (addr >= RAM_SIZE)
+	{
+		if ((addr - VBE_LFB_ADDRESS) < VBE_LFB_SIZE - 1)
+		{
+			*(unsigned short *)&VBE_LFB[addr - VBE_LFB_ADDRESS] = v;
+			VBE_MARK_DIRTY(addr - VBE_LFB_ADDRESS);
+			VBE_MARK_DIRTY(addr + 1 - VBE_LFB_ADDRESS);
+		}
 		return 1;
+	}
 	*(unsigned short *)&ram[addr] = v;
 	return 1;
 }
@@ -317,14 +362,25 @@ int writephys32(unsigned int addr, unsigned int v)
 	addr &= a20mask;
 	if ((addr & 0xFFFF0000) == 0xA0000)
 	{
-		vga_memwrite(addr, v);
-		vga_memwrite(addr + 1, v >> 8);
-		vga_memwrite(addr + 2, v >> 16u);
-		vga_memwrite(addr + 3, v >> 24u);
+		vga_memwrite32(addr, v);
 		return 1;
 	}
+	// CGA / text mode memory
+	if ((addr & 0xFFFF8000) == 0xB8000)
+	{
+		VGA_MARK_DIRTY(addr - 0xA0000);
+		VGA_MARK_DIRTY(addr + 3 - 0xA0000);
+	}
 	if (addr >= RAM_SIZE)
+	{
+		if ((addr - VBE_LFB_ADDRESS) < VBE_LFB_SIZE - 3)
+		{
+			*(unsigned int *)&VBE_LFB[addr - VBE_LFB_ADDRESS] = v;
+			VBE_MARK_DIRTY(addr - VBE_LFB_ADDRESS);
+			VBE_MARK_DIRTY(addr + 3 - VBE_LFB_ADDRESS);
+		}
 		return 1;
+	}
 	*(unsigned int *)&ram[addr] = v;
 	return 1;
 }
@@ -0,0 +1,273 @@
+#include "stdafx.h"
+#include "cpu.h"
+#include "metrics.h"
+#include "blockcache.h"
+
+// Runtime metrics. Counters are cumulative since metrics_reset(),
+// metrics_poll() appends a snapshot to METRICS_FILE_NAME every METRICS_INTERVAL ms.
+
+metrics_t metrics;
+
+static unsigned __int64 irq_raise_time[16];
+
+static FILE *metrics_file = NULL;
+static unsigned long metrics_start = 0;
+static unsigned long metrics_last = 0;
+
+typedef struct
+{
+	const char *name;
+	unsigned short first;
+	unsigned short last;
+} port_range_t;
+
+// The last entry catches everything else
+static const port_range_t port_ranges[METRICS_NUM_PORT_RANGES] =
+{
+	{"pic", 0x20, 0x21},
+	{"pit", 0x40, 0x43},
+	{"keyb", 0x60, 0x64},
+	{"cmos", 0x70, 0x71},
+	{"sysctl", 0x92, 0x92},
+	{"pic2", 0xA0, 0xA1},
+	{"ide1", 0x170, 0x177},
+	{"vbe", 0x1CE, 0x1CF},
+	{"ide0", 0x1F0, 0x1F7},
+	{"ide1_ctl", 0x376, 0x377},
+	{"vga", 0x3B0, 0x3DF},
+	{"ide0_ctl", 0x3F6, 0x3F7},
+	{"com1", 0x3F8, 0x3FF},
+	{"ide_bm", 0xF000, 0xF00F},
+	{"other", 0, 0xFFFF},
+};
+
+static int hist_bucket(unsigned __int64 v)
+{
+	int n = 0;
+
+	while ((v != 0) && (n < METRICS_HIST_BUCKETS - 1))
+	{
+		v >>= 1;
+		n++;
+	}
+
+	return n;
+}
+
+void metrics_reset()
+{
+	memset(&metrics, 0, sizeof(metrics));
+	memset(irq_raise_time, 0, sizeof(irq_raise_time));
+}
+
+void metrics_init()
+{
+	metrics_reset();
+
+	metrics_file = NULL;
+	if (strcmp(METRICS_FILE_NAME, "-") == 0)
+		metrics_file = stdout;
+	else
+		fopen_s(&metrics_file, METRICS_FILE_NAME, "wt");
+
+	metrics_start = metrics_last = GetTickCount();
+}
+
+void metrics_irq_raised(int n)
+{
+	n &= 15;
+	metrics.irq_raised[n]++;
+
+	// Repeated requests while pending are merged by the PIC, measure from the first one
+	if (!(irqs & (1 << n)))
+		irq_raise_time[n] = metrics.instructions;
+}
+
+void metrics_irq_delivered(int n)
+{
+	unsigned __int64 latency;
+
+	n &= 15;
+	latency = metrics.instructions - irq_raise_time[n];
+
+	metrics.irq_delivered[n]++;
+	metrics.irq_latency_sum[n] += latency;
+	if (latency > metrics.irq_latency_max[n])
+		metrics.irq_latency_max[n] = latency;
+	metrics.irq_latency_hist[hist_bucket(latency)]++;
+}
+
+static int port_range(unsigned short port)
+{
+	int i;
+
+	for (i = 0; i < METRICS_NUM_PORT_RANGES - 1; i++)
+		if ((port >= port_ranges[i].first) && (port <= port_ranges[i].last))
+			break;
+
+	return i;
+}
+
+void metrics_port_read(unsigned short port)
+{
+	metrics.port_reads[port_range(port)]++;
+}
+
+void metrics_port_write(unsigned short port)
+{
+	metrics.port_writes[port_range(port)]++;
+}
+
+void metrics_frame(unsigned int us)
+{
+	metrics.frames++;
+	metrics.frame_time_sum += us;
+	if (us > metrics.frame_time_max)
+		metrics.frame_time_max = us;
+	metrics.frame_time_hist[hist_bucket(us)]++;
+}
+
+void metrics_input(unsigned int us)
+{
+	metrics.input_events++;
+	metrics.input_latency_sum += us;
+	if (us > metrics.input_latency_max)
+		metrics.input_latency_max = us;
+	metrics.input_latency_hist[hist_bucket(us)]++;
+}
+
+static void dump_hist_json(FILE *f, const unsigned __int64 *h)
+{
+	int i;
+
+	fprintf(f, "[");
+	for (i = 0; i < METRICS_HIST_BUCKETS; i++)
+		fprintf(f, "%s%llu", i ? "," : "", h[i]);
+	fprintf(f, "]");
+}
+
+static void dump_hist_text(FILE *f, const unsigned __int64 *h, const char *unit)
+{
+	int i;
+
+	for (i = 0; i < METRICS_HIST_BUCKETS; i++)
+		if (h[i])
+			fprintf(f, "    < %-9u %s  %llu\n", 1u << i, unit, h[i]);
+}
+
+// JSON output is one object per line so snapshots can be appended
+void metrics_dump(FILE *f, int json)
+{
+	int i, first;
+	unsigned long t = GetTickCount() - metrics_start;
+	blockcache_stats_t bc;
+
+	if (f == NULL)
+		return;
+
+	blockcache_get_stats(&bc);
+
+	if (json)
+	{
+		fprintf(f, "{\"time_ms\":%lu,\"instructions\":%llu,\"interrupts\":{", t, metrics.instructions);
+		for (i = 0, first = 1; i < 256; i++)
+			if (metrics.interrupts[i])
+			{
+				fprintf(f, "%s\"%d\":%llu", first ? "" : ",", i, metrics.interrupts[i]);
+				first = 0;
+			}
+		fprintf(f, "},\"exceptions\":{");
+		for (i = 0, first = 1; i < 32; i++)
+			if (metrics.exceptions[i])
+			{
+				fprintf(f, "%s\"%d\":%llu", first ? "" : ",", i, metrics.exceptions[i]);
+				first = 0;
+			}
+		fprintf(f, "},\"irqs\":[");
+		for (i = 0; i < 16; i++)
+		{
+			fprintf(f, "%s{\"irq\":%d,\"raised\":%llu,\"delivered\":%llu,\"latency_sum\":%llu,\"latency_max\":%llu}",
+				i ? "," : "", i, metrics.irq_raised[i], metrics.irq_delivered[i],
+				metrics.irq_latency_sum[i], metrics.irq_latency_max[i]);
+		}
+		fprintf(f, "],\"irq_latency_hist\":");
+		dump_hist_json(f, metrics.irq_latency_hist);
+		fprintf(f, ",\"page_walks\":%llu,\"ports\":{", metrics.page_walks);
+		for (i = 0; i < METRICS_NUM_PORT_RANGES; i++)
+		{
+			fprintf(f, "%s\"%s\":{\"reads\":%llu,\"writes\":%llu}", i ? "," : "",
+				port_ranges[i].name, metrics.port_reads[i], metrics.port_writes[i]);
+		}
+		fprintf(f, "},\"hdd\":{\"sectors_read\":%llu,\"sectors_written\":%llu,\"ide_bytes_in\":%llu,\"ide_bytes_out\":%llu}",
+			metrics.hdd_sectors_read, metrics.hdd_sectors_written, metrics.ide_bytes_in, metrics.ide_bytes_out);
+		fprintf(f, ",\"block_cache\":{\"hits\":%llu,\"misses\":%llu,\"evictions\":%llu,\"used\":%u,\"capacity\":%u}",
+			bc.hits, bc.misses, bc.evictions, bc.used, bc.capacity);
+		fprintf(f, ",\"frames\":{\"count\":%llu,\"time_sum_us\":%llu,\"time_max_us\":%llu,\"time_hist\":",
+			metrics.frames, metrics.frame_time_sum, metrics.frame_time_max);
+		dump_hist_json(f, metrics.frame_time_hist);
+		fprintf(f, "},\"input\":{\"events\":%llu,\"latency_sum_us\":%llu,\"latency_max_us\":%llu,\"latency_hist\":",
+			metrics.input_events, metrics.input_latency_sum, metrics.input_latency_max);
+		dump_hist_json(f, metrics.input_latency_hist);
+		fprintf(f, "}}\n");
+	}
+	else
+	{
+		fprintf(f, "--- %lu ms ---\n", t);
+		fprintf(f, "instructions: %llu\n", metrics.instructions);
+		fprintf(f, "interrupts:\n");
+		for (i = 0; i < 256; i++)
+			if (metrics.interrupts[i])
+				fprintf(f, "  %.2X  %llu\n", i, metrics.interrupts[i]);
+		fprintf(f, "exceptions:\n");
+		for (i = 0; i < 32; i++)
+			if (metrics.exceptions[i])
+				fprintf(f, "  %-2d  %llu\n", i, metrics.exceptions[i]);
+		fprintf(f, "irqs:        raised   delivered  avg latency  max latency\n");
+		for (i = 0; i < 16; i++)
+			if (metrics.irq_raised[i] || metrics.irq_delivered[i])
+				fprintf(f, "  %-2d  %12llu  %10llu  %11llu  %11llu\n", i, metrics.irq_raised[i], metrics.irq_delivered[i],
+					metrics.irq_delivered[i] ? metrics.irq_latency_sum[i] / metrics.irq_delivered[i] : 0,
+					metrics.irq_latency_max[i]);
+		fprintf(f, "  latency:\n");
+		dump_hist_text(f, metrics.irq_latency_hist, "instr");
+		fprintf(f, "page walks: %llu\n", metrics.page_walks);
+		fprintf(f, "ports:              reads       writes\n");
+		for (i = 0; i < METRICS_NUM_PORT_RANGES; i++)
+			if (metrics.port_reads[i] || metrics.port_writes[i])
+				fprintf(f, "  %-8s  %12llu %12llu\n", port_ranges[i].name, metrics.port_reads[i], metrics.port_writes[i]);
+		fprintf(f, "hdd: %llu sectors read, %llu sectors written, IDE %llu bytes in, %llu bytes out\n",
+			metrics.hdd_sectors_read, metrics.hdd_sectors_written, metrics.ide_bytes_in, metrics.ide_bytes_out);
+		fprintf(f, "block cache: %llu hits (%.1f%%), %llu misses, %llu evictions, %u of %u blocks used\n",
+			bc.hits, bc.hits + bc.misses ? bc.hits * 100.0 / (bc.hits + bc.misses) : 0.0, bc.misses,
+			bc.evictions, bc.used, bc.capacity);
+		fprintf(f, "frames: %llu, avg %llu us, max %llu us\n", metrics.frames,
+			metrics.frames ? metrics.frame_time_sum / metrics.frames : 0, metrics.frame_time_max);
+		dump_hist_text(f, metrics.frame_time_hist, "us");
+		fprintf(f, "input: %llu events, avg latency %llu us, max %llu us\n", metrics.input_events,
+			metrics.input_events ? metrics.input_latency_sum / metrics.input_events : 0, metrics.input_latency_max);
+		dump_hist_text(f, metrics.input_latency_hist, "us");
+		fprintf(f, "\n");
+	}
+
+	fflush(f);
+}
+
+void metrics_poll()
+{
+	unsigned long t = GetTickCount();
+
+	if (t - metrics_last < METRICS_INTERVAL)
+		return;
+
+	metrics_last = t;
+	metrics_dump(metrics_file, METRICS_JSON);
+}
+
+void metrics_deinit()
+{
+	metrics_dump(metrics_file, METRICS_JSON);
+
+	if ((metrics_file != NULL) && (metrics_file != stdout))
+		fclose(metrics_file);
+	metrics_file = NULL;
+}
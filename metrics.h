@@ -0,0 +1,61 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#define METRICS_NUM_PORT_RANGES	15
+
+// Histograms use power of 2 buckets: bucket N counts values in [2^(N-1), 2^N)
+#define METRICS_HIST_BUCKETS	24
+
+typedef struct
+{
+	unsigned __int64 instructions;
+
+	unsigned __int64 interrupts[256];
+	unsigned __int64 exceptions[32];
+
+	unsigned __int64 irq_raised[16];
+	unsigned __int64 irq_delivered[16];
+	unsigned __int64 irq_latency_sum[16];
+	unsigned __int64 irq_latency_max[16];
+	// IRQ latency in instructions
+	unsigned __int64 irq_latency_hist[METRICS_HIST_BUCKETS];
+
+	unsigned __int64 page_walks;
+
+	// Byte transactions, 16/32-bit port access is split into bytes
+	unsigned __int64 port_reads[METRICS_NUM_PORT_RANGES];
+	unsigned __int64 port_writes[METRICS_NUM_PORT_RANGES];
+
+	unsigned __int64 hdd_sectors_read;
+	unsigned __int64 hdd_sectors_written;
+	unsigned __int64 ide_bytes_in;
+	unsigned __int64 ide_bytes_out;
+
+	unsigned __int64 frames;
+	unsigned __int64 frame_time_sum;
+	unsigned __int64 frame_time_max;
+	// Frame render time in microseconds
+	unsigned __int64 frame_time_hist[METRICS_HIST_BUCKETS];
+
+	unsigned __int64 input_events;
+	unsigned __int64 input_latency_sum;
+	unsigned __int64 input_latency_max;
+	// Host time from the UI event to the guest seeing it, microseconds
+	unsigned __int64 input_latency_hist[METRICS_HIST_BUCKETS];
+} metrics_t;
+
+extern metrics_t metrics;
+
+void metrics_init();
+void metrics_reset();
+void metrics_irq_raised(int n);
+void metrics_irq_delivered(int n);
+void metrics_port_read(unsigned short port);
+void metrics_port_write(unsigned short port);
+void metrics_frame(unsigned int us);
+void metrics_input(unsigned int us);
+void metrics_dump(FILE *f, int json);
+void metrics_poll();
+void metrics_deinit();
+
+#endif
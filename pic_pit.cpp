@@ -1,121 +1,210 @@
 #include "stdafx.h"
 #include "cpu.h"
 #include "pic_pit.h"
+#include "vclock.h"
+#if (METRICS)
+#include "metrics.h"
+#endif
 
-pic_t pic;
-pic_t pic2;
+pic_t pic = {0, 0, 0, {0}, 0, 7};
+pic_t pic2 = {0, 0, 0, {0}, 0, 7};
 
-pit_t pit = {0, 0, 0, 0, 0, 0, 0xFFFFu, 0xFFFFu, 0xFFFFu, 0xFFFFu, 0xFFFFu, 0xFFFFu};
+int irq_pending = 0;
 
+// Gates of channels 0 and 1 are tied high, channel 2 gate is bit 0 of port 61h
+pit_t pit[3] = {{0, 3, 0, 1}, {0, 3, 0, 1}, {0, 3, 0, 0}};
 
-int current_irq = -1;
+// Index of the lowest set bit, 8 for 0
+static unsigned char pic_first_bit[256];
 
-void irq(int n)
+static void pic_init_tables()
 {
-	irqs |= (1 << n);
+	int i, j;
+
+	for (i = 0; i < 256; i++)
+	{
+		for (j = 0; (j < 8) && !(i & (1 << j)); j++)
+			;
+		pic_first_bit[i] = j;
+	}
 }
 
-int get_next_irq_vector()
+// Priority order: bit 0 of the result is the highest priority level
+static inline int pic_rotate(pic_t *p, int bits)
 {
-	int m;
-	int test_irq;
-	
-	if (current_irq >= 0)
-	{
+	int shift = (p->lowest + 1) & 7;
+
+	return ((bits >> shift) | (bits << (8 - shift))) & 0xFF;
+}
+
+// Highest priority request of a chip that may interrupt now, -1 if none. cascade is the level
+// with a slave on it or -1.
+static int pic_highest(pic_t *p, int req, int cascade)
+{
+	int level, service, n;
+
+	// Not initialized yet
+	if ((p->icw[2] & 0xF8) == 0)
 		return -1;
-	}
 
-	if (irqs == 0)
-	{
+	req &= ~p->imr;
+	// In special mask mode only the level itself is inhibited by its in-service bit
+	if (p->special_mask)
+		req &= ~p->isr;
+	if (req == 0)
 		return -1;
+
+	level = pic_first_bit[pic_rotate(p, req)];
+	n = (level + p->lowest + 1) & 7;
+	if (!p->special_mask)
+	{
+		service = pic_first_bit[pic_rotate(p, p->isr)];
+		// Special fully nested mode lets the slave interrupt again while its cascade input is in service
+		if ((service < level) || ((service == level) && !((n == cascade) && (p->icw[4] & 0x10))))
+			return -1;
 	}
 
-	m = irqs &
-		(1 << 14) | (1 << 4) | (1 << 1) | (1 << 0) &
-		(~(pic.imr | (pic2.imr << 8))) &
-		(~(pic.isr | (pic2.isr << 8)));
+	return n;
+}
+
+// Highest priority request of the pair, IRQ number or -1
+static int pic_resolve()
+{
+	int slave, master, req;
+
+	// Single mode, no slave
+	if (pic.icw[1] & 2)
+		return pic_highest(&pic, irqs & 0xFF, -1);
+
+	// The slave output is the cascade input of the master
+	req = irqs & 0xFF;
+	slave = pic_highest(&pic2, (irqs >> 8) & 0xFF, -1);
+	if (slave >= 0)
+		req |= 1 << 2;
 
-	if (m == 0)
+	master = pic_highest(&pic, req, 2);
+	if ((master == 2) && (slave >= 0))
+		return 8 + slave;
+	return master;
+}
+
+static void pic_update()
+{
+	if (pic_first_bit[0] == 0)
+		pic_init_tables();
+
+	irq_pending = (irqs != 0) && (pic_resolve() >= 0);
+}
+
+static void pic_ack(pic_t *p, int level)
+{
+	if (p->icw[4] & 0x02)
 	{
-		return -1;
+		// Automatic EOI
+		if (p->rotate_aeoi)
+			p->lowest = level;
 	}
+	else
+		p->isr |= 1 << level;
+}
 
-	// Find an active interrupt
-	// We need to check all the interrupts frequently or Linux 0.01 will not start
-	test_irq = m & 0xFF ? 0 : 8;
+// Clears the highest priority in-service level, returns it or -1
+static int pic_eoi(pic_t *p)
+{
+	int level;
 
-	for (; test_irq < 15; test_irq++)
-	{
-		if (irqs & (1 << test_irq))
-		{
-			if (test_irq < 8)
-			{
-				if ((pic.icw[2] & 0xF8) == 0)
-					return -1;
-			}
-			else
-			{
-				if ((pic2.icw[2] & 0xF8) == 0)
-					return -1;
-			}
+	if (p->isr == 0)
+		return -1;
 
-			current_irq = test_irq;
+	level = (pic_first_bit[pic_rotate(p, p->isr)] + p->lowest + 1) & 7;
+	p->isr &= ~(1 << level);
+	return level;
+}
 
-			irqs &= ~(1 << current_irq);
-		
-			if (current_irq < 8)
-			{
-				pic.isr |= 1 << (current_irq & 7);
-				return (pic.icw[2] & 0xF8) + (current_irq & 7);
-			}
-			else
-			{
-				pic2.isr |= 1 << (current_irq & 7);
-				return (pic2.icw[2] & 0xF8) + (current_irq & 7);
-			}
-		}
-	}
+void irq(int n)
+{
+#if (METRICS)
+	metrics_irq_raised(n);
+#endif
+	irqs |= (1 << n);
+	pic_update();
+}
 
-	return -1;
+void irq_clear(int n)
+{
+	irqs &= ~(1 << n);
+	pic_update();
 }
 
-void pit_step()
+int get_next_irq_vector()
 {
-	if (pit.value[0] < 10)
+	int n, vector;
+
+	if (!irq_pending)
+		return -1;
+
+	n = pic_resolve();
+	if (n < 0)
 	{
-		pit.value[0] = pit.preset[0];
-		irq(0);
+		irq_pending = 0;
+		return -1;
 	}
-	else
-		pit.value[0] -= 2;
 
-	if (pit.value[1] < 10)
-		pit.value[1] = pit.preset[1];
+	irqs &= ~(1 << n);
+	if (n >= 8)
+	{
+		pic_ack(&pic2, n & 7);
+		pic_ack(&pic, 2);
+		vector = (pic2.icw[2] & 0xF8) + (n & 7);
+	}
 	else
-		pit.value[1] -= 10;
+	{
+		pic_ack(&pic, n);
+		vector = (pic.icw[2] & 0xF8) + n;
+	}
 
-	if (pit.value[2] < 10)
-		pit.value[2] = pit.preset[2];
-	else
-		pit.value[2] -= 10;	
+#if (METRICS)
+	metrics_irq_delivered(n);
+#endif
+
+	pic_update();
+	return vector;
+}
+
+// Poll command: the next read acknowledges the highest request of the chip
+static unsigned char pic_poll(pic_t *p)
+{
+	int level, base = (p == &pic2) ? 8 : 0;
+
+	p->poll = 0;
+	level = pic_highest(p, (irqs >> base) & 0xFF, -1);
+	if (level < 0)
+		return 0;
+
+	irqs &= ~(1 << (base + level));
+	pic_ack(p, level);
+	pic_update();
+	return 0x80 | level;
 }
 
 unsigned char pic_read(int port)
 {
+	pic_t *p = port >= 0xA0 ? &pic2 : &pic;
+	unsigned int base = port >= 0xA0 ? 8 : 0;
+
+	if (p->poll)
+		return pic_poll(p);
+
 	switch (port)
 	{
 		case 0x20:
-			if (pic.readmode == 0)
-				return pic.irr;
-			return pic.isr;
-		case 0x21:
-			return pic.imr;
 		case 0xA0:
-			if (pic2.readmode == 0)
-				return pic2.irr;
-			return pic2.isr;
+			if (p->readmode == 0)
+				return (unsigned char)(irqs >> base);
+			return p->isr;
+		case 0x21:
 		case 0xA1:
-			return pic2.imr;
+			return p->imr;
 	}
 	return 0;
 }
@@ -123,7 +212,7 @@ unsigned char pic_read(int port)
 void pic_write(int port, unsigned char value)
 {
 	pic_t *p = port >= 0xA0 ? &pic2 : &pic;
-	unsigned int base = port >= 0xA0 ? 8 : 0;
+	int level;
 
 	switch (port)
 	{
@@ -137,54 +226,62 @@ void pic_write(int port, unsigned char value)
 					{
 						case 0:
 							// Rotate in automatic EOI mode (clear)
+							p->rotate_aeoi = 0;
 							break;
 						case 1:
 							// Non-specific EOI
-							if (current_irq >= 0)
-							{
-								if ((current_irq & 8) == base)
-								{
-									p->isr &= ~(1 << ((current_irq - base) & 7));
-									current_irq = -1;
-								}
-							}
+							pic_eoi(p);
 							break;
 						case 2:
 							// Nop
 							break;
 						case 3:
 							// Specific EOI command
-							// irqs &= ~(1 << (base + (value & 7)));
-							if (current_irq == (base + (value & 7)))
-							{
-								p->isr &= ~(1 << (value & 7));
-								current_irq = -1;
-							}
+							p->isr &= ~(1 << (value & 7));
 							break;
 						case 4:
 							// Rotate in automatic EOI mode (set)
+							p->rotate_aeoi = 1;
 							break;
 						case 5:
 							// Rotate on non-specific EOI command
+							level = pic_eoi(p);
+							if (level >= 0)
+								p->lowest = level;
 							break;
 						case 6:
 							// Set priority command
+							p->lowest = value & 7;
 							break;
 						case 7:
 							// Rotate on specific EOI command
+							p->isr &= ~(1 << (value & 7));
+							p->lowest = value & 7;
 							break;
 					}
 					break;
 				case 0x08:
 					// OCW3
+					if (value & 0x40)
+						p->special_mask = (value >> 5) & 1;
+					if (value & 4)
+						p->poll = 1;
 					if (value & 2)
 						p->readmode = value & 1;
 					break;
 				case 0x10:
+				case 0x18:
 					// ICW1
 					p->icwstep = 1;
 					// p->imr = 0;
 					p->icw[p->icwstep++] = value;
+					p->icw[4] = 0;
+					p->isr = 0;
+					p->lowest = 7;
+					p->special_mask = 0;
+					p->rotate_aeoi = 0;
+					p->poll = 0;
+					p->readmode = 0;
 					break;
 			}
 			break;
@@ -230,66 +327,389 @@ void pic_write(int port, unsigned char value)
 			}
 			break;
 	}
+
+	pic_update();
 }
 
-unsigned char pit_read(int port)
+// PIT input clocks elapsed at the current virtual time
+static unsigned __int64 pit_clock()
 {
-	switch (port)
+	unsigned __int64 ns = vclock_now();
+
+	return ns / 1000000000 * PIT_FREQUENCY + ns % 1000000000 * PIT_FREQUENCY / 1000000000;
+}
+
+// First virtual time (ns) at which pit_clock() reaches clock
+static unsigned __int64 pit_clock_ns(unsigned __int64 clock)
+{
+	return clock / PIT_FREQUENCY * 1000000000 + (clock % PIT_FREQUENCY * 1000000000 + PIT_FREQUENCY - 1) / PIT_FREQUENCY;
+}
+
+static unsigned int pit_from_bcd(unsigned int v)
+{
+	return (v & 0x0F) + ((v >> 4) & 0x0F) * 10 + ((v >> 8) & 0x0F) * 100 + ((v >> 12) & 0x0F) * 1000;
+}
+
+static unsigned int pit_to_bcd(unsigned int v)
+{
+	return (v % 10) | ((v / 10 % 10) << 4) | ((v / 100 % 10) << 8) | ((v / 1000 % 10) << 12);
+}
+
+// Counter value and output computed from the clocks counted since start
+static void pit_state(pit_t *c, unsigned int *value, int *out)
+{
+	unsigned __int64 e;
+	unsigned int n, p, wrap;
+
+	if (!c->counting)
 	{
-		case 0x40:
-		case 0x41:
-		case 0x42:
-			switch (pit.access[port & 3])
+		*value = c->held;
+		*out = c->out;
+		return;
+	}
+
+	n = c->count;
+	wrap = c->bcd ? 10000 : 65536;
+	e = pit_clock() - c->start;
+
+	switch (c->mode)
+	{
+		case 0:
+		case 1:
+			// Output goes high at terminal count, the counter keeps wrapping
+			*value = (n + wrap - (unsigned int)(e % wrap)) % wrap;
+			*out = e >= n;
+			break;
+		case 4:
+		case 5:
+			// Output is low for one clock after terminal count
+			*value = (n + wrap - (unsigned int)(e % wrap)) % wrap;
+			*out = e != n;
+			break;
+		case 2:
+			p = (unsigned int)(e % n);
+			*value = (n - p) % wrap;
+			*out = p != n - 1;
+			break;
+		default:
+			// Counts down by 2, output high for the first half of the period
+			p = (unsigned int)(e % n);
+			if (p < (n + 1) / 2)
 			{
-				case 0:
-					pit.toggle[port & 3] = !pit.toggle[port & 3];
-					return (unsigned char)pit.value[port & 3];
-				case 1:
-					return (unsigned char)pit.value[port & 3];
-				case 2:
-					return (unsigned char)(pit.value[port & 3] >> 8);
-				case 3:
-					pit.toggle[port & 3] = !pit.toggle[port & 3];
-					if (pit.toggle[port & 3])
-						return (unsigned char)pit.value[port & 3];
-					return (pit.value[port & 3] >> 8);
+				*value = (n - 2 * p) % wrap;
+				*out = 1;
+			}
+			else
+			{
+				*value = (n - 2 * (p - (n + 1) / 2)) % wrap;
+				*out = 0;
 			}
 			break;
 	}
-	return 0;
 }
 
-void pit_write(int port, unsigned char value)
+static void pit_expire();
+
+// Schedules the next rising edge of channel 0 output, IRQ 0
+static void pit_schedule()
 {
-	unsigned char n;
-	switch (port)
+	pit_t *c = &pit[0];
+	unsigned __int64 e, edge;
+
+	if (!c->counting)
+	{
+		vclock_cancel(VCLOCK_EVENT_PIT);
+		return;
+	}
+
+	e = pit_clock() - c->start;
+	switch (c->mode)
+	{
+		case 0:
+		case 1:
+			edge = c->count;
+			break;
+		case 4:
+		case 5:
+			edge = c->count + 1;
+			break;
+		default:
+			edge = (e / c->count + 1) * c->count;
+			break;
+	}
+
+	// One-shot modes interrupt once per count
+	if (edge <= e)
+		vclock_cancel(VCLOCK_EVENT_PIT);
+	else
+		vclock_schedule(VCLOCK_EVENT_PIT, pit_clock_ns(c->start + edge), pit_expire);
+}
+
+static void pit_expire()
+{
+	irq(0);
+	pit_schedule();
+}
+
+// Stops the count, the value and output stay as they are
+static void pit_stop(pit_t *c)
+{
+	unsigned int value;
+	int out;
+
+	pit_state(c, &value, &out);
+	c->held = value;
+	c->out = out;
+	c->counting = 0;
+}
+
+static void pit_start(pit_t *c)
+{
+	c->start = pit_clock();
+	c->counting = 1;
+}
+
+static void pit_load(int n, unsigned int value)
+{
+	pit_t *c = &pit[n];
+
+	if (c->bcd)
+		value = pit_from_bcd(value);
+	c->count = value ? value : (c->bcd ? 10000 : 65536);
+	c->null_count = 0;
+
+	switch (c->mode)
 	{
-		case 0x40:
-			n = port & 3;
-			switch (pit.access[n])
+		case 0:
+		case 4:
+			c->out = c->mode == 4;
+			c->held = c->count & 0xFFFF;
+			if (c->gate)
+				pit_start(c);
+			else
+				c->start = 0;
+			break;
+		case 1:
+		case 5:
+			// Started by the next rising edge of the gate
+			break;
+		default:
+			// The 8254 takes a new count at the end of the current period, here it restarts at once
+			c->out = 1;
+			c->held = c->count & 0xFFFF;
+			if (c->gate)
+				pit_start(c);
+			break;
+	}
+
+	if (n == 0)
+		pit_schedule();
+}
+
+static void pit_latch(pit_t *c)
+{
+	unsigned int value;
+	int out;
+
+	if (c->latched)
+		return;
+
+	pit_state(c, &value, &out);
+	c->latch = c->bcd ? pit_to_bcd(value) : value;
+	c->latched = (c->access == 3) ? 2 : 1;
+}
+
+static void pit_latch_status(pit_t *c)
+{
+	unsigned int value;
+	int out;
+
+	if (c->status_latched)
+		return;
+
+	pit_state(c, &value, &out);
+	c->status = (out << 7) | (c->null_count << 6) | (c->access << 4) | (c->mode << 1) | c->bcd;
+	c->status_latched = 1;
+}
+
+void pit_set_gate(int n, int gate)
+{
+	pit_t *c = &pit[n];
+
+	gate = gate != 0;
+	if (c->gate == gate)
+		return;
+	c->gate = gate;
+
+	// No count written yet
+	if (c->null_count || (c->count == 0))
+		return;
+
+	switch (c->mode)
+	{
+		case 0:
+		case 4:
+			// Low gate pauses the count
+			if (!gate)
 			{
-				case 1:
-					pit.preset[n] = (pit.preset[n] & 0xFF00) | value;
-					break;
-				case 2:
-					pit.preset[n] = (pit.preset[n] & 0x00FF) | (value << 8);
-					break;
-				case 3:
-					pit.toggle[n] = !pit.toggle[n];
-					if (pit.toggle[n])
-						pit.preset[n] = (pit.preset[n] & 0xFF00) | value;
-					else
-						pit.preset[n] = (pit.preset[n] & 0x00FF) | (value << 8);
-					break;
+				pit_stop(c);
+				// Keeps the clocks counted so far
+				c->start = pit_clock() - c->start;
 			}
-			if (pit.preset[n] == 0)
-				pit.preset[n] = 0xFFFF;
+			else
+			{
+				c->start = pit_clock() - c->start;
+				c->counting = 1;
+			}
+			break;
+		case 1:
+		case 5:
+			// Rising edge (re)triggers the count
+			if (gate)
+				pit_start(c);
 			break;
-		case 0x43:
-			n = value >> 6;
-			pit.access[n] = (value >> 4) & 3;
-			if (pit.access[n] == 0)
-				pit.toggle[n] = 0;
+		default:
+			// Low gate stops the count and forces the output high, rising edge reloads
+			if (!gate)
+			{
+				pit_stop(c);
+				c->out = 1;
+			}
+			else
+				pit_start(c);
 			break;
 	}
+
+	if (n == 0)
+		pit_schedule();
+}
+
+int pit_output(int n)
+{
+	unsigned int value;
+	int out;
+
+	pit_state(&pit[n], &value, &out);
+	return out;
+}
+
+unsigned char pit_read(int port)
+{
+	pit_t *c;
+	unsigned int value;
+	int out;
+
+	if (port == 0x43)
+		return 0;
+
+	c = &pit[port & 3];
+
+	if (c->status_latched)
+	{
+		c->status_latched = 0;
+		return c->status;
+	}
+
+	if (c->latched)
+	{
+		value = c->latch;
+		c->latched--;
+	}
+	else
+	{
+		pit_state(c, &value, &out);
+		if (c->bcd)
+			value = pit_to_bcd(value);
+	}
+
+	switch (c->access)
+	{
+		case 1:
+			return (unsigned char)value;
+		case 2:
+			return (unsigned char)(value >> 8);
+	}
+
+	c->read_msb = !c->read_msb;
+	return c->read_msb ? (unsigned char)value : (unsigned char)(value >> 8);
+}
+
+void pit_write(int port, unsigned char value)
+{
+	pit_t *c;
+	int i, n;
+
+	if (port != 0x43)
+	{
+		n = port & 3;
+		c = &pit[n];
+		switch (c->access)
+		{
+			case 1:
+				pit_load(n, value);
+				break;
+			case 2:
+				pit_load(n, value << 8);
+				break;
+			case 3:
+				c->write_msb = !c->write_msb;
+				if (c->write_msb)
+				{
+					c->preset = value;
+					// Writing the first byte stops the count in mode 0
+					if ((c->mode == 0) && c->counting)
+					{
+						pit_stop(c);
+						c->out = 0;
+						if (n == 0)
+							pit_schedule();
+					}
+				}
+				else
+					pit_load(n, c->preset | (value << 8));
+				break;
+		}
+		return;
+	}
+
+	n = value >> 6;
+	if (n == 3)
+	{
+		// Read-back command
+		for (i = 0; i < 3; i++)
+		{
+			if (!(value & (2 << i)))
+				continue;
+			if (!(value & 0x20))
+				pit_latch(&pit[i]);
+			if (!(value & 0x10))
+				pit_latch_status(&pit[i]);
+		}
+		return;
+	}
+
+	c = &pit[n];
+	if ((value & 0x30) == 0)
+	{
+		// Counter latch command
+		pit_latch(c);
+		return;
+	}
+
+	c->access = (value >> 4) & 3;
+	c->mode = (value >> 1) & 7;
+	if (c->mode > 5)
+		c->mode -= 4;
+	c->bcd = value & 1;
+	c->write_msb = 0;
+	c->read_msb = 0;
+	c->latched = 0;
+	c->status_latched = 0;
+	c->null_count = 1;
+	// A new mode waits for its count
+	c->counting = 0;
+	c->out = c->mode != 0;
+
+	if (n == 0)
+		pit_schedule();
 }
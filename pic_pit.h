@@ -1,35 +1,68 @@
 #pragma once
 
+// 8259 pair. Requests of both chips are kept in irqs (bit n - IRQ n), the slave is on IRQ 2.
 typedef struct
 {
-	
 	unsigned char imr;
-	unsigned char irr;
 	unsigned char isr;
 	unsigned char icwstep;
 	unsigned char icw[5];
 	unsigned char readmode;
+	// Lowest priority level, changed by the rotation commands
+	unsigned char lowest;
+	unsigned char special_mask;
+	unsigned char rotate_aeoi;
+	unsigned char poll;
 } pic_t;
 
 extern pic_t pic;
 extern pic_t pic2;
 
+// Set when an unmasked request may interrupt the CPU, get_next_irq_vector acknowledges it
+extern int irq_pending;
+
+// 8254 input clock, Hz
+#define PIT_FREQUENCY	1193182u
+
+// 8254 channel. The counter is not stepped, its value is computed from the virtual time.
 typedef struct
 {
-	unsigned char access[3];
-	unsigned char toggle[3];
-	unsigned short preset[3];
-	unsigned short value[3];
+	unsigned char mode;
+	// 1 - LSB, 2 - MSB, 3 - LSB then MSB
+	unsigned char access;
+	unsigned char bcd;
+	unsigned char gate;
+	unsigned char counting;
+	unsigned char write_msb;
+	unsigned char read_msb;
+	// Bytes of the latched count left to read
+	unsigned char latched;
+	unsigned char status_latched;
+	unsigned char status;
+	unsigned char null_count;
+	// Output while not counting
+	unsigned char out;
+	unsigned short latch;
+	unsigned short preset;
+	// 1..65536 (10000 in BCD mode)
+	unsigned int count;
+	// Counter value while not counting
+	unsigned int held;
+	// PIT clock of the first count
+	unsigned __int64 start;
 } pit_t;
 
-extern pit_t pit;
+extern pit_t pit[3];
 
 void irq(int n);
+// Withdraws a request that has not been acknowledged yet
+void irq_clear(int n);
 
 unsigned char pic_read(int port);
 void pic_write(int port, unsigned char value);
 unsigned char pit_read(int port);
 void pit_write(int port, unsigned char value);
+void pit_set_gate(int n, int gate);
+int pit_output(int n);
 
-void pit_step();
 int get_next_irq_vector();
@@ -0,0 +1,262 @@
+#include "stdafx.h"
+#include "cpu.h"
+#include "profiler.h"
+
+// Sampling profiler for guest code.
+// Every "interval" instructions step() records CS:EIP, linear EIP, CPU mode and CPL
+// into an open-addressing hash histogram. Reports can be resolved against
+// System.map style ("c0100000 T _start") or DOS linker map ("0000:0010  _main") symbols.
+
+int profiler_countdown = 0x7FFFFFFF;
+int profiler_dump_request = 0;
+
+static int profiler_interval = 0;
+
+static prof_slot_t prof_slots[PROF_SLOTS];
+static unsigned int prof_used = 0;
+static unsigned int prof_samples = 0;
+static unsigned int prof_dropped = 0;
+
+static prof_symbol_t *prof_symbols = NULL;
+static int prof_num_symbols = 0;
+static int prof_max_symbols = 0;
+
+static const char *prof_mode_names[4] = {"real", "v86", "pmode16", "pmode32"};
+
+void profiler_reset()
+{
+	memset(prof_slots, 0, sizeof(prof_slots));
+	prof_used = 0;
+	prof_samples = 0;
+	prof_dropped = 0;
+}
+
+void profiler_init(int interval)
+{
+	profiler_interval = interval > 0 ? interval : 1;
+	profiler_countdown = profiler_interval;
+	profiler_dump_request = 0;
+	profiler_reset();
+}
+
+void profiler_sample()
+{
+	unsigned int linear, eip, h, i;
+	unsigned char mode;
+	prof_slot_t *s;
+
+	profiler_countdown = profiler_interval;
+
+	eip = instr_cs.big ? instr_eip : instr_eip & 0xFFFFu;
+	linear = instr_cs.base + eip;
+
+	if (!pmode)
+		mode = PROF_MODE_REAL;
+	else if (r.eflags & F_VM)
+		mode = PROF_MODE_V86;
+	else
+		mode = instr_cs.big ? PROF_MODE_PMODE32 : PROF_MODE_PMODE16;
+
+	prof_samples++;
+
+	h = (linear * 0x9E3779B1u) ^ (instr_cs.value << 4) ^ (mode << 2) ^ cpl;
+	for (i = 0; i < 16; i++)
+	{
+		s = &prof_slots[(h + i) & (PROF_SLOTS - 1)];
+		if (s->count == 0)
+		{
+			s->linear = linear;
+			s->eip = eip;
+			s->cs = instr_cs.value;
+			s->mode = mode;
+			s->cpl = cpl;
+			s->count = 1;
+			prof_used++;
+			return;
+		}
+		if ((s->linear == linear) && (s->eip == eip) && (s->cs == instr_cs.value) &&
+			(s->mode == mode) && (s->cpl == cpl))
+		{
+			s->count++;
+			return;
+		}
+	}
+
+	// Neighbourhood is full
+	prof_dropped++;
+}
+
+static int prof_add_symbol(unsigned int addr, const char *name)
+{
+	prof_symbol_t *p;
+
+	if (prof_num_symbols >= prof_max_symbols)
+	{
+		prof_max_symbols = prof_max_symbols ? prof_max_symbols * 2 : 1024;
+		p = (prof_symbol_t *)realloc(prof_symbols, prof_max_symbols * sizeof(prof_symbol_t));
+		if (p == NULL)
+			return 0;
+		prof_symbols = p;
+	}
+
+	p = &prof_symbols[prof_num_symbols++];
+	p->addr = addr;
+	strncpy(p->name, name, sizeof(p->name) - 1);
+	p->name[sizeof(p->name) - 1] = 0;
+	return 1;
+}
+
+static int prof_compare_symbols(const void *a, const void *b)
+{
+	unsigned int x = ((const prof_symbol_t *)a)->addr;
+	unsigned int y = ((const prof_symbol_t *)b)->addr;
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+// Linux System.map lines are "address type name".
+// DOS map lines are "segment:offset name" relative to the load segment.
+int profiler_load_symbols(const char *file_name, unsigned short load_segment)
+{
+	FILE *f;
+	char line[256], name[128];
+	char type;
+	unsigned int addr, seg, ofs;
+	int pos, n = 0;
+
+	f = fopen(file_name, "rt");
+	if (f == NULL)
+		return 0;
+
+	while (fgets(line, sizeof(line), f) != NULL)
+	{
+		if (sscanf(line, " %x:%x %127s", &seg, &ofs, name) == 3)
+		{
+			// Borland maps mark absolute symbols with "Abs"
+			if (strcmp(name, "Abs") == 0)
+				continue;
+			addr = (load_segment + seg) * 16u + ofs;
+		}
+		else if ((sscanf(line, " %x%n", &addr, &pos) == 1) && ((line[pos] == ' ') || (line[pos] == '\t')) &&
+			(sscanf(line + pos, " %c %127s", &type, name) == 2))
+		{
+			// Absolute symbols are not code addresses
+			if ((type == 'a') || (type == 'A'))
+				continue;
+		}
+		else
+			continue;
+
+		if (!prof_add_symbol(addr, name))
+			break;
+		n++;
+	}
+
+	fclose(f);
+
+	qsort(prof_symbols, prof_num_symbols, sizeof(prof_symbol_t), prof_compare_symbols);
+
+	return n;
+}
+
+static const prof_symbol_t *prof_find_symbol(unsigned int addr)
+{
+	int lo = 0, hi = prof_num_symbols - 1, mid;
+	const prof_symbol_t *res = NULL;
+
+	while (lo <= hi)
+	{
+		mid = (lo + hi) / 2;
+		if (prof_symbols[mid].addr <= addr)
+		{
+			res = &prof_symbols[mid];
+			lo = mid + 1;
+		}
+		else
+			hi = mid - 1;
+	}
+
+	return res;
+}
+
+static void prof_symbol_name(char *s, int size, unsigned int addr)
+{
+	const prof_symbol_t *sym = prof_find_symbol(addr);
+
+	if (sym == NULL)
+		_snprintf(s, size, "0x%.8X", addr);
+	else if (sym->addr == addr)
+		_snprintf(s, size, "%s", sym->name);
+	else
+		_snprintf(s, size, "%s+0x%X", sym->name, addr - sym->addr);
+	s[size - 1] = 0;
+}
+
+static int prof_compare_slots(const void *a, const void *b)
+{
+	unsigned int x = (*(const prof_slot_t **)a)->count;
+	unsigned int y = (*(const prof_slot_t **)b)->count;
+	return x > y ? -1 : (x < y ? 1 : 0);
+}
+
+// Flat report: one line per sampled address, most frequent first.
+// Collapsed report: "mode;cplN;symbol count" lines for flame graph tools.
+void profiler_dump(const char *flat_file_name, const char *collapsed_file_name)
+{
+	prof_slot_t **sorted;
+	const prof_symbol_t *sym;
+	FILE *f;
+	char name[128];
+	unsigned int i, n;
+
+	sorted = (prof_slot_t **)malloc(sizeof(prof_slot_t *) * (prof_used + 1));
+	if (sorted == NULL)
+		return;
+
+	for (i = 0, n = 0; (i < PROF_SLOTS) && (n < prof_used); i++)
+		if (prof_slots[i].count)
+			sorted[n++] = &prof_slots[i];
+
+	qsort(sorted, n, sizeof(prof_slot_t *), prof_compare_slots);
+
+	if ((flat_file_name != NULL) && (fopen_s(&f, flat_file_name, "wt") == 0))
+	{
+		fprintf(f, "samples: %u, interval: %d, addresses: %u, dropped: %u\n\n",
+			prof_samples, profiler_interval, n, prof_dropped);
+		fprintf(f, "   count       %%  mode     cpl  cs:eip          linear    symbol\n");
+		for (i = 0; i < n; i++)
+		{
+			prof_symbol_name(name, sizeof(name), sorted[i]->linear);
+			fprintf(f, "%8u  %6.2f  %-7s  %u    %.4X:%.8X  %.8X  %s\n",
+				sorted[i]->count, sorted[i]->count * 100.0 / (prof_samples ? prof_samples : 1),
+				prof_mode_names[sorted[i]->mode], sorted[i]->cpl,
+				sorted[i]->cs, sorted[i]->eip, sorted[i]->linear, name);
+		}
+		fclose(f);
+	}
+
+	if ((collapsed_file_name != NULL) && (fopen_s(&f, collapsed_file_name, "wt") == 0))
+	{
+		for (i = 0; i < n; i++)
+		{
+			sym = prof_find_symbol(sorted[i]->linear);
+			if (sym != NULL)
+				fprintf(f, "%s;cpl%u;%s %u\n", prof_mode_names[sorted[i]->mode], sorted[i]->cpl,
+					sym->name, sorted[i]->count);
+			else
+				fprintf(f, "%s;cpl%u;%.4X:%.8X %u\n", prof_mode_names[sorted[i]->mode], sorted[i]->cpl,
+					sorted[i]->cs, sorted[i]->eip & 0xFFFFFFF0u, sorted[i]->count);
+		}
+		fclose(f);
+	}
+
+	free(sorted);
+}
+
+void profiler_deinit()
+{
+	profiler_countdown = 0x7FFFFFFF;
+	free(prof_symbols);
+	prof_symbols = NULL;
+	prof_num_symbols = 0;
+	prof_max_symbols = 0;
+}
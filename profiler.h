@@ -0,0 +1,38 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#define PROF_MODE_REAL		0
+#define PROF_MODE_V86		1
+#define PROF_MODE_PMODE16	2
+#define PROF_MODE_PMODE32	3
+
+// Number of histogram slots, must be a power of 2
+#define PROF_SLOTS			65536
+
+typedef struct
+{
+	unsigned int linear;
+	unsigned int eip;
+	unsigned short cs;
+	unsigned char mode;
+	unsigned char cpl;
+	unsigned int count;
+} prof_slot_t;
+
+typedef struct
+{
+	unsigned int addr;
+	char name[60];
+} prof_symbol_t;
+
+extern int profiler_countdown;
+extern int profiler_dump_request;
+
+void profiler_init(int interval);
+void profiler_reset();
+void profiler_sample();
+int profiler_load_symbols(const char *file_name, unsigned short load_segment);
+void profiler_dump(const char *flat_file_name, const char *collapsed_file_name);
+void profiler_deinit();
+
+#endif
@@ -0,0 +1,169 @@
+#include "stdafx.h"
+#include "vga.h"
+#include "render.h"
+#if (FB_EXPORT)
+#include "fbexport.h"
+#endif
+#if (METRICS)
+#include "metrics.h"
+#endif
+
+// Frames are drawn outside of the CPU and window threads. At vertical retrace the CPU thread
+// takes a snapshot of the video state if the previous frame has been rendered. The render thread
+// draws it into scr, exports it and, once the window has painted the previous frame, copies scr
+// into the back buffer, which then becomes the front buffer painted by WM_PAINT. Buffers change
+// hands through the frame counters only.
+
+#include <atomic>
+#if (RENDER_THREAD)
+#include <condition_variable>
+#endif
+
+extern HWND hWnd;
+extern unsigned int scr[SCREEN_WIDTH * SCREEN_HEIGHT];
+
+static unsigned int frame_buffer[2][SCREEN_WIDTH * SCREEN_HEIGHT];
+static atomic<int> render_front(0);
+// Frames drawn / copied to the front buffer / painted by the window
+static unsigned int render_drawn = 0;
+static atomic<unsigned int> render_published(0);
+static atomic<unsigned int> render_presented(0);
+// A snapshot is waiting for the render thread
+static atomic<int> render_pending(0);
+
+#if (RENDER_THREAD)
+static thread *render_thread = NULL;
+static mutex render_mtx;
+static condition_variable render_wake;
+static bool render_stop = false;
+#endif
+
+static void render_frame()
+{
+	int back;
+#if (METRICS)
+	LARGE_INTEGER frame_start, frame_end, frame_freq;
+
+	QueryPerformanceCounter(&frame_start);
+#endif
+
+	vga_render();
+	render_drawn++;
+
+#if (FB_EXPORT)
+	// A minimized or hidden window paints nothing, the export does not wait for it
+	fb_export_frame(scr, render_drawn);
+#endif
+
+	// The window paints only the front buffer and no frame is published until it has
+	// painted the last one, so the back buffer is free. Otherwise the frame is dropped.
+	if (render_presented == render_published)
+	{
+		back = render_front ^ 1;
+		memcpy(frame_buffer[back], scr, sizeof(frame_buffer[back]));
+		render_front = back;
+		render_published++;
+		InvalidateRect(hWnd, NULL, false);
+	}
+
+#if (METRICS)
+	QueryPerformanceCounter(&frame_end);
+	QueryPerformanceFrequency(&frame_freq);
+	metrics_frame((unsigned int)((frame_end.QuadPart - frame_start.QuadPart) * 1000000 / frame_freq.QuadPart));
+#endif
+}
+
+#if (RENDER_THREAD)
+static void render_worker()
+{
+	for (;;)
+	{
+		{
+			unique_lock<mutex> lock(render_mtx);
+
+			while ((!render_stop) && (!render_pending))
+				render_wake.wait(lock);
+
+			if (render_stop)
+				return;
+		}
+
+		render_frame();
+
+		// Published before the snapshot is released, see render_vsync
+		render_pending = 0;
+	}
+}
+#endif
+
+void render_init()
+{
+#if (FB_EXPORT)
+	fb_export_init();
+#endif
+
+#if (RENDER_THREAD)
+	if (render_thread != NULL)
+		return;
+
+	render_stop = false;
+	render_thread = new thread(render_worker);
+#endif
+}
+
+void render_vsync()
+{
+	// The previous snapshot is still being drawn, emulation never waits
+	if (render_pending)
+		return;
+
+	vga_snapshot();
+
+#if (RENDER_THREAD)
+	if (render_thread != NULL)
+	{
+		{
+			lock_guard<mutex> lock(render_mtx);
+			render_pending = 1;
+		}
+		render_wake.notify_one();
+		return;
+	}
+#endif
+
+	render_frame();
+}
+
+const unsigned int *render_acquire(unsigned int *frame)
+{
+	// The counter is read first: a frame published meanwhile is painted again on its own WM_PAINT
+	*frame = render_published;
+	return frame_buffer[render_front];
+}
+
+void render_release(unsigned int frame)
+{
+	render_presented = frame;
+}
+
+void render_deinit()
+{
+#if (RENDER_THREAD)
+	if (render_thread != NULL)
+	{
+		{
+			lock_guard<mutex> lock(render_mtx);
+			render_stop = true;
+		}
+		render_wake.notify_one();
+
+		render_thread->join();
+		delete render_thread;
+		render_thread = NULL;
+	}
+#endif
+
+#if (FB_EXPORT)
+	fb_export_deinit();
+#endif
+}
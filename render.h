@@ -0,0 +1,12 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+void render_init();
+// Called by the CPU thread at vertical retrace
+void render_vsync();
+// Newest complete frame for the window, frame receives its number for render_release
+const unsigned int *render_acquire(unsigned int *frame);
+void render_release(unsigned int frame);
+void render_deinit();
+
+#endif
@@ -0,0 +1,133 @@
+// Reference viewer for the FB_EXPORT frame section. Attaches to a running emulator
+// and writes its next frames as BMP files, the emulator does not wait for it.
+//
+// cl /EHsc /I.. fbdump.cpp
+// fbdump [frames] [section name]
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include "fbexport.h"
+
+using namespace std;
+
+#define DEFAULT_NAME		"Local\\e86r_frame"
+// Give up when no frame comes for this long (ms)
+#define WAIT_TIMEOUT_MS		5000
+
+static void put16(unsigned char *p, unsigned int v)
+{
+	p[0] = (unsigned char)v;
+	p[1] = (unsigned char)(v >> 8);
+}
+
+static void put32(unsigned char *p, unsigned int v)
+{
+	put16(p, v);
+	put16(p + 2, v >> 16);
+}
+
+// 32 bpp bottom-up BMP, the exported rows are already in this order
+static int write_bmp(const char *file_name, const unsigned int *pixels, unsigned int width, unsigned int height)
+{
+	unsigned char h[54];
+	unsigned int size = width * height * 4;
+	FILE *f;
+
+	memset(h, 0, sizeof(h));
+	h[0] = 'B';
+	h[1] = 'M';
+	put32(&h[2], sizeof(h) + size);
+	put32(&h[10], sizeof(h));
+	put32(&h[14], 40);
+	put32(&h[18], width);
+	put32(&h[22], height);
+	put16(&h[26], 1);
+	put16(&h[28], 32);
+	put32(&h[34], size);
+
+	if (fopen_s(&f, file_name, "wb") != 0)
+		return 0;
+	fwrite(h, 1, sizeof(h), f);
+	fwrite(pixels, 1, size, f);
+	fclose(f);
+	return 1;
+}
+
+// Copies a complete frame newer than *sequence, returns 0 on timeout
+static int read_frame(fb_export_t *fb, fb_export_t *info, unsigned int *pixels, unsigned int *sequence)
+{
+	unsigned int s1, s2, start = GetTickCount();
+
+	for (;;)
+	{
+		// Keeps the emulator exporting
+		fb->viewer_tick = GetTickCount();
+
+		s1 = fb->sequence;
+		atomic_thread_fence(memory_order_acquire);
+		if (!(s1 & 1) && (s1 != *sequence))
+		{
+			*info = *fb;
+			memcpy(pixels, FB_EXPORT_PIXELS(fb), info->width * info->height * sizeof(unsigned int));
+			atomic_thread_fence(memory_order_acquire);
+			s2 = fb->sequence;
+			if (s1 == s2)
+			{
+				*sequence = s1;
+				return 1;
+			}
+		}
+
+		if (GetTickCount() - start > WAIT_TIMEOUT_MS)
+			return 0;
+		Sleep(5);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	const char *name = (argc > 2) ? argv[2] : DEFAULT_NAME;
+	int frames = (argc > 1) ? atoi(argv[1]) : 1;
+	HANDLE mapping;
+	fb_export_t *fb, info;
+	unsigned int *pixels, sequence = 0;
+	char file_name[64];
+	int i;
+
+	mapping = OpenFileMappingA(FILE_MAP_WRITE, FALSE, name);
+	if (mapping == NULL)
+	{
+		printf("Cannot open \"%s\", is the emulator running with FB_EXPORT 1?\n", name);
+		return 1;
+	}
+	fb = (fb_export_t *)MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, 0);
+	if ((fb == NULL) || (fb->magic != FB_EXPORT_MAGIC) || (fb->version != FB_EXPORT_VERSION))
+	{
+		printf("\"%s\" is not a frame section\n", name);
+		return 1;
+	}
+
+	// Only frames completed after attaching
+	sequence = fb->sequence;
+	pixels = (unsigned int *)malloc(fb->width * fb->height * sizeof(unsigned int));
+	for (i = 0; i < frames; i++)
+	{
+		if (!read_frame(fb, &info, pixels, &sequence))
+		{
+			printf("No frames\n");
+			break;
+		}
+		sprintf_s(file_name, sizeof(file_name), "frame%05u.bmp", info.frame);
+		write_bmp(file_name, pixels, info.width, info.height);
+		printf("%s: mode %Xh %ux%u %u bpp\n", file_name, info.mode, info.mode_width, info.mode_height, info.mode_bpp);
+	}
+
+	free(pixels);
+	UnmapViewOfFile(fb);
+	CloseHandle(mapping);
+	return 0;
+}
@@ -0,0 +1,135 @@
+#include "stdafx.h"
+#include "config.h"
+#include "vclock.h"
+
+typedef struct
+{
+	unsigned __int64 due;
+	vclock_handler_t handler;
+} vclock_event_t;
+
+unsigned __int64 vclock_cycles = 0;
+unsigned __int64 vclock_next = VCLOCK_NEVER;
+
+static vclock_event_t events[VCLOCK_NUM_EVENTS] = {
+	{VCLOCK_NEVER, NULL}, {VCLOCK_NEVER, NULL}, {VCLOCK_NEVER, NULL}, {VCLOCK_NEVER, NULL},
+	{VCLOCK_NEVER, NULL}, {VCLOCK_NEVER, NULL}
+};
+
+#if (CPU_CYCLE_WEIGHTS)
+// Approximate 486 clocks by the first opcode byte. Prefixes are counted with the instruction,
+// REP string instructions as a single iteration.
+const unsigned char vclock_weights[256] =
+{
+	 1,  1,  1,  1,  1,  1,  3,  3,  1,  1,  1,  1,  1,  1,  3,  3,
+	 1,  1,  1,  1,  1,  1,  3,  3,  1,  1,  1,  1,  1,  1,  3,  3,
+	 1,  1,  1,  1,  1,  1,  1,  3,  1,  1,  1,  1,  1,  1,  1,  3,
+	 1,  1,  1,  1,  1,  1,  1,  3,  1,  1,  1,  1,  1,  1,  1,  3,
+	 1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,
+	 1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,
+	11,  9,  7,  9,  1,  1,  1,  1,  1, 13,  1, 13, 17, 17, 17, 17,
+	 2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,
+	 1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  3,  1,  3,  1,
+	 1,  1,  1,  1,  1,  1,  1,  1,  1,  1, 18,  3,  4,  9,  1,  1,
+	 1,  1,  1,  1,  5,  5,  5,  5,  1,  1,  5,  5,  5,  5,  5,  5,
+	 1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,
+	 1,  1,  5,  5,  6,  6,  1,  1, 14,  5, 13, 13, 26, 30,  3, 15,
+	 3,  3,  3,  3, 15, 14,  1,  4,  8,  8,  8,  8,  8,  8,  8,  8,
+	 7,  7,  7,  5, 14, 14, 14, 14,  3,  3, 17,  3, 14, 14, 14, 14,
+	 1,  1,  1,  1,  4,  1, 15, 15,  1,  1,  5,  5,  1,  1,  1,  3
+};
+#endif
+
+#if (VCLOCK_REALTIME)
+static LARGE_INTEGER sync_freq = {0};
+static LARGE_INTEGER sync_start;
+// Virtual time at sync_start
+static unsigned __int64 sync_virtual;
+#endif
+
+static void vclock_update_next()
+{
+	int i;
+
+	vclock_next = VCLOCK_NEVER;
+	for (i = 0; i < VCLOCK_NUM_EVENTS; i++)
+		if (events[i].due < vclock_next)
+			vclock_next = events[i].due;
+}
+
+unsigned __int64 vclock_now()
+{
+	return vclock_cycles * 1000 / CPU_MHZ;
+}
+
+void vclock_schedule(int event, unsigned __int64 ns, vclock_handler_t handler)
+{
+	// First cycle at which vclock_now() >= ns
+	events[event].due = (ns * CPU_MHZ + 999) / 1000;
+	events[event].handler = handler;
+	vclock_update_next();
+}
+
+void vclock_cancel(int event)
+{
+	events[event].due = VCLOCK_NEVER;
+	vclock_update_next();
+}
+
+void vclock_run_events()
+{
+	vclock_handler_t handler;
+	int i;
+
+	// A handler may schedule the next event of its slot, even one that is already due
+	while (vclock_cycles >= vclock_next)
+	{
+		for (i = 0; i < VCLOCK_NUM_EVENTS; i++)
+		{
+			if (events[i].due > vclock_cycles)
+				continue;
+			handler = events[i].handler;
+			events[i].due = VCLOCK_NEVER;
+			handler();
+		}
+		vclock_update_next();
+	}
+}
+
+void vclock_sync()
+{
+#if (VCLOCK_REALTIME)
+	LARGE_INTEGER t;
+	unsigned __int64 d, host, guest;
+
+	QueryPerformanceCounter(&t);
+	if (sync_freq.QuadPart == 0)
+	{
+		QueryPerformanceFrequency(&sync_freq);
+		sync_start = t;
+		sync_virtual = vclock_now();
+		return;
+	}
+
+	d = t.QuadPart - sync_start.QuadPart;
+	host = d / sync_freq.QuadPart * 1000000000 + d % sync_freq.QuadPart * 1000000000 / sync_freq.QuadPart;
+	guest = vclock_now() - sync_virtual;
+
+	if (guest >= host)
+	{
+		// Faster than CPU_MHZ
+		if (guest - host >= VCLOCK_SLEEP_NS)
+			Sleep((DWORD)((guest - host) / 1000000));
+	}
+	else if (host - guest > VCLOCK_MAX_LAG_NS)
+	{
+		sync_start = t;
+		sync_virtual = vclock_now();
+	}
+	else
+	{
+		// Slower than CPU_MHZ, the clock jumps forward to the host time
+		vclock_cycles += (host - guest) * CPU_MHZ / 1000;
+	}
+#endif
+}
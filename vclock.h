@@ -0,0 +1,64 @@
+#ifndef VCLOCK_H
+#define VCLOCK_H
+
+// Virtual time of the emulated machine. step() adds the clock cycles of every instruction, time in ns
+// is derived from them and CPU_MHZ. RDTSC, the timers and the devices all read this clock, events are
+// scheduled on it instead of counting loop iterations.
+
+// Event slots, one pending event each
+#define VCLOCK_EVENT_PIT		0
+#define VCLOCK_EVENT_RETRACE	1
+#define VCLOCK_EVENT_IDE		2
+#define VCLOCK_EVENT_RTC		3
+#define VCLOCK_EVENT_KEYB		4
+#define VCLOCK_EVENT_MOUSE		5
+#define VCLOCK_NUM_EVENTS		6
+
+#define VCLOCK_NEVER			0xFFFFFFFFFFFFFFFFull
+
+// Real-time mode: sleep when ahead of the host clock by this much
+#define VCLOCK_SLEEP_NS			2000000
+// Real-time mode: a longer lag (debugger, suspended host) is dropped instead of caught up
+#define VCLOCK_MAX_LAG_NS		250000000
+
+typedef void (*vclock_handler_t)();
+
+extern unsigned __int64 vclock_cycles;
+// Cycle count of the earliest scheduled event
+extern unsigned __int64 vclock_next;
+
+#if (CPU_CYCLE_WEIGHTS)
+extern const unsigned char vclock_weights[256];
+#endif
+
+void vclock_run_events();
+
+static inline void vclock_poll()
+{
+	if (vclock_cycles >= vclock_next)
+		vclock_run_events();
+}
+
+// Halted CPU
+static inline void vclock_idle()
+{
+#if (VCLOCK_REALTIME)
+	vclock_cycles++;
+#else
+	// Nothing happens until the next event
+	if ((vclock_next != VCLOCK_NEVER) && (vclock_next > vclock_cycles))
+		vclock_cycles = vclock_next;
+	else
+		vclock_cycles++;
+#endif
+}
+
+// Current virtual time, ns
+unsigned __int64 vclock_now();
+// Calls handler when the virtual time reaches ns, replaces the event pending in the slot
+void vclock_schedule(int event, unsigned __int64 ns, vclock_handler_t handler);
+void vclock_cancel(int event);
+// Called by the CPU loop now and then, keeps the virtual time in step with the host in real-time mode
+void vclock_sync();
+
+#endif
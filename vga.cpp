@@ -2,6 +2,8 @@
 #include "cpu.h"
 #include "vga.h"
 #include "ioports.h"
+#include "memdescr.h"
+#include "vclock.h"
 
 #define VMODE_BW40x25		0x00
 #define VMODE_COL40x25		0x01
@@ -18,6 +20,13 @@
 #define VMODE_VGA320x200	0x13
 #define VMODE_VGA640x480x8	0x14
 
+// CRT timing: 31.5 kHz lines, 70 Hz frames or 60 Hz in 480-line modes
+#define VGA_LINE_NS			31778
+#define VGA_HDISPLAY_NS		25422
+#define VGA_LINES_70HZ		449
+#define VGA_LINES_60HZ		525
+#define VGA_RETRACE_LINES	2
+
 #ifndef COLORREF
 #define COLORREF	unsigned int
 #endif
@@ -38,10 +47,6 @@
 #define RGB(r,g,b)          ((COLORREF)(((BYTE)(r)|((WORD)((BYTE)(g))<<8))|(((DWORD)(BYTE)(b))<<16)))
 #endif
 
-#if (STM32)
-extern "C" unsigned long GetTickCount(void);
-#endif
-
 typedef union
 {
 	unsigned char b[4];
@@ -50,14 +55,12 @@ typedef union
 } reg_t;
 
 int vmode = 3;
-int vga_lines = 400;
 
 unsigned char crt_regs[32] = {0};
 unsigned char cga_color_cr = 0;
 unsigned char vga_palette[1024] = {0};
 unsigned int ega_palette[16] = {0};
 int vga_pan = 0;
-int vga_3da = 0;
 int vga_pal_mask = 0xFF;
 int vga_pal_index = 0;
 int vga_pal_read_index = 0;
@@ -90,6 +93,56 @@ unsigned char vga_color_dontcare = 0;
 
 int svga_page = 0;
 
+unsigned short vbe_regs[VBE_DISPI_NUM_REGS] = {VBE_DISPI_ID5, 640, 480, 8, 0, 0, 640, 0, 0, 0, VBE_LFB_SIZE >> 16};
+int vbe_index = 0;
+// Mode number of the last INT 10h AX = 4F02h
+int vbe_current_mode = 3;
+unsigned int vbe_dirty[VBE_DIRTY_PAGES];
+
+// DAC registers are 6 bits wide unless VBE_DISPI_8BIT_DAC is set
+int vga_dac_shift = 2;
+
+unsigned int vga_dirty[VGA_DIRTY_PAGES];
+unsigned int vga_frame = 0;
+// Register or palette change, everything is redrawn
+static int vga_redraw = 1;
+// Memory written behind the dirty tracking, all pages are copied again
+static int vga_recopy = 1;
+static int vga_frame_redraw = 1;
+
+// Planar modes address up to 64K dwords
+#define VGA_SNAPSHOT_PLANAR_PAGES	(0x10000 >> VGA_DIRTY_SHIFT)
+
+// Video state seen by the renderers, copied from the live state by vga_snapshot
+typedef struct
+{
+	unsigned int frame;
+	// Virtual time, ns
+	unsigned __int64 time;
+	int redraw;
+	int vmode;
+	unsigned char crt_regs[32];
+	unsigned char ac_regs[32];
+	unsigned char sq_regs[16];
+	unsigned char cga_color_cr;
+	unsigned char cursor_x;
+	unsigned char cursor_y;
+	unsigned char rom_font[256 * 8];
+	// 0xA0000 - 0xBFFFF
+	unsigned char mem[0x20000];
+	// Same size as the live vram, renderers may read past the copied part with large offsets
+	unsigned int vram[1024 * 1024];
+	// Snapshot number of the last change of every dirty page
+	unsigned int page_frame[VGA_DIRTY_PAGES];
+	unsigned short vbe_regs[VBE_DISPI_NUM_REGS];
+	int vbe_mode;
+	unsigned int vbe_page_frame[VBE_DIRTY_PAGES];
+} vga_state_t;
+
+static vga_state_t vs;
+
+#define VBE_LFB_SNAPSHOT	((unsigned char *)vs.vram)
+
 extern unsigned char *scr;
 
 const unsigned int bit_fill[16] = 
@@ -415,13 +468,6 @@ const unsigned long pal16_ega[16] = {
 	RGB(255, 0, 0), RGB(255, 0, 255), RGB(255, 255, 0), RGB(255, 255, 255),
 };
 
-const unsigned long pal16_pcjr[16] = {
-	BGR(0, 0, 0), BGR(0, 0, 128), BGR(0, 128, 0), BGR(0, 128, 128),
-	BGR(128, 0, 0), BGR(128, 0, 128), BGR(128, 128, 0), BGR(192, 192, 192),
-	BGR(128, 128, 128), BGR(0, 0, 255), BGR(0, 255, 0), BGR(0, 255, 255),
-	BGR(255, 0, 0), BGR(255, 0, 255), BGR(255, 255, 0), BGR(255, 255, 255),
-};
-
 const unsigned long palcga[5][4] = {
 	{0, 10, 12, 14},
 	{0, 11, 13, 15},
@@ -437,169 +483,202 @@ const unsigned long palcga[5][4] = {
 */
 };
 
-void CGADrawChar8x8(int x, int y, int ch, int attr)
-{
-	int i, j;
-	const unsigned char *f = &ram[0xFFA6E + ch * 8];
-	unsigned char b, m;
-	unsigned long fg, bg;
-
-	fg = attr & 0x0F; //pal16[attr & 0x0F];
-	bg = (attr >> 4) & 0x0F; //pal16[(attr >> 4) & 0x0F];
-	for (i = 0; i < 8; i++)
-	{
-		for (j = 0, m = 0x80; j < 8; j++)
-		{
-			b = *f;
-			set_pixel_2x2(x + j, y + i, b & m ? fg : bg);
-			m >>= 1;
-		}
-		f++;
-	}
-}
-
 void CGADrawChar8x16r(int x, int y, int ch, int attr)
 {
 	int i, j;
 	const unsigned char *f = &asciivga[ch * 16];
-	unsigned char b, m;
-	unsigned long fg, bg;
+	unsigned char b, m, *d;
+	unsigned char fg, bg;
 
 	fg = attr & 0x0F; //pal16[attr & 0x0F];
 	bg = (attr >> 4) & 0x0F; //pal16[(attr >> 4) & 0x0F];
 	for (i = 0; i < 16; i++)
 	{
+		d = native_line(y + i) + x;
 		for (j = 0, m = 0x01; j < 8; j++)
 		{
 			b = *f;
-			set_pixel(x + j, y + i, b & m ? fg : bg);
+			d[j] = b & m ? fg : bg;
 			m <<= 1;
 		}
 		f++;
 	}
 }
 
-void CGADrawChar8x16(int x, int y, int ch, int attr)
+// Plane byte to 8 pixels, bit 7 (the leftmost pixel) goes to the lowest byte
+static unsigned __int64 planar_expand[256];
+
+static void init_planar_expand()
 {
-	int i, j;
-	const unsigned char *f = &asciivga[ch * 16];
-	unsigned char b, m;
-	unsigned long fg, bg;
+	unsigned int i, k;
 
-	fg = attr & 0x0F; //pal16[attr & 0x0F];
-	bg = (attr >> 4) & 0x0F; //pal16[(attr >> 4) & 0x0F];
-	for (i = 0; i < 16; i++)
+	for (i = 0; i < 256; i++)
 	{
-		for (j = 0, m = 0x80; j < 8; j++)
-		{
-			b = *f;
-			set_pixel(x + j, y + i, b & m ? fg : bg);
-			m >>= 1;
-		}
-		f++;
+		planar_expand[i] = 0;
+		for (k = 0; k < 8; k++)
+			if (i & (0x80 >> k))
+				planar_expand[i] |= (unsigned __int64)1 << (k * 8);
 	}
 }
 
+// 4 plane bytes of a dword to 8 palette indices, sN is the color bit of plane N
+static inline unsigned __int64 planar_to_chunky(unsigned int d, int s0, int s1, int s2, int s3)
+{
+	return (planar_expand[d & 0xFF] << s0) | (planar_expand[(d >> 8) & 0xFF] << s1) |
+		(planar_expand[(d >> 16) & 0xFF] << s2) | (planar_expand[d >> 24] << s3);
+}
+
+// Returns 1 if the scanline has to be rendered: video memory at offset (from 0xA0000) was written
+// since the previous snapshot or the whole screen must be redrawn
+static int vga_dirty_range(unsigned int offset, unsigned int size)
+{
+	unsigned int i, last;
+
+	if (vga_frame_redraw)
+		return 1;
+
+	last = (offset + size - 1) >> VGA_DIRTY_SHIFT;
+	for (i = offset >> VGA_DIRTY_SHIFT; i <= last; i++)
+		if (vs.page_frame[i & (VGA_DIRTY_PAGES - 1)] == vs.frame)
+			return 1;
+
+	return 0;
+}
+
 void update_screen_text40_color()
 {
-	int i, j, k;
-	const unsigned char *p = &ram[0xb8000];
-	int cx = ram[0x450];
-	int cy = ram[0x451];
-	int blink = GetTickCount() % 1000 < 500;
+	int i, j;
+	const unsigned char *p = &vs.mem[0x18000];
+	int cx = vs.cursor_x;
+	int cy = vs.cursor_y;
+	int blink = vs.time / 1000000 % 1000 < 500;
+	static int last_cx = -1, last_cy = -1, last_blink = -1;
+	int cursor_changed = (cx != last_cx) || (cy != last_cy) || (blink != last_blink);
+	static unsigned char rom_font[256 * 8];
+
+	// The ROM font is in RAM and can be changed, cached glyphs are then stale
+	if (memcmp(rom_font, vs.rom_font, sizeof(rom_font)))
+	{
+		memcpy(rom_font, vs.rom_font, sizeof(rom_font));
+		glyph_cache_flush();
+		vga_frame_redraw = 1;
+	}
+
 	for (i = 0; i < 25; i++)
 	{
+		if (!vga_dirty_range(0x18000 + i * 80, 80) && !(cursor_changed && ((i == cy) || (i == last_cy))))
+		{
+			p += 80;
+			continue;
+		}
 		for (j = 0; j < 40; j++)
 		{
-			CGADrawChar8x8(j * 8, i * 8, p[0], p[1]);
-			if ((i == cy) && (j == cx))
-				if (blink)
-					for (k = 0; k < 8; k++)
-						set_pixel(k + j * 8, i * 8 + 7, pal16[p[1] & 0x0F]);
+			set_glyph(j * 8, i * 8, GLYPH_FONT_8X8, rom_font, p[0], p[1], blink && (i == cy) && (j == cx));
 			p += 2;
 		}
 	}
+
+	last_cx = cx;
+	last_cy = cy;
+	last_blink = blink;
 }
 
 void update_screen_text80_color()
 {
-	int i, j, k;
-	const unsigned char *p = &ram[0xb8000];
-	int cur = crt_regs[0x0E] * 256 + crt_regs[0x0F];
-	int blink = GetTickCount() % 1000 < 500;
-	p += (crt_regs[12] * 256 + crt_regs[13]) * 2;
-	cur -= crt_regs[12] * 256 + crt_regs[13];
+	int i, j;
+	const unsigned char *p = &vs.mem[0x18000];
+	int cur = vs.crt_regs[0x0E] * 256 + vs.crt_regs[0x0F];
+	int blink = vs.time / 1000000 % 1000 < 500;
+	int start = (vs.crt_regs[12] * 256 + vs.crt_regs[13]) * 2;
+	static int last_cur = -1, last_cy = -1, last_blink = -1;
+	int cursor_changed = (cur != last_cur) || (blink != last_blink);
+	p += start;
+	cur -= vs.crt_regs[12] * 256 + vs.crt_regs[13];
 
 	int cx = cur % 80;
 	int cy = cur / 80;
 	for (i = 0; i < 25; i++)
 	{
+		if (!vga_dirty_range(0x18000 + start + i * 160, 160) && !(cursor_changed && ((i == cy) || (i == last_cy))))
+		{
+			p += 160;
+			continue;
+		}
 		for (j = 0; j < 80; j++)
 		{
-			CGADrawChar8x16(j * 8, i * 16, p[0], p[1]);
-			if ((i == cy) && (j == cx))
-				if (blink)
-					for (k = 0; k < 8; k++)
-						set_pixel(k + j * 8, i * 16 + 15, p[1] & 0x0F);//pal16[p[1] & 0x0F]);
+			set_glyph(j * 8, i * 16, GLYPH_FONT_8X16, asciivga, p[0], p[1], blink && (i == cy) && (j == cx));
 			p += 2;
 		}
 	}
+
+	last_cur = vs.crt_regs[0x0E] * 256 + vs.crt_regs[0x0F];
+	last_cy = cy;
+	last_blink = blink;
 }
 
 void update_screen_col320x200()
 {
 	int i, j, k;
 	const unsigned char *p;
-	unsigned char b;
-	unsigned long c;
+	unsigned char b, *d;
 	int cgapalindex;
 
 	cgapalindex = 2;
-	if (cga_color_cr & 4)
+	if (vs.cga_color_cr & 4)
 	{
 		cgapalindex = 4;
 	} else
 	{
-		if (cga_color_cr & 0x20)
+		if (vs.cga_color_cr & 0x20)
 		{
-			if (cga_color_cr & 0x10)
+			if (vs.cga_color_cr & 0x10)
 				cgapalindex = 3;
 			else
 				cgapalindex = 1;
 		} else
 		{
-			if (cga_color_cr & 0x10)
+			if (vs.cga_color_cr & 0x10)
 				cgapalindex = 2;
 			else
 				cgapalindex = 0;
 		}
 	}
 
-	p = &ram[0xb8000];
+	p = &vs.mem[0x18000];
 	for (i = 0; i < 200; i += 2)
 	{
+		if (!vga_dirty_range(p - vs.mem, 80))
+		{
+			p += 80;
+			continue;
+		}
+		d = native_line(i);
 		for (j = 0; j < 320; j += 4)
 		{
 			b = *p++;
 			for (k = 0; k < 4; k++)
 			{
-				c = palcga[cgapalindex][(b >> 6) & 3];
+				d[k + j] = (unsigned char)palcga[cgapalindex][(b >> 6) & 3];
 				b <<= 2;
-				set_pixel_2x2(k + j, i, c);
 			}
 		}
 	}
-	p = &ram[0xbA000];
+	p = &vs.mem[0x1A000];
 	for (i = 1; i < 200; i += 2)
 	{
+		if (!vga_dirty_range(p - vs.mem, 80))
+		{
+			p += 80;
+			continue;
+		}
+		d = native_line(i);
 		for (j = 0; j < 320; j += 4)
 		{
 			b = *p++;
 			for (k = 0; k < 4; k++)
 			{
-				c = palcga[cgapalindex][(b >> 6) & 3];
+				d[k + j] = (unsigned char)palcga[cgapalindex][(b >> 6) & 3];
 				b <<= 2;
-				set_pixel_2x2(k + j, i, c);
 			}
 		}
 	}
@@ -609,23 +688,24 @@ void update_screen_ega320x200()
 {
 	int i, j, k, l;
 	const unsigned char *p;
-	unsigned char b;
-	unsigned long c;
+	unsigned char b, *d;
 
 	for (l = 0; l < 4; l++)
 	{
-		p = &ram[0xB8000 + l * 8192];
+		p = &vs.mem[0x18000 + l * 8192];
 		for (i = l; i < 200; i += 4)
 		{
+			if (!vga_dirty_range(p - vs.mem, 160))
+			{
+				p += 160;
+				continue;
+			}
+			d = native_line(i);
 			for (j = 0; j < 320; j += 2)
 			{
 				b = *p++;
-				for (k = 0; k < 2; k++)
-				{
-					c = pal16_pcjr[(b >> 4) & 15];
-					b <<= 4;
-					set_pixel_2x2(k + j, i, c);
-				}
+				d[j] = b >> 4;
+				d[j + 1] = b & 15;
 			}
 		}
 	}
@@ -633,112 +713,94 @@ void update_screen_ega320x200()
 
 void update_screen_vga320x200()
 {
-	int i, j;
+	int i;
 	const unsigned char *p;
-	const unsigned long *pal = (const unsigned long *)vga_palette;
 
-	p = &ram[0xA0000];
+	p = vs.mem;
 	for (i = 0; i < 200; i++)
 	{
-		for (j = 0; j < 320; j++)
-		{
-			set_pixel_2x2(j, i, *p++);//pal[*p++]);
-		}
+		if (vga_dirty_range(i * 320, 320))
+			memcpy(native_line(i), p, 320);
+		p += 320;
 	}
 }
 
 void update_screen_vga640x480x8()
 {
-	int i, j;
+	int i;
 	const unsigned char *p;
-	const unsigned long *pal = (const unsigned long *)vga_palette;
 
 	vga_pan = 0;
-	p = (unsigned char *)vram;
+	p = (unsigned char *)vs.vram;
 	for (i = 0; i < 480; i++)
 	{
-		for (j = 0; j < 640; j++)
-		{
-			set_pixel(j, i, *p++);//pal[*p++]);
-		}
-		p += vga_pan;
+		if (vga_dirty_range(p - (unsigned char *)vs.vram, 640))
+			memcpy(native_line(i), p, 640);
+		p += 640 + vga_pan;
 	}
 }
 
+// Vertical display end of the unchained 256 color modes
+static int vga_modex_lines()
+{
+	int lines;
+
+	lines = vs.crt_regs[0x12] + ((vs.crt_regs[7] >> 1) & 0x01) * 256 + ((vs.crt_regs[7] >> 6) & 0x01) * 512;
+	if (vs.crt_regs[0x10] & 4)
+		lines /= 2;
+	return lines;
+}
+
 void update_screen_vga320x200x()
 {
 	int i, j;
 	const unsigned int *p;
-	const unsigned long *pal = (const unsigned long *)vga_palette;
-	unsigned char b;
-	unsigned long c;
-	unsigned int d;
+	unsigned int line[80];
 	int lines = 200;
-	int pixel_shift;
-	p = &vram[(crt_regs[12] * 256 + crt_regs[13]) / 1];
-	pixel_shift = 0;
+	p = &vs.vram[(vs.crt_regs[12] * 256 + vs.crt_regs[13]) / 1];
 
 	// TODO: find out how to do it right
-	if (crt_regs[0x13] > 40)
-		vga_pan = (crt_regs[0x13] - (crt_regs[1] + 1) / 2) * 2;
+	if (vs.crt_regs[0x13] > 40)
+		vga_pan = (vs.crt_regs[0x13] - (vs.crt_regs[1] + 1) / 2) * 2;
 	else
 		vga_pan = 0;
 
 	// HPAN
-	p += ac_regs[0x13] & 0x0F;
+	p += vs.ac_regs[0x13] & 0x0F;
 
-	lines = crt_regs[0x12] + ((crt_regs[7] >> 1) & 0x01) * 256 + ((crt_regs[7] >> 6) & 0x01) * 512;
-
-	if (crt_regs[0x10] & 4)
-		lines /= 2;
-
-	if (lines > 240)
-	{
-		for (i = 0; i < lines; i++)
-		{
-			for (j = 0; j < 320; j++)
-			{
-				if ((j & 3) == 0)
-					d = *p++;
-				else
-					d >>= 8;
-				b = d;
-				c = pal[b];
-				if (j - pixel_shift >= 0)
-					set_pixel_2x1(j - pixel_shift, i, c);
-			}
-			p += vga_pan;
-		}
-		return;
-	}
+	lines = vga_modex_lines();
 
 #if (STM32)
 	unsigned short *fb = (unsigned short *)scr;
 	unsigned short cp;
 #endif
-	
+
 	for (i = 0; i < lines; i++)
 	{
-		for (j = 0; j < 320; j++)
+		if (!vga_dirty_range(p - vs.vram, 80))
 		{
-			if ((j & 3) == 0)
-				d = *p++;
-			else
-				d >>= 8;
-			b = d;
-			c = b;//pal[b];
+			p += 80 + vga_pan;
 #if (STM32)
-			cp = b + (b << 8);
-			*fb = cp;
-			fb[320] = cp;
-			fb++;
-#else
-			set_pixel_2x2(j, i, c);
+			fb += 640;
 #endif
+			continue;
 		}
+
+		// Every dword holds 4 consecutive pixels, one per plane
+		for (j = 0; j < 80; j++)
+			line[j] = *p++;
 		p += vga_pan;
+
 #if (STM32)
-		fb += 320;
+		for (j = 0; j < 320; j++)
+		{
+			cp = ((unsigned char *)line)[j] * 0x0101;
+			fb[j] = cp;
+			fb[j + 320] = cp;
+		}
+		fb += 640;
+#else
+		memcpy(native_line(i), line, 320);
 #endif
 	}
 }
@@ -747,38 +809,47 @@ void update_screen_bw640x200()
 {
 	int i, j, k;
 	const unsigned char *p;
-	unsigned char b;
-	unsigned long c;
-	p = &ram[0xb8000];
+	unsigned char b, *d;
+	p = &vs.mem[0x18000];
 	for (i = 0; i < 200; i += 2)
 	{
-		for (j = 0; j < 640; j += 8)
+		if (vga_dirty_range(p - vs.mem, 80))
 		{
-			b = *p++;
-			for (k = 0; k < 8; k++)
+			d = native_line(i);
+			for (j = 0; j < 640; j += 8)
 			{
-				c = b & 0x80 ? 15 : 0;
-				b <<= 1;
-				set_pixel_1x2(k + j, i, c);
+				b = *p++;
+				for (k = 0; k < 8; k++)
+				{
+					d[k + j] = b & 0x80 ? 15 : 0;
+					b <<= 1;
+				}
 			}
 		}
-		if (p >= &ram[0xba000])
+		else
+			p += 80;
+		if (p >= &vs.mem[0x1A000])
 			p -= 8192;
 	}
-	p = &ram[0xbA000];
+	p = &vs.mem[0x1A000];
 	for (i = 1; i < 200; i += 2)
 	{
-		for (j = 0; j < 640; j += 8)
+		if (vga_dirty_range(p - vs.mem, 80))
 		{
-			b = *p++;
-			for (k = 0; k < 8; k++)
+			d = native_line(i);
+			for (j = 0; j < 640; j += 8)
 			{
-				c = b & 0x80 ? 15 : 0;
-				b <<= 1;
-				set_pixel_1x2(k + j, i, c);
+				b = *p++;
+				for (k = 0; k < 8; k++)
+				{
+					d[k + j] = b & 0x80 ? 15 : 0;
+					b <<= 1;
+				}
 			}
 		}
-		if (p >= &ram[0xbc000])
+		else
+			p += 80;
+		if (p >= &vs.mem[0x1C000])
 			p -= 8192;
 	}
 }
@@ -787,19 +858,23 @@ void update_screen_bw640x480()
 {
 	int i, j, k;
 	const unsigned char *p;
-	unsigned char b;
-	unsigned long c;
-	p = &ram[0xA0000];
+	unsigned char b, *d;
+	p = vs.mem;
 	for (i = 0; i < 480; i++)
 	{
+		if (!vga_dirty_range(i * 80, 80))
+		{
+			p += 80;
+			continue;
+		}
+		d = native_line(i);
 		for (j = 0; j < 640; j += 8)
 		{
 			b = *p++;
 			for (k = 0; k < 8; k++)
 			{
-				c = b & 0x80 ? 15 : 0;
+				d[k + j] = b & 0x80 ? 15 : 0;
 				b <<= 1;
-				set_pixel(k + j, i, c);
 			}
 		}
 	}
@@ -807,104 +882,270 @@ void update_screen_bw640x480()
 
 void update_screen_ega320x200d()
 {
-	int i, j, k;
+	int i, j;
 	const unsigned int *p;
-	unsigned char c;
-	unsigned int b;
+	unsigned __int64 *line;
 
-	p = &vram[(crt_regs[12] * 256 + crt_regs[13]) / 1];
-	if (crt_regs[0x13] > 40)
-		vga_pan = (crt_regs[0x13] - 40) * 4 - 2;
+	p = &vs.vram[(vs.crt_regs[12] * 256 + vs.crt_regs[13]) / 1];
+	if (vs.crt_regs[0x13] > 40)
+		vga_pan = (vs.crt_regs[0x13] - 40) * 4 - 2;
 	else
 		vga_pan = 0;
 	for (i = 0; i < 200; i++)
 	{
-		for (j = 0; j < 320; j += 8)
+		if (!vga_dirty_range(p - vs.vram, 40))
 		{
-			b = *p++;
-			for (k = 0; k < 8; k++)
-			{
-				c = 0;
-				c = (b & 0x80) ? 4 : 0;
-				c |= (b & 0x8000) ? 2 : 0;
-				c |= (b & 0x800000) ? 1 : 0;
-				c |= (b & 0x80000000ul) ? 8 : 0;
-				b <<= 1;
-
-				set_pixel_2x2(j + k, i, c);
-			}
+			p += 40 + vga_pan;
+			continue;
 		}
+		line = (unsigned __int64 *)native_line(i);
+		for (j = 0; j < 40; j++)
+			line[j] = planar_to_chunky(*p++, 2, 1, 0, 3);
 		p += vga_pan;
 	}
 }
 
 void update_screen_ega640x350()
 {
-	int i, j, k;
+	int i, j;
 	const unsigned int *p;
-	unsigned char c;
-	unsigned long b;
-	p = vram;
-	if (crt_regs[0x13] > 40)
-		vga_pan = (crt_regs[0x13] - 40) * 2;
+	unsigned __int64 *line;
+	p = vs.vram;
+	if (vs.crt_regs[0x13] > 40)
+		vga_pan = (vs.crt_regs[0x13] - 40) * 2;
 	else
 		vga_pan = 0;
 	for (i = 0; i < 350; i++)
 	{
-		for (j = 0; j < 640; j += 8)
+		if (!vga_dirty_range(p - vs.vram, 80))
 		{
-			b = *p++;
-			for (k = 0; k < 8; k++)
-			{
-				c = 0;
-				c = (b & 0x80) ? 1 : 0;
-				c |= (b & 0x8000) ? 2 : 0;
-				c |= (b & 0x800000) ? 4 : 0;
-				c |= (b & 0x80000000ul) ? 8 : 0;
-				b <<= 1;
-				set_pixel(k + j, i, c);
-			}
+			p += 80 + vga_pan;
+			continue;
 		}
+		line = (unsigned __int64 *)native_line(i);
+		for (j = 0; j < 80; j++)
+			line[j] = planar_to_chunky(*p++, 0, 1, 2, 3);
 		p += vga_pan;
 	}
 }
 
 void update_screen_vga640x480()
 {
-	int i, j, k;
+	int i, j;
 	const unsigned int *p;
 #if (STM32)
 	unsigned char *s = scr;
+	unsigned __int64 line[80];
+#else
+	unsigned __int64 *line;
 #endif
-	unsigned char c;
-	unsigned long b;
-	p = vram;
+	p = vs.vram;
 	for (i = 0; i < 480; i++)
 	{
-		for (j = 0; j < 640; j += 8)
+		if (!vga_dirty_range(i * 80, 80))
 		{
-			b = *p++;
-			for (k = 0; k < 8; k++)
-			{
-				c = (b & 0x80) ? 4 : 0;
-				c |= (b & 0x8000) ? 2 : 0;
-				c |= (b & 0x800000) ? 1 : 0;
-				c |= (b & 0x80000000ul) ? 8 : 0;
-				b <<= 1;
+			p += 80;
 #if (STM32)
-				*s++ = c;
+			s += 640;
+#endif
+			continue;
+		}
+#if (STM32)
+		for (j = 0; j < 80; j++)
+			line[j] = planar_to_chunky(*p++, 2, 1, 0, 3);
+		memcpy(s, line, 640);
+		s += 640;
 #else
-				set_pixel(k + j, i, c);
+		line = (unsigned __int64 *)native_line(i);
+		for (j = 0; j < 80; j++)
+			line[j] = planar_to_chunky(*p++, 2, 1, 0, 3);
 #endif
+	}
+}
+
+// Same as vga_dirty_range for the linear frame buffer
+static int vbe_dirty_range(unsigned int offset, unsigned int size)
+{
+	unsigned int i, last;
+
+	if (vga_frame_redraw)
+		return 1;
+
+	last = (offset + size - 1) >> VBE_DIRTY_SHIFT;
+	for (i = offset >> VBE_DIRTY_SHIFT; i <= last; i++)
+		if (vs.vbe_page_frame[i & (VBE_DIRTY_PAGES - 1)] == vs.frame)
+			return 1;
+
+	return 0;
+}
+
+// VBE modes are scaled to the screen size
+void update_screen_vbe()
+{
+	int i, j, bpp, bytes;
+	unsigned int xres, yres, pitch, start, offset, x, step, c;
+	const unsigned char *p;
+	unsigned int line[SCREEN_WIDTH];
+
+	xres = vs.vbe_regs[VBE_DISPI_INDEX_XRES];
+	yres = vs.vbe_regs[VBE_DISPI_INDEX_YRES];
+	bpp = vs.vbe_regs[VBE_DISPI_INDEX_BPP];
+	if ((xres == 0) || (yres == 0))
+		return;
+
+	bytes = (bpp + 7) / 8;
+	pitch = vs.vbe_regs[VBE_DISPI_INDEX_VIRT_WIDTH] * bytes;
+	start = vs.vbe_regs[VBE_DISPI_INDEX_Y_OFFSET] * pitch + vs.vbe_regs[VBE_DISPI_INDEX_X_OFFSET] * bytes;
+	step = (xres << 16) / SCREEN_WIDTH;
+
+	// 256 colors go through the native frame like the VGA modes
+	if (bpp == 8)
+	{
+		for (i = 0; i < (int)yres; i++)
+		{
+			offset = start + i * pitch;
+			if (offset + xres > VBE_LFB_SIZE)
+				break;
+			if (vbe_dirty_range(offset, xres))
+				memcpy(native_line(i), VBE_LFB_SNAPSHOT + offset, xres);
+		}
+		return;
+	}
+
+	// Direct color is sampled to the screen
+	for (i = 0; i < SCREEN_HEIGHT; i++)
+	{
+		offset = start + (i * yres / SCREEN_HEIGHT) * pitch;
+		if (offset + xres * bytes > VBE_LFB_SIZE)
+			break;
+		if (!vbe_dirty_range(offset, xres * bytes))
+			continue;
+
+		p = VBE_LFB_SNAPSHOT + offset;
+		for (j = 0, x = 0; j < SCREEN_WIDTH; j++, x += step)
+		{
+			switch (bpp)
+			{
+				case 15:
+					c = *(const unsigned short *)&p[(x >> 16) * 2];
+					c = ((c & 0x7C00) << 9) | ((c & 0x03E0) << 6) | ((c & 0x001F) << 3);
+					line[j] = c | ((c >> 5) & 0x070707);
+					break;
+				case 16:
+					c = *(const unsigned short *)&p[(x >> 16) * 2];
+					c = ((c & 0xF800) << 8) | ((c & 0x07E0) << 5) | ((c & 0x001F) << 3);
+					line[j] = c | ((c >> 5) & 0x070007) | ((c >> 6) & 0x000300);
+					break;
+				case 24:
+					line[j] = p[(x >> 16) * 3] | (p[(x >> 16) * 3 + 1] << 8) | (p[(x >> 16) * 3 + 2] << 16);
+					break;
+				default:
+					line[j] = *(const unsigned int *)&p[(x >> 16) * 4] & 0xFFFFFF;
+					break;
 			}
 		}
+
+		set_line_rgb(i, line, SCREEN_WIDTH);
 	}
 }
 
-void update_screen()
+// Forces the next snapshot to copy the whole video memory and the next frame to be fully redrawn
+void vga_invalidate()
 {
-	vga_lines = 400;
-	switch (vmode)
+	vga_redraw = 1;
+	vga_recopy = 1;
+}
+
+// Called by the CPU thread at vertical retrace while the renderer is idle. Copies the registers
+// and the video memory pages written since the previous snapshot.
+void vga_snapshot()
+{
+	static int last_vmode = -1;
+	static int last_chain4 = -1;
+	static int last_vbe = 0;
+	unsigned int i, redraw, recopy, vbe;
+	unsigned char *c;
+
+	// Register writes only re-render the lines, the memory copy stays limited to dirty pages
+	redraw = vga_redraw || (vmode != last_vmode) || ((sq_regs[4] & 0x08) != last_chain4);
+	recopy = vga_recopy;
+	vga_redraw = 0;
+	vga_recopy = 0;
+	last_vmode = vmode;
+	last_chain4 = sq_regs[4] & 0x08;
+
+	vs.frame++;
+	vs.time = vclock_now();
+	vs.redraw = redraw;
+	vs.vmode = vmode;
+	memcpy(vs.crt_regs, crt_regs, sizeof(vs.crt_regs));
+	memcpy(vs.ac_regs, ac_regs, sizeof(vs.ac_regs));
+	memcpy(vs.sq_regs, sq_regs, sizeof(vs.sq_regs));
+	vs.cga_color_cr = cga_color_cr;
+	vs.cursor_x = ram[0x450];
+	vs.cursor_y = ram[0x451];
+	memcpy(vs.rom_font, &ram[0xFFA6E], sizeof(vs.rom_font));
+
+	// A page offset means a dword in planar modes, a byte of vram in mode 0x14 and a byte
+	// from 0xA0000 otherwise, all three are copied
+	c = (unsigned char *)vram;
+	for (i = 0; i < VGA_DIRTY_PAGES; i++)
+	{
+		if ((vga_dirty[i] != vga_frame) && !recopy)
+			continue;
+		if (i < VGA_SNAPSHOT_PLANAR_PAGES)
+			memcpy(&vs.vram[i << VGA_DIRTY_SHIFT], &vram[i << VGA_DIRTY_SHIFT], sizeof(unsigned int) << VGA_DIRTY_SHIFT);
+		memcpy((unsigned char *)vs.vram + (i << VGA_DIRTY_SHIFT), c + (i << VGA_DIRTY_SHIFT), 1 << VGA_DIRTY_SHIFT);
+		if (i < sizeof(vs.mem) >> VGA_DIRTY_SHIFT)
+			memcpy(&vs.mem[i << VGA_DIRTY_SHIFT], &ram[0xA0000 + (i << VGA_DIRTY_SHIFT)], 1 << VGA_DIRTY_SHIFT);
+		vs.page_frame[i] = vs.frame;
+	}
+
+	// Linear frame buffer pages, the LFB is the same memory as vram. They are only read while
+	// VBE is enabled, so the whole LFB is copied once when it gets enabled.
+	memcpy(vs.vbe_regs, vbe_regs, sizeof(vs.vbe_regs));
+	vs.vbe_mode = vbe_current_mode;
+	vbe = vbe_regs[VBE_DISPI_INDEX_ENABLE] & VBE_DISPI_ENABLED;
+	if (vbe && !last_vbe)
+		recopy = 1;
+	last_vbe = vbe;
+	for (i = 0; vbe && (i < VBE_DIRTY_PAGES); i++)
+	{
+		if ((vbe_dirty[i] != vga_frame) && !recopy)
+			continue;
+		memcpy(VBE_LFB_SNAPSHOT + (i << VBE_DIRTY_SHIFT), c + (i << VBE_DIRTY_SHIFT), 1 << VBE_DIRTY_SHIFT);
+		vs.vbe_page_frame[i] = vs.frame;
+	}
+
+	hw_latch_palette();
+
+	// Writes from now on belong to the next snapshot
+	vga_frame++;
+}
+
+// Draws the last snapshot into the frame buffer, may run on another thread than vga_snapshot
+void vga_render()
+{
+	unsigned int mode, width, height, bpp;
+
+	if (planar_expand[0xFF] == 0)
+		init_planar_expand();
+
+	vga_frame_redraw = vs.redraw;
+
+	vga_frame_info(&mode, &width, &height, &bpp);
+	if (vs.vbe_regs[VBE_DISPI_INDEX_ENABLE] & VBE_DISPI_ENABLED)
+	{
+		// Direct color modes draw the screen themselves
+		native_set_size((bpp == 8) ? width : 0, (bpp == 8) ? height : 0);
+		update_screen_vbe();
+		native_present();
+		return;
+	}
+
+	native_set_size(width, height);
+
+	switch (vs.vmode)
 	{
 		case VMODE_BW40x25:
 		case VMODE_COL40x25:
@@ -923,7 +1164,6 @@ void update_screen()
 			break;
 		case VMODE_BW640x480:
 			update_screen_bw640x480();
-			vga_lines = 480;
 			break;
 		case VMODE_EGA320x200:
 			update_screen_ega320x200();
@@ -933,22 +1173,94 @@ void update_screen()
 			break;
 		case VMODE_EGA640x350:
 			update_screen_ega640x350();
-			vga_lines = 350;
 			break;
 		case VMODE_VGA320x200:
-			if (sq_regs[4] & 0x08)
+			if (vs.sq_regs[4] & 0x08)
 				update_screen_vga320x200();
 			else
 				update_screen_vga320x200x();
 			break;
 		case VMODE_VGA640x480:
 			update_screen_vga640x480();
-			vga_lines = 480;
 			break;
 		case VMODE_VGA640x480x8:
 			update_screen_vga640x480x8();
 			break;
 	}
+
+	native_present();
+}
+
+// Guest mode and resolution of the last snapshot
+void vga_frame_info(unsigned int *mode, unsigned int *width, unsigned int *height, unsigned int *bpp)
+{
+	if (vs.vbe_regs[VBE_DISPI_INDEX_ENABLE] & VBE_DISPI_ENABLED)
+	{
+		*mode = 0x10000u | vs.vbe_mode;
+		*width = vs.vbe_regs[VBE_DISPI_INDEX_XRES];
+		*height = vs.vbe_regs[VBE_DISPI_INDEX_YRES];
+		*bpp = vs.vbe_regs[VBE_DISPI_INDEX_BPP];
+		return;
+	}
+
+	*mode = vs.vmode;
+	*width = 640;
+	*height = 200;
+	*bpp = 4;
+	switch (vs.vmode)
+	{
+		case VMODE_BW40x25:
+		case VMODE_COL40x25:
+			*width = 320;
+			break;
+		case VMODE_BW80x25:
+		case VMODE_COL80x25:
+			*height = 400;
+			break;
+		case VMODE_COL320x200:
+		case VMODE_BW320x200:
+			*width = 320;
+			*bpp = 2;
+			break;
+		case VMODE_BW640x200:
+			*bpp = 1;
+			break;
+		case VMODE_EGA320x200:
+			*width = 320;
+			*bpp = 2;
+			break;
+		case VMODE_EGA320x200D:
+			*width = 320;
+			break;
+		case VMODE_EGA640x350:
+			*height = 350;
+			break;
+		case VMODE_BW640x480:
+			*height = 480;
+			*bpp = 1;
+			break;
+		case VMODE_VGA640x480:
+			*height = 480;
+			break;
+		case VMODE_VGA320x200:
+			*width = 320;
+			*bpp = 8;
+			// Mode X
+			if (!(vs.sq_regs[4] & 0x08))
+				*height = vga_modex_lines();
+			break;
+		case VMODE_VGA640x480x8:
+			*height = 480;
+			*bpp = 8;
+			break;
+	}
+}
+
+// Snapshot and render on the calling thread
+void update_screen()
+{
+	vga_snapshot();
+	vga_render();
 }
 
 // Windows working good
@@ -1008,6 +1320,9 @@ void vga_portwrite(unsigned short port, unsigned char value)
 			{
 				if (ac_index < sizeof(ac_regs))
 					ac_regs[ac_index] = value;
+				// Palette registers only change the DAC colors, see hw_latch_palette
+				if (ac_index >= 16)
+					vga_redraw = 1;
 				if (ac_index < 16)
 				{
 					ega_palette[ac_index] = RGB(
@@ -1037,6 +1352,8 @@ void vga_portwrite(unsigned short port, unsigned char value)
 				sq_regs[sq_index] = value;
 			if (sq_index == 2)
 				vga_plane_mask = bit_fill[value & 0x0F];
+			else
+				vga_redraw = 1;
 			break;
 		case 0x3CE:
 			gc_index = value;
@@ -1087,13 +1404,13 @@ void vga_portwrite(unsigned short port, unsigned char value)
 			switch (vga_pal_index & 3)
 			{
 				case 0:
-					vga_palette[(vga_pal_index & (vga_pal_mask << 2)) | 2] = value << 2;
+					vga_palette[(vga_pal_index & (vga_pal_mask << 2)) | 2] = value << vga_dac_shift;
 					break;
 				case 1:
-					vga_palette[(vga_pal_index & (vga_pal_mask << 2)) | 1] = value << 2;
+					vga_palette[(vga_pal_index & (vga_pal_mask << 2)) | 1] = value << vga_dac_shift;
 					break;
 				case 2:
-					vga_palette[(vga_pal_index & (vga_pal_mask << 2)) | 0] = value << 2;
+					vga_palette[(vga_pal_index & (vga_pal_mask << 2)) | 0] = value << vga_dac_shift;
 					vga_pal_index++;
 					
 					hw_set_palette(
@@ -1101,7 +1418,6 @@ void vga_portwrite(unsigned short port, unsigned char value)
 						vga_palette[(vga_pal_index & (vga_pal_mask << 2)) | 2],
 						vga_palette[(vga_pal_index & (vga_pal_mask << 2)) | 1],
 						vga_palette[(vga_pal_index & (vga_pal_mask << 2)) | 0]);
-					
 					break;
 			}
 			vga_pal_index++;
@@ -1115,9 +1431,13 @@ void vga_portwrite(unsigned short port, unsigned char value)
 		case 0x3D5:
 			if (crt_index < 32)
 				crt_regs[crt_index] = value;
+			// The cursor is tracked by the text renderers
+			if ((crt_index != 0x0E) && (crt_index != 0x0F))
+				vga_redraw = 1;
 			break;
 		case 0x3D9:
 			cga_color_cr = value;
+			vga_redraw = 1;
 			break;
 		case 0x3DC:
 			svga_page = value & 7;
@@ -1125,17 +1445,71 @@ void vga_portwrite(unsigned short port, unsigned char value)
 	}
 }
 
+// Displayed and total scan lines from the CRTC vertical display end and vertical total.
+// Registers the BIOS has not programmed fall back to the standard timing of the mode.
+static void vga_scan_lines(int *lines, int *total)
+{
+	*lines = crt_regs[0x12] + ((crt_regs[7] >> 1) & 0x01) * 256 + ((crt_regs[7] >> 6) & 0x01) * 512 + 1;
+	*total = crt_regs[6] + (crt_regs[7] & 0x01) * 256 + ((crt_regs[7] >> 5) & 0x01) * 512 + 2;
+	if ((crt_regs[6] != 0) && (*lines + VGA_RETRACE_LINES <= *total))
+		return;
+
+	switch (vmode)
+	{
+		case VMODE_BW640x480:
+		case VMODE_VGA640x480:
+			*lines = 480;
+			*total = VGA_LINES_60HZ;
+			break;
+		case VMODE_EGA640x350:
+			*lines = 350;
+			*total = VGA_LINES_70HZ;
+			break;
+		default:
+			*lines = 400;
+			*total = VGA_LINES_70HZ;
+			break;
+	}
+}
+
+// Scan position at the current virtual time. A frame starts with the vertical retrace.
+static unsigned char vga_input_status()
+{
+	unsigned __int64 t;
+	int lines, total, line;
+
+	vga_scan_lines(&lines, &total);
+	t = vclock_now() % ((unsigned __int64)total * VGA_LINE_NS);
+
+	// Bit 3 - vertical retrace, bit 0 - display disabled
+	if (t < VGA_RETRACE_LINES * VGA_LINE_NS)
+		return 0x09;
+
+	line = (int)(t / VGA_LINE_NS) - (total - lines) / 2;
+	if ((line < 0) || (line >= lines) || (t % VGA_LINE_NS >= VGA_HDISPLAY_NS))
+		return 0x01;
+
+	return 0x00;
+}
+
+unsigned __int64 vga_next_retrace()
+{
+	unsigned __int64 frame;
+	int lines, total;
+
+	vga_scan_lines(&lines, &total);
+	frame = (unsigned __int64)total * VGA_LINE_NS;
+	return (vclock_now() / frame + 1) * frame;
+}
+
 unsigned char vga_portread(unsigned short port)
 {
-	static int p3da = 0;
 	switch (port)
 	{
 		case 0x3ba:
 		case 0x3da:
 			ac_index_state = 1;
-			p3da++;
-			return ports[port];
-			return /*ports[port];*/(p3da & 0x04 ? 1 : 0) + (p3da & 0x100 ? 8 : 0);
+			return vga_input_status();
 		case 0x3C1:
 			if (ac_index < sizeof(ac_regs))
 				return ac_regs[ac_index];
@@ -1151,11 +1525,11 @@ unsigned char vga_portread(unsigned short port)
 			{
 				case 0:
 				case 1:
-					return vga_palette[(vga_pal_read_index & (vga_pal_mask << 2)) | 2] >> 2;
+					return vga_palette[(vga_pal_read_index & (vga_pal_mask << 2)) | 2] >> vga_dac_shift;
 				case 2:
-					return vga_palette[(vga_pal_read_index & (vga_pal_mask << 2)) | 1] >> 2;
+					return vga_palette[(vga_pal_read_index & (vga_pal_mask << 2)) | 1] >> vga_dac_shift;
 				case 3:
-					return vga_palette[(vga_pal_read_index++ & (vga_pal_mask << 2)) | 0] >> 2;
+					return vga_palette[(vga_pal_read_index++ & (vga_pal_mask << 2)) | 0] >> vga_dac_shift;
 			}
 			break;
 		case 0x3C4:
@@ -1170,12 +1544,18 @@ unsigned char vga_portread(unsigned short port)
 	return 0;
 }
 
+// Mode 0x14 and VBE modes without LFB: the A0000 window shows a 64K bank of vram
+static inline int vga_banked()
+{
+	return (vmode == 0x14) || (vbe_regs[VBE_DISPI_INDEX_ENABLE] & VBE_DISPI_ENABLED);
+}
+
 unsigned char vga_memread(unsigned int addr)
 {
 	reg_t r;
 	unsigned char *c;
 
-	if (vmode == 0x14)
+	if (vga_banked())
 	{
 		c = (unsigned char *)vram;
 		return c[addr - 0xA0000 + svga_page * 65536u];
@@ -1200,13 +1580,17 @@ void vga_memwrite(unsigned int addr, unsigned char value)
 	unsigned int *p;
 	unsigned char *c;
 	
-	if (vmode == 0x14)
+	if (vga_banked())
 	{
 		c = (unsigned char *)vram;
 		c[addr - 0xA0000 + svga_page * 65536u] = value;
+		VGA_MARK_DIRTY(addr - 0xA0000 + svga_page * 65536u);
+		VBE_MARK_DIRTY(addr - 0xA0000 + svga_page * 65536u);
 		return;
 	}
 
+	VGA_MARK_DIRTY(addr - 0xA0000);
+
 	if ((sq_regs[4] & 0x08) != 0)
 	{
 		ram[addr] = value;
@@ -1240,3 +1624,560 @@ void vga_memwrite(unsigned int addr, unsigned char value)
 	m = vga_plane_mask;
 	*p = (r & m) | (*p & (~m));
 }
+
+// Wide accesses behave like 2 or 4 byte accesses in a row, but the mode and the registers are
+// evaluated once for all bytes (lanes). The latch is loaded from the last byte read.
+
+static unsigned int vga_read_planar(unsigned int offset, int n)
+{
+	const unsigned int *p = &vram[offset];
+	unsigned int v = 0, r, dontcare, compare;
+	int i;
+
+	vga_latch.d = p[n - 1];
+	if (vga_read_mode == 1)
+	{
+		dontcare = bit_fill[vga_color_dontcare];
+		compare = bit_fill[vga_color_compare & vga_color_dontcare];
+		for (i = 0; i < n; i++)
+		{
+			r = (p[i] & dontcare) ^ compare;
+			r |= r >> 16;
+			r |= r >> 8;
+			v |= (~r & 0xFF) << (i * 8);
+		}
+		return v;
+	}
+
+	for (i = 0; i < n; i++)
+		v |= ((p[i] >> (vga_read_map * 8)) & 0xFF) << (i * 8);
+	return v;
+}
+
+static void vga_write_planar(unsigned int offset, unsigned int value, int n)
+{
+	unsigned int *p = &vram[offset];
+	unsigned int v[4], mask[4], r[4], latch, m;
+	int i;
+
+	// Rotate all bytes at once
+	if (vga_rotate && ((vga_write_mode == 0) || (vga_write_mode == 3)))
+		value = ((value >> vga_rotate) & (0x01010101u * (0xFFu >> vga_rotate))) |
+			((value << (8 - vga_rotate)) & (0x01010101u * ((0xFFu << (8 - vga_rotate)) & 0xFFu)));
+
+	latch = vga_latch.d;
+	m = vga_plane_mask;
+
+	switch (vga_write_mode)
+	{
+		case 0:
+			for (i = 0; i < n; i++)
+			{
+				v[i] = (fill_color & fill_mask) | (byte_fill[(value >> (i * 8)) & 0xFF] & (~fill_mask));
+				mask[i] = write_mask;
+			}
+			break;
+		case 1:
+			for (i = 0; i < n; i++)
+				p[i] = (latch & m) | (p[i] & (~m));
+			return;
+		case 2:
+			for (i = 0; i < n; i++)
+			{
+				v[i] = bit_fill[(value >> (i * 8)) & 0x0F];
+				mask[i] = write_mask;
+			}
+			break;
+		default:
+			for (i = 0; i < n; i++)
+			{
+				v[i] = fill_color;
+				mask[i] = byte_fill[(value >> (i * 8)) & 0xFF] & write_mask;
+			}
+			break;
+	}
+
+	// Same as vga_logic
+	switch (vga_logic_op)
+	{
+		case 0:
+			for (i = 0; i < n; i++)
+				r[i] = (v[i] & mask[i]) | (latch & (~mask[i]));
+			break;
+		case 1:
+			for (i = 0; i < n; i++)
+				r[i] = (v[i] | (~mask[i])) & latch;
+			break;
+		case 2:
+			for (i = 0; i < n; i++)
+				r[i] = (v[i] & mask[i]) | latch;
+			break;
+		default:
+			for (i = 0; i < n; i++)
+				r[i] = (v[i] & mask[i]) ^ latch;
+			break;
+	}
+
+	for (i = 0; i < n; i++)
+		p[i] = (r[i] & m) | (p[i] & (~m));
+}
+
+unsigned short vga_memread16(unsigned int addr)
+{
+	unsigned char *c;
+
+	// Crosses the end of the window
+	if ((addr & 0xFFFF) > 0xFFFE)
+		return vga_memread(addr) | (vga_memread(addr + 1) << 8);
+
+	if (vga_banked())
+	{
+		c = (unsigned char *)vram;
+		return *(unsigned short *)&c[addr - 0xA0000 + svga_page * 65536u];
+	}
+
+	if ((sq_regs[4] & 0x08) != 0)
+		return *(unsigned short *)&ram[addr];
+
+	return (unsigned short)vga_read_planar(addr - 0xA0000, 2);
+}
+
+unsigned int vga_memread32(unsigned int addr)
+{
+	unsigned char *c;
+
+	if ((addr & 0xFFFF) > 0xFFFC)
+		return vga_memread16(addr) | (vga_memread16(addr + 2) << 16);
+
+	if (vga_banked())
+	{
+		c = (unsigned char *)vram;
+		return *(unsigned int *)&c[addr - 0xA0000 + svga_page * 65536u];
+	}
+
+	if ((sq_regs[4] & 0x08) != 0)
+		return *(unsigned int *)&ram[addr];
+
+	return vga_read_planar(addr - 0xA0000, 4);
+}
+
+void vga_memwrite16(unsigned int addr, unsigned short value)
+{
+	unsigned char *c;
+	unsigned int offset;
+
+	if ((addr & 0xFFFF) > 0xFFFE)
+	{
+		vga_memwrite(addr, (unsigned char)value);
+		vga_memwrite(addr + 1, value >> 8);
+		return;
+	}
+
+	if (vga_banked())
+	{
+		c = (unsigned char *)vram;
+		offset = addr - 0xA0000 + svga_page * 65536u;
+		*(unsigned short *)&c[offset] = value;
+		VGA_MARK_DIRTY(offset);
+		VGA_MARK_DIRTY(offset + 1);
+		VBE_MARK_DIRTY(offset);
+		VBE_MARK_DIRTY(offset + 1);
+		return;
+	}
+
+	offset = addr - 0xA0000;
+	VGA_MARK_DIRTY(offset);
+	VGA_MARK_DIRTY(offset + 1);
+
+	if ((sq_regs[4] & 0x08) != 0)
+	{
+		*(unsigned short *)&ram[addr] = value;
+		return;
+	}
+
+	vga_write_planar(offset, value, 2);
+}
+
+void vga_memwrite32(unsigned int addr, unsigned int value)
+{
+	unsigned char *c;
+	unsigned int offset;
+
+	if ((addr & 0xFFFF) > 0xFFFC)
+	{
+		vga_memwrite16(addr, (unsigned short)value);
+		vga_memwrite16(addr + 2, value >> 16);
+		return;
+	}
+
+	if (vga_banked())
+	{
+		c = (unsigned char *)vram;
+		offset = addr - 0xA0000 + svga_page * 65536u;
+		*(unsigned int *)&c[offset] = value;
+		VGA_MARK_DIRTY(offset);
+		VGA_MARK_DIRTY(offset + 3);
+		VBE_MARK_DIRTY(offset);
+		VBE_MARK_DIRTY(offset + 3);
+		return;
+	}
+
+	offset = addr - 0xA0000;
+	VGA_MARK_DIRTY(offset);
+	VGA_MARK_DIRTY(offset + 3);
+
+	if ((sq_regs[4] & 0x08) != 0)
+	{
+		*(unsigned int *)&ram[addr] = value;
+		return;
+	}
+
+	vga_write_planar(offset, value, 4);
+}
+
+static int vbe_valid_bpp(int bpp)
+{
+	return (bpp == 8) || (bpp == 15) || (bpp == 16) || (bpp == 24) || (bpp == 32);
+}
+
+// Virtual height and the offsets follow from the virtual width and the memory size
+static void vbe_update_virtual()
+{
+	unsigned int pitch;
+
+	if (vbe_regs[VBE_DISPI_INDEX_VIRT_WIDTH] < vbe_regs[VBE_DISPI_INDEX_XRES])
+		vbe_regs[VBE_DISPI_INDEX_VIRT_WIDTH] = vbe_regs[VBE_DISPI_INDEX_XRES];
+	pitch = vbe_regs[VBE_DISPI_INDEX_VIRT_WIDTH] * ((vbe_regs[VBE_DISPI_INDEX_BPP] + 7) / 8);
+	if (pitch == 0)
+		return;
+	vbe_regs[VBE_DISPI_INDEX_VIRT_HEIGHT] = (unsigned short)(VBE_LFB_SIZE / pitch > 0xFFFF ? 0xFFFF : VBE_LFB_SIZE / pitch);
+}
+
+void vbe_portwrite(unsigned short port, unsigned short value)
+{
+	unsigned short old;
+
+	if (port == VBE_DISPI_IOPORT_INDEX)
+	{
+		vbe_index = value;
+		return;
+	}
+
+	if (vbe_index >= VBE_DISPI_NUM_REGS)
+		return;
+
+	old = vbe_regs[vbe_index];
+	switch (vbe_index)
+	{
+		case VBE_DISPI_INDEX_ID:
+			if ((value >= VBE_DISPI_ID0) && (value <= VBE_DISPI_ID5))
+				vbe_regs[vbe_index] = value;
+			break;
+		case VBE_DISPI_INDEX_XRES:
+		case VBE_DISPI_INDEX_YRES:
+		case VBE_DISPI_INDEX_BPP:
+			// Only while disabled
+			if (vbe_regs[VBE_DISPI_INDEX_ENABLE] & VBE_DISPI_ENABLED)
+				break;
+			if ((vbe_index == VBE_DISPI_INDEX_XRES) && ((value > VBE_DISPI_MAX_XRES) || (value & 7)))
+				break;
+			if ((vbe_index == VBE_DISPI_INDEX_YRES) && (value > VBE_DISPI_MAX_YRES))
+				break;
+			if (vbe_index == VBE_DISPI_INDEX_BPP)
+			{
+				if (value == 0)
+					value = 8;
+				if (!vbe_valid_bpp(value))
+					break;
+			}
+			vbe_regs[vbe_index] = value;
+			break;
+		case VBE_DISPI_INDEX_ENABLE:
+			if ((value & VBE_DISPI_ENABLED) && !(old & VBE_DISPI_ENABLED))
+			{
+				// The mode must fit into the memory
+				if ((unsigned int)vbe_regs[VBE_DISPI_INDEX_XRES] * vbe_regs[VBE_DISPI_INDEX_YRES] *
+					((vbe_regs[VBE_DISPI_INDEX_BPP] + 7) / 8) > VBE_LFB_SIZE)
+					break;
+				vbe_regs[VBE_DISPI_INDEX_VIRT_WIDTH] = vbe_regs[VBE_DISPI_INDEX_XRES];
+				vbe_regs[VBE_DISPI_INDEX_X_OFFSET] = 0;
+				vbe_regs[VBE_DISPI_INDEX_Y_OFFSET] = 0;
+				vbe_regs[VBE_DISPI_INDEX_BANK] = 0;
+				svga_page = 0;
+				vbe_update_virtual();
+				if (!(value & VBE_DISPI_NOCLEARMEM))
+					memset(VBE_LFB, 0, VBE_LFB_SIZE);
+			}
+			vbe_regs[vbe_index] = value;
+			vga_dac_shift = (value & VBE_DISPI_8BIT_DAC) ? 0 : 2;
+			break;
+		case VBE_DISPI_INDEX_BANK:
+			if (value < (VBE_LFB_SIZE >> 16))
+			{
+				vbe_regs[vbe_index] = value;
+				svga_page = value;
+			}
+			break;
+		case VBE_DISPI_INDEX_VIRT_WIDTH:
+			if (value > VBE_DISPI_MAX_XRES * 4)
+				break;
+			vbe_regs[vbe_index] = value;
+			vbe_update_virtual();
+			break;
+		case VBE_DISPI_INDEX_X_OFFSET:
+		case VBE_DISPI_INDEX_Y_OFFSET:
+			vbe_regs[vbe_index] = value;
+			break;
+	}
+
+	vga_redraw = 1;
+}
+
+unsigned short vbe_portread(unsigned short port)
+{
+	if (port == VBE_DISPI_IOPORT_INDEX)
+		return vbe_index;
+
+	if (vbe_index >= VBE_DISPI_NUM_REGS)
+		return 0;
+
+	if (vbe_regs[VBE_DISPI_INDEX_ENABLE] & VBE_DISPI_GETCAPS)
+	{
+		switch (vbe_index)
+		{
+			case VBE_DISPI_INDEX_XRES:
+				return VBE_DISPI_MAX_XRES;
+			case VBE_DISPI_INDEX_YRES:
+				return VBE_DISPI_MAX_YRES;
+			case VBE_DISPI_INDEX_BPP:
+				return VBE_DISPI_MAX_BPP;
+		}
+	}
+
+	return vbe_regs[vbe_index];
+}
+
+// VBE 2.0 BIOS on top of the dispi registers
+
+typedef struct
+{
+	unsigned short mode;
+	unsigned short xres;
+	unsigned short yres;
+	unsigned char bpp;
+} vbe_mode_t;
+
+static const vbe_mode_t vbe_modes[] =
+{
+	{0x100, 640, 400, 8}, {0x101, 640, 480, 8}, {0x103, 800, 600, 8}, {0x105, 1024, 768, 8},
+	{0x10D, 320, 200, 15}, {0x10E, 320, 200, 16}, {0x10F, 320, 200, 24},
+	{0x110, 640, 480, 15}, {0x111, 640, 480, 16}, {0x112, 640, 480, 24},
+	{0x113, 800, 600, 15}, {0x114, 800, 600, 16}, {0x115, 800, 600, 24},
+	{0x116, 1024, 768, 15}, {0x117, 1024, 768, 16}, {0x118, 1024, 768, 24},
+	{0x140, 320, 200, 32}, {0x141, 640, 480, 32}, {0x142, 800, 600, 32}, {0x143, 1024, 768, 32},
+};
+
+#define VBE_NUM_MODES	(sizeof(vbe_modes) / sizeof(vbe_modes[0]))
+
+static const vbe_mode_t *vbe_find_mode(unsigned int mode)
+{
+	unsigned int i;
+
+	for (i = 0; i < VBE_NUM_MODES; i++)
+		if (vbe_modes[i].mode == (mode & 0x1FF))
+			return &vbe_modes[i];
+	return NULL;
+}
+
+// Real mode buffer, NULL if it does not fit into the RAM
+static unsigned char *vbe_buffer(unsigned short seg, unsigned short ofs, unsigned int size)
+{
+	unsigned int addr = seg * 16u + ofs;
+
+	if ((addr >= RAM_SIZE) || (size > RAM_SIZE - addr))
+		return NULL;
+
+	return &ram[addr];
+}
+
+// AX = 4F00h, ES:DI - controller information. The mode list and the OEM string are
+// placed into the reserved area of the block.
+static int vbe_info()
+{
+	unsigned char *p;
+	unsigned int i, size;
+	static const char oem[] = "e86r Bochs VBE";
+
+	p = vbe_buffer(es.value, r.di, 256);
+	if (p == NULL)
+		return 0;
+	size = (memcmp(p, "VBE2", 4) == 0) ? 512 : 256;
+	if (vbe_buffer(es.value, r.di, size) == NULL)
+		return 0;
+
+	memset(p, 0, size);
+	memcpy(p, "VESA", 4);
+	*(unsigned short *)&p[0x04] = 0x0200;
+	// DAC can be switched to 8 bits
+	*(unsigned int *)&p[0x0A] = 0x00000001;
+	*(unsigned short *)&p[0x12] = VBE_LFB_SIZE >> 16;
+
+	for (i = 0; i < VBE_NUM_MODES; i++)
+		*(unsigned short *)&p[0x22 + i * 2] = vbe_modes[i].mode;
+	*(unsigned short *)&p[0x22 + i * 2] = 0xFFFF;
+	*(unsigned short *)&p[0x0E] = r.di + 0x22;
+	*(unsigned short *)&p[0x10] = es.value;
+
+	memcpy(&p[0x80], oem, sizeof(oem));
+	*(unsigned short *)&p[0x06] = r.di + 0x80;
+	*(unsigned short *)&p[0x08] = es.value;
+	return 1;
+}
+
+// AX = 4F01h, CX - mode, ES:DI - mode information
+static int vbe_mode_info()
+{
+	unsigned char *p;
+	const vbe_mode_t *m;
+	unsigned int bytes;
+
+	m = vbe_find_mode(r.cx);
+	p = vbe_buffer(es.value, r.di, 256);
+	if ((m == NULL) || (p == NULL))
+		return 0;
+
+	bytes = (m->bpp + 7) / 8;
+	memset(p, 0, 256);
+	// Supported, color graphics, no VGA compatible windowing restrictions, LFB
+	*(unsigned short *)&p[0x00] = 0x009B;
+	p[0x02] = 0x07;
+	*(unsigned short *)&p[0x04] = 64;
+	*(unsigned short *)&p[0x06] = 64;
+	*(unsigned short *)&p[0x08] = 0xA000;
+	*(unsigned short *)&p[0x10] = m->xres * bytes;
+	*(unsigned short *)&p[0x12] = m->xres;
+	*(unsigned short *)&p[0x14] = m->yres;
+	p[0x16] = 8;
+	p[0x17] = 16;
+	p[0x18] = 1;
+	p[0x19] = m->bpp;
+	p[0x1A] = 1;
+	// Packed pixel or direct color
+	p[0x1B] = (m->bpp == 8) ? 4 : 6;
+	p[0x1D] = (unsigned char)(VBE_LFB_SIZE / (m->xres * bytes * m->yres) - 1);
+	p[0x1E] = 1;
+	switch (m->bpp)
+	{
+		case 15:
+			p[0x1F] = 5; p[0x20] = 10; p[0x21] = 5; p[0x22] = 5; p[0x23] = 5; p[0x24] = 0; p[0x25] = 1; p[0x26] = 15;
+			break;
+		case 16:
+			p[0x1F] = 5; p[0x20] = 11; p[0x21] = 6; p[0x22] = 5; p[0x23] = 5; p[0x24] = 0;
+			break;
+		case 24:
+		case 32:
+			p[0x1F] = 8; p[0x20] = 16; p[0x21] = 8; p[0x22] = 8; p[0x23] = 8; p[0x24] = 0;
+			if (m->bpp == 32)
+			{
+				p[0x25] = 8;
+				p[0x26] = 24;
+			}
+			break;
+	}
+	*(unsigned int *)&p[0x28] = VBE_LFB_ADDRESS;
+	return 1;
+}
+
+// AX = 4F02h, BX - mode, bit 14 - LFB, bit 15 - keep the memory
+static int vbe_set_mode()
+{
+	const vbe_mode_t *m;
+
+	m = vbe_find_mode(r.bx);
+	if (m == NULL)
+		return 0;
+
+	vbe_portwrite(VBE_DISPI_IOPORT_INDEX, VBE_DISPI_INDEX_ENABLE);
+	vbe_portwrite(VBE_DISPI_IOPORT_DATA, 0);
+	vbe_portwrite(VBE_DISPI_IOPORT_INDEX, VBE_DISPI_INDEX_XRES);
+	vbe_portwrite(VBE_DISPI_IOPORT_DATA, m->xres);
+	vbe_portwrite(VBE_DISPI_IOPORT_INDEX, VBE_DISPI_INDEX_YRES);
+	vbe_portwrite(VBE_DISPI_IOPORT_DATA, m->yres);
+	vbe_portwrite(VBE_DISPI_IOPORT_INDEX, VBE_DISPI_INDEX_BPP);
+	vbe_portwrite(VBE_DISPI_IOPORT_DATA, m->bpp);
+	vbe_portwrite(VBE_DISPI_IOPORT_INDEX, VBE_DISPI_INDEX_ENABLE);
+	vbe_portwrite(VBE_DISPI_IOPORT_DATA, VBE_DISPI_ENABLED | ((r.bx & 0x4000) ? VBE_DISPI_LFB_ENABLED : 0) |
+		((r.bx & 0x8000) ? VBE_DISPI_NOCLEARMEM : 0));
+	vbe_current_mode = r.bx & 0x41FF;
+	return 1;
+}
+
+// Free ROM space between the BIOS and ROM Basic: MOV AX, 004Fh / IRET
+#define VBE_VGA_RETURN	0xF2000
+static const unsigned char vbe_vga_return[] = {0xB8, 0x4F, 0x00, 0xCF};
+
+int bios_vbe()
+{
+	switch (r.al)
+	{
+		case 0x00:
+			r.ax = vbe_info() ? 0x004F : 0x014F;
+			return 1;
+		case 0x01:
+			r.ax = vbe_mode_info() ? 0x004F : 0x014F;
+			return 1;
+		case 0x02:
+			if (r.bx & 0x100)
+			{
+				r.ax = vbe_set_mode() ? 0x004F : 0x014F;
+				return 1;
+			}
+			// VGA modes are set by the VGA BIOS as AH = 00h. It returns through a stub that
+			// reports success as AX = 004Fh to the caller.
+			vbe_portwrite(VBE_DISPI_IOPORT_INDEX, VBE_DISPI_INDEX_ENABLE);
+			vbe_portwrite(VBE_DISPI_IOPORT_DATA, 0);
+			vbe_current_mode = r.bx & 0x7F;
+			memcpy(&ram[VBE_VGA_RETURN], vbe_vga_return, sizeof(vbe_vga_return));
+			push16(r.flags);
+			push16(cs.value);
+			push16(r.ip);
+			set_selector(&cs, VBE_VGA_RETURN >> 4, 1);
+			r.eip = VBE_VGA_RETURN & 0x0F;
+			r.ax = (r.bx & 0x7F) | ((r.bx & 0x8000) ? 0x80 : 0);
+			return 0;
+		case 0x03:
+			r.bx = (vbe_regs[VBE_DISPI_INDEX_ENABLE] & VBE_DISPI_ENABLED) ? vbe_current_mode : vmode;
+			r.ax = 0x004F;
+			return 1;
+		case 0x05:
+			// Window A only, BH = 0 - set, 1 - get
+			if (r.bl != 0)
+			{
+				r.ax = 0x014F;
+				return 1;
+			}
+			vbe_portwrite(VBE_DISPI_IOPORT_INDEX, VBE_DISPI_INDEX_BANK);
+			if (r.bh == 0)
+				vbe_portwrite(VBE_DISPI_IOPORT_DATA, r.dx);
+			else
+				r.dx = vbe_portread(VBE_DISPI_IOPORT_DATA);
+			r.ax = 0x004F;
+			return 1;
+		case 0x08:
+			// BL = 0 to set, 1 to get, BH = 6 or 8 bits per DAC primary
+			vbe_portwrite(VBE_DISPI_IOPORT_INDEX, VBE_DISPI_INDEX_ENABLE);
+			if (r.bl == 0)
+			{
+				if (r.bh >= 8)
+					vbe_portwrite(VBE_DISPI_IOPORT_DATA, vbe_regs[VBE_DISPI_INDEX_ENABLE] | VBE_DISPI_8BIT_DAC | VBE_DISPI_NOCLEARMEM);
+				else
+					vbe_portwrite(VBE_DISPI_IOPORT_DATA, (vbe_regs[VBE_DISPI_INDEX_ENABLE] & ~VBE_DISPI_8BIT_DAC) | VBE_DISPI_NOCLEARMEM);
+			}
+			r.bh = vga_dac_shift ? 6 : 8;
+			r.ax = 0x004F;
+			return 1;
+	}
+
+	r.ax = 0x0100 | 0x4F;
+	return 1;
+}
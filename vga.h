@@ -6,21 +6,111 @@
 
 extern int vmode;
 
-// Should be at least 512KB!
+// Dirty tracking. Video memory (offsets from 0xA0000, dwords in planar modes) is split into
+// pages of 1 << VGA_DIRTY_SHIFT, every write stamps its page with the current frame number.
+#define VGA_DIRTY_SHIFT		8
+#define VGA_DIRTY_PAGES		(0x80000 >> VGA_DIRTY_SHIFT)
+
+#define VGA_MARK_DIRTY(offset)	(vga_dirty[((offset) >> VGA_DIRTY_SHIFT) & (VGA_DIRTY_PAGES - 1)] = vga_frame)
+
+extern unsigned int vga_dirty[VGA_DIRTY_PAGES];
+extern unsigned int vga_frame;
+
+// Bochs VBE (dispi) interface, 16-bit index and data ports
+#define VBE_DISPI_IOPORT_INDEX		0x1CE
+#define VBE_DISPI_IOPORT_DATA		0x1CF
+
+#define VBE_DISPI_INDEX_ID			0x00
+#define VBE_DISPI_INDEX_XRES		0x01
+#define VBE_DISPI_INDEX_YRES		0x02
+#define VBE_DISPI_INDEX_BPP			0x03
+#define VBE_DISPI_INDEX_ENABLE		0x04
+#define VBE_DISPI_INDEX_BANK		0x05
+#define VBE_DISPI_INDEX_VIRT_WIDTH	0x06
+#define VBE_DISPI_INDEX_VIRT_HEIGHT	0x07
+#define VBE_DISPI_INDEX_X_OFFSET	0x08
+#define VBE_DISPI_INDEX_Y_OFFSET	0x09
+#define VBE_DISPI_INDEX_VIDEO_MEMORY_64K	0x0A
+#define VBE_DISPI_NUM_REGS			0x0B
+
+#define VBE_DISPI_ID0				0xB0C0
+#define VBE_DISPI_ID5				0xB0C5
+
+#define VBE_DISPI_ENABLED			0x01
+#define VBE_DISPI_GETCAPS			0x02
+#define VBE_DISPI_8BIT_DAC			0x20
+#define VBE_DISPI_LFB_ENABLED		0x40
+#define VBE_DISPI_NOCLEARMEM		0x80
+
+#define VBE_DISPI_MAX_XRES			1024
+#define VBE_DISPI_MAX_YRES			768
+#define VBE_DISPI_MAX_BPP			32
+
+// Linear frame buffer, vram mapped at a fixed physical address like on Bochs. Guest accesses
+// are plain memory accesses, pages are stamped for the renderer like the VGA memory.
+#define VBE_LFB_ADDRESS				0xE0000000u
+#define VBE_LFB_SIZE				0x400000u
+#define VBE_LFB						((unsigned char *)vram)
+
+#define VBE_DIRTY_SHIFT				12
+#define VBE_DIRTY_PAGES				(VBE_LFB_SIZE >> VBE_DIRTY_SHIFT)
+
+#define VBE_MARK_DIRTY(offset)	(vbe_dirty[((offset) >> VBE_DIRTY_SHIFT) & (VBE_DIRTY_PAGES - 1)] = vga_frame)
+
+extern unsigned int vbe_dirty[VBE_DIRTY_PAGES];
+
+// Should be at least 512KB, VBE_LFB_SIZE for the VBE modes!
 extern unsigned int *vram;
 
+// vga_snapshot runs on the CPU thread, vga_render draws the snapshot. update_screen does both.
+void vga_snapshot();
+void vga_render();
 void update_screen();
+void vga_invalidate();
+
+// Renderers draw palette indices at the guest resolution. native_present converts the scanlines
+// written since its last call (all of them after a palette change) and scales them to the screen.
+#define NATIVE_MAX_WIDTH	VBE_DISPI_MAX_XRES
+#define NATIVE_MAX_HEIGHT	VBE_DISPI_MAX_YRES
+
+void native_set_size(int width, int height);
+// Scanline y of the native frame, marks it changed
+unsigned char *native_line(int y);
+void native_present();
+// Whole screen line of 0x00RRGGBB pixels starting at x = 0, bypasses the native frame
+void set_line_rgb(int y, const unsigned int *pixels, int count);
 
-void set_pixel_2x2(int x, int y, unsigned int color);
-void set_pixel_2x1(int x, int y, unsigned int color);
-void set_pixel_1x2(int x, int y, unsigned int color);
-void set_pixel(int x, int y, unsigned int color);
+// Text mode glyphs in the native frame. The cursor replaces the last row.
+#define GLYPH_FONT_8X8		0
+#define GLYPH_FONT_8X16		1
+
+void set_glyph(int x, int y, int font, const unsigned char *font_data, int ch, int attr, int cursor);
+// Must be called when a font changes
+void glyph_cache_flush();
 
 void vga_portwrite(unsigned short port, unsigned char value);
 unsigned char vga_portread(unsigned short port);
 unsigned char vga_memread(unsigned int addr);
 void vga_memwrite(unsigned int addr, unsigned char value);
+unsigned short vga_memread16(unsigned int addr);
+unsigned int vga_memread32(unsigned int addr);
+void vga_memwrite16(unsigned int addr, unsigned short value);
+void vga_memwrite32(unsigned int addr, unsigned int value);
+
+void vbe_portwrite(unsigned short port, unsigned short value);
+unsigned short vbe_portread(unsigned short port);
+// INT 10h AX = 4Fxxh in real mode, returns 0 if the call goes on to the VGA BIOS
+int bios_vbe();
+
+// Virtual time of the next vertical retrace start, ns
+unsigned __int64 vga_next_retrace();
+
+// Guest mode of the last snapshot (BIOS mode number, 10000h + VBE mode number in VBE modes),
+// its resolution and bits per pixel
+void vga_frame_info(unsigned int *mode, unsigned int *width, unsigned int *height, unsigned int *bpp);
 
 void hw_set_palette(unsigned char index, unsigned char r, unsigned char g, unsigned char b);
+// Makes the palette set so far visible to the renderers, called by vga_snapshot
+void hw_latch_palette();
 
 #endif